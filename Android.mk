@@ -9,7 +9,9 @@ commands_recovery_local_path := $(LOCAL_PATH)
 
 LOCAL_SRC_FILES := \
     recovery.c \
+    recovery_log.c \
     bootloader.c \
+    dirlist.c \
     install.c \
     roots.c \
     ui.c \
@@ -123,7 +125,7 @@ LOCAL_CFLAGS += -DUSE_F2FS
 LOCAL_STATIC_LIBRARIES += libmake_f2fs libfsck_f2fs libfibmap_f2fs
 endif
 
-LOCAL_STATIC_LIBRARIES += libminzip libunz libmincrypt
+LOCAL_STATIC_LIBRARIES += libminzip libunz libmincrypt libminelf
 
 LOCAL_STATIC_LIBRARIES += libminizip libminadbd libedify libbusybox libmkyaffs2image libunyaffs liberase_image libdump_image libflash_image
 LOCAL_LDFLAGS += -Wl,--no-fatal-warnings
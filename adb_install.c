@@ -106,6 +106,7 @@ apply_from_adb() {
               "to the device with \"adb sideload <filename>\"...\n\n");
 
     struct sideload_waiter_data data;
+    fflush(stdout);
     if ((data.child = fork()) == 0) {
         execl("/sbin/recovery", "recovery", "adbd", NULL);
         _exit(-1);
@@ -16,14 +16,17 @@
 
 #include <errno.h>
 #include <libgen.h>
+#include <malloc.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/statfs.h>
 #include <sys/types.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <linux/fs.h>
 
 #include "mincrypt/sha.h"
 #include "applypatch.h"
@@ -355,6 +358,172 @@ int SaveFileContents(const char* filename, const FileContents* file) {
     return 0;
 }
 
+// eMMC partitions are written and verified in chunks of this size; only
+// chunks whose read-back hash doesn't match are rewritten.
+#define EMMC_CHUNK_SIZE (1 << 20)
+
+// Alignment of the verify buffer, enough for O_DIRECT on any block
+// device we're likely to see.
+#define EMMC_DIRECT_ALIGN 4096
+
+static int WriteChunk(int fd, const unsigned char* data, size_t offset,
+                      size_t len, const char* partition) {
+    if (lseek(fd, offset, SEEK_SET) == (off_t)-1) {
+        printf("failed to seek %s to %d: %s\n",
+               partition, offset, strerror(errno));
+        return -1;
+    }
+    size_t so_far = 0;
+    while (so_far < len) {
+        ssize_t written = write(fd, data+offset+so_far, len-so_far);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            printf("failed write writing to %s (%s)\n",
+                   partition, strerror(errno));
+            return -1;
+        }
+        so_far += written;
+    }
+    return 0;
+}
+
+// Read back [offset, offset+len) through 'fd' and compare its SHA-1 with
+// 'expected'.  When 'direct' is set, 'fd' was opened with O_DIRECT, so the
+// read is rounded up to a whole number of aligned blocks.  Returns 0 on a
+// match, 1 on a mismatch, -1 on a read error.
+static int VerifyChunk(int fd, int direct, unsigned char* buffer,
+                       size_t offset, size_t len, const uint8_t* expected,
+                       const char* partition) {
+    size_t to_read = len;
+    if (direct) {
+        to_read = (len + EMMC_DIRECT_ALIGN - 1) & ~(EMMC_DIRECT_ALIGN - 1);
+    }
+    if (lseek(fd, offset, SEEK_SET) == (off_t)-1) {
+        printf("failed to seek %s to %d: %s\n",
+               partition, offset, strerror(errno));
+        return -1;
+    }
+
+    size_t so_far = 0;
+    while (so_far < len) {
+        ssize_t read_count = read(fd, buffer+so_far, to_read-so_far);
+        if (read_count < 0) {
+            if (errno == EINTR) continue;
+            printf("verify read error %s at %d: %s\n",
+                   partition, offset+so_far, strerror(errno));
+            return -1;
+        }
+        if (read_count == 0) {
+            printf("short verify read %s at %d: %d %d\n",
+                   partition, offset, so_far, len);
+            return -1;
+        }
+        so_far += read_count;
+    }
+
+    uint8_t digest[SHA_DIGEST_SIZE];
+    SHA_hash(buffer, len, digest);
+    return memcmp(digest, expected, SHA_DIGEST_SIZE) == 0 ? 0 : 1;
+}
+
+// Write 'data' to the start of the eMMC partition open on 'fd' and read it
+// back to make sure it landed.  The read-back goes through a separate
+// O_DIRECT descriptor so it bypasses the page cache without having to drop
+// every cache in the system; if the device doesn't support O_DIRECT we
+// flush just this device's buffers instead.  Chunks that fail
+// verification are rewritten individually.  Return 0 on success.
+static int WriteAndVerifyEmmc(int fd, unsigned char* data, size_t len,
+                              const char* partition) {
+    size_t chunks = (len + EMMC_CHUNK_SIZE - 1) / EMMC_CHUNK_SIZE;
+    uint8_t* chunk_sha1 = malloc(chunks * SHA_DIGEST_SIZE);
+    unsigned char* pending = malloc(chunks);
+    unsigned char* buffer = memalign(EMMC_DIRECT_ALIGN, EMMC_CHUNK_SIZE);
+    int vfd = -1;
+    int success = 0;
+    size_t c;
+
+    if (chunk_sha1 == NULL || pending == NULL || buffer == NULL) {
+        printf("failed to allocate verify buffers for %s\n", partition);
+        goto done;
+    }
+
+    for (c = 0; c < chunks; ++c) {
+        size_t offset = c * EMMC_CHUNK_SIZE;
+        size_t n = len - offset;
+        if (n > EMMC_CHUNK_SIZE) n = EMMC_CHUNK_SIZE;
+        SHA_hash(data+offset, n, chunk_sha1 + c*SHA_DIGEST_SIZE);
+        pending[c] = 1;
+    }
+
+    int direct = 1;
+    vfd = open(partition, O_RDONLY | O_DIRECT);
+    if (vfd < 0) {
+        direct = 0;
+        vfd = open(partition, O_RDONLY);
+        if (vfd < 0) {
+            printf("failed to open %s for verify: %s\n",
+                   partition, strerror(errno));
+            goto done;
+        }
+    }
+
+    int attempt;
+    for (attempt = 0; attempt < 2; ++attempt) {
+        for (c = 0; c < chunks; ++c) {
+            if (!pending[c]) continue;
+            size_t offset = c * EMMC_CHUNK_SIZE;
+            size_t n = len - offset;
+            if (n > EMMC_CHUNK_SIZE) n = EMMC_CHUNK_SIZE;
+            if (WriteChunk(fd, data, offset, n, partition) != 0) goto done;
+        }
+        fsync(fd);
+
+        if (!direct) {
+            // make sure the verification read comes from the device and
+            // not from the buffer cache.
+            if (ioctl(vfd, BLKFLSBUF, 0) != 0) {
+                printf("failed to flush buffers of %s: %s\n",
+                       partition, strerror(errno));
+            }
+        }
+
+        size_t mismatched = 0;
+        for (c = 0; c < chunks; ++c) {
+            if (!pending[c]) continue;
+            size_t offset = c * EMMC_CHUNK_SIZE;
+            size_t n = len - offset;
+            if (n > EMMC_CHUNK_SIZE) n = EMMC_CHUNK_SIZE;
+            int r = VerifyChunk(vfd, direct, buffer, offset, n,
+                                chunk_sha1 + c*SHA_DIGEST_SIZE, partition);
+            if (r < 0) goto done;
+            if (r == 0) {
+                pending[c] = 0;
+            } else {
+                printf("verification failed for %d bytes at %d\n", n, offset);
+                ++mismatched;
+            }
+        }
+
+        if (mismatched == 0) {
+            printf("verification read succeeded (attempt %d%s)\n",
+                   attempt+1, direct ? ", direct" : "");
+            success = 1;
+            break;
+        }
+    }
+
+    if (!success) {
+        printf("failed to verify after all attempts\n");
+    }
+
+done:
+    if (vfd >= 0) close(vfd);
+    free(buffer);
+    free(pending);
+    free(chunk_sha1);
+    return success ? 0 : -1;
+}
+
 // Write a memory buffer to 'target' partition, a string of the form
 // "MTD:<partition>[:...]" or "EMMC:<partition_device>:".  Return 0 on
 // success.
@@ -422,95 +591,19 @@ int WriteToPartition(unsigned char* data, size_t len,
 
         case EMMC:
         {
-            size_t start = 0;
-            int success = 0;
             int fd = open(partition, O_RDWR);
             if (fd < 0) {
                 printf("failed to open %s: %s\n", partition, strerror(errno));
                 return -1;
             }
-            int attempt;
-
-            for (attempt = 0; attempt < 2; ++attempt) {
-                lseek(fd, start, SEEK_SET);
-                while (start < len) {
-                    size_t to_write = len - start;
-                    if (to_write > 1<<20) to_write = 1<<20;
-
-                    ssize_t written = write(fd, data+start, to_write);
-                    if (written < 0) {
-                        if (errno == EINTR) {
-                            written = 0;
-                        } else {
-                            printf("failed write writing to %s (%s)\n",
-                                   partition, strerror(errno));
-                            return -1;
-                        }
-                    }
-                    start += written;
-                }
-                fsync(fd);
-
-                // drop caches so our subsequent verification read
-                // won't just be reading the cache.
-                sync();
-                int dc = open("/proc/sys/vm/drop_caches", O_WRONLY);
-                write(dc, "3\n", 2);
-                close(dc);
-                sleep(1);
-                printf("  caches dropped\n");
-
-                // verify
-                lseek(fd, 0, SEEK_SET);
-                unsigned char buffer[4096];
-                start = len;
-                size_t p;
-                for (p = 0; p < len; p += sizeof(buffer)) {
-                    size_t to_read = len - p;
-                    if (to_read > sizeof(buffer)) to_read = sizeof(buffer);
-
-                    size_t so_far = 0;
-                    while (so_far < to_read) {
-                        ssize_t read_count = read(fd, buffer+so_far, to_read-so_far);
-                        if (read_count < 0) {
-                            if (errno == EINTR) {
-                                read_count = 0;
-                            } else {
-                                printf("verify read error %s at %d: %s\n",
-                                       partition, p, strerror(errno));
-                                return -1;
-                            }
-                        }
-                        if ((size_t)read_count < to_read) {
-                            printf("short verify read %s at %d: %d %d %s\n",
-                                   partition, p, read_count, to_read, strerror(errno));
-                        }
-                        so_far += read_count;
-                    }
-
-                    if (memcmp(buffer, data+p, to_read)) {
-                        printf("verification failed starting at %d\n", p);
-                        start = p;
-                        break;
-                    }
-                }
-
-                if (start == len) {
-                    printf("verification read succeeded (attempt %d)\n", attempt+1);
-                    success = true;
-                    break;
-                }
-            }
-
-            if (!success) {
-                printf("failed to verify after all attempts\n");
-                return -1;
-            }
-
+            int result = WriteAndVerifyEmmc(fd, data, len, partition);
             if (close(fd) != 0) {
                 printf("error closing %s (%s)\n", partition, strerror(errno));
                 return -1;
             }
+            if (result != 0) {
+                return -1;
+            }
             sync();
             break;
         }
@@ -21,6 +21,8 @@
 #include <fs_mgr.h>
 #include <sys/stat.h>
 
+#include "recovery_log.h"
+
 #define MENU_TEXT_COLOR 0, 191, 255, 255
 #define NORMAL_TEXT_COLOR 200, 200, 200, 255
 #define HEADER_TEXT_COLOR 0, 247, 255, 255
@@ -148,16 +150,10 @@ void ui_show_indeterminate_progress();
 void ui_reset_progress();
 
 #define LOGE(...) ui_print("E:" __VA_ARGS__)
-#define LOGW(...) fprintf(stdout, "W:" __VA_ARGS__)
-#define LOGI(...) fprintf(stdout, "I:" __VA_ARGS__)
-
-#if 0
-#define LOGV(...) fprintf(stdout, "V:" __VA_ARGS__)
-#define LOGD(...) fprintf(stdout, "D:" __VA_ARGS__)
-#else
-#define LOGV(...) do {} while (0)
-#define LOGD(...) do {} while (0)
-#endif
+#define LOGW(...) log_printf(LOG_LEVEL_WARN, "W:" __VA_ARGS__)
+#define LOGI(...) log_printf(LOG_LEVEL_INFO, "I:" __VA_ARGS__)
+#define LOGV(...) log_printf(LOG_LEVEL_VERBOSE, "V:" __VA_ARGS__)
+#define LOGD(...) log_printf(LOG_LEVEL_DEBUG, "D:" __VA_ARGS__)
 
 #define STRINGIFY(x) #x
 #define EXPAND(x) STRINGIFY(x)
@@ -12,10 +12,15 @@ else
 	CARLIV_RES_LOC := $(commands_recovery_local_path)/devices/generic
 endif
 	
+# The PNGs are also decoded once here into res/images.atlas, which
+# libminui maps instead of running libpng on every image at startup.
 CARLIV_RES_GEN := $(intermediates)/carliv
-$(CARLIV_RES_GEN):
+CARLIV_MKATLAS := $(HOST_OUT_EXECUTABLES)/minui_mkatlas$(HOST_EXECUTABLE_SUFFIX)
+$(CARLIV_RES_GEN): PRIVATE_PIXEL_FORMAT := $(subst ",,$(TARGET_RECOVERY_PIXEL_FORMAT))
+$(CARLIV_RES_GEN): $(CARLIV_MKATLAS)
 	mkdir -p $(TARGET_RECOVERY_ROOT_OUT)/res/images/
 	cp -fr $(CARLIV_RES_LOC)/* $(TARGET_RECOVERY_ROOT_OUT)/res/images
+	$(CARLIV_MKATLAS) --format "$(PRIVATE_PIXEL_FORMAT)" $(CARLIV_RES_LOC) $(TARGET_RECOVERY_ROOT_OUT)/res/images.atlas
 
 LOCAL_GENERATED_SOURCES := $(CARLIV_RES_GEN)
 LOCAL_SRC_FILES := carliv $(CARLIV_RES_GEN)
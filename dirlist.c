@@ -0,0 +1,238 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "dirlist.h"
+
+// Listings of the last few directories visited.  Browsing in and out of
+// a folder on a slow sdcard then costs one stat instead of a readdir and
+// a sort.  The cache holds its own reference, so a listing replaced here
+// lives on until the menu showing it lets go.
+#define DIRLIST_CACHE_SIZE 8
+
+typedef struct {
+    DirList list;       // first, so a DirList* can be cast back
+    char* path;
+    int refs;
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+    time_t ctime;
+    off_t size;
+    time_t listed;
+} CachedList;
+
+static CachedList* cache[DIRLIST_CACHE_SIZE];
+
+int natural_compare(const char* a, const char* b) {
+    while (*a && *b) {
+        if (isdigit((unsigned char) *a) && isdigit((unsigned char) *b)) {
+            // compare the numbers by length once leading zeros are gone,
+            // then digit by digit
+            while (*a == '0') a++;
+            while (*b == '0') b++;
+            const char* ea = a;
+            const char* eb = b;
+            while (isdigit((unsigned char) *ea)) ea++;
+            while (isdigit((unsigned char) *eb)) eb++;
+            if (ea - a != eb - b)
+                return (ea - a) - (eb - b);
+            for (; a < ea; a++, b++) {
+                if (*a != *b)
+                    return *a - *b;
+            }
+            continue;
+        }
+        int ca = tolower((unsigned char) *a);
+        int cb = tolower((unsigned char) *b);
+        if (ca != cb)
+            return ca - cb;
+        a++;
+        b++;
+    }
+    return (unsigned char) *a - (unsigned char) *b;
+}
+
+static int compare_names(const void* a, const void* b) {
+    const char* sa = *(const char**) a;
+    const char* sb = *(const char**) b;
+    int r = natural_compare(sa, sb);
+    return r != 0 ? r : strcmp(sa, sb);
+}
+
+static int append(char*** array, int* count, int* alloc, char* name) {
+    if (name == NULL)
+        return -1;
+    if (*count + 1 >= *alloc) {
+        int n = *alloc ? *alloc * 2 : 32;
+        char** grown = realloc(*array, n * sizeof(char*));
+        if (grown == NULL) {
+            free(name);
+            return -1;
+        }
+        *array = grown;
+        *alloc = n;
+    }
+    (*array)[(*count)++] = name;
+    (*array)[*count] = NULL;
+    return 0;
+}
+
+static void free_list(CachedList* c) {
+    int i;
+    for (i = 0; i < c->list.num_dirs; i++)
+        free(c->list.dirs[i]);
+    for (i = 0; i < c->list.num_files; i++)
+        free(c->list.files[i]);
+    free(c->list.dirs);
+    free(c->list.files);
+    free(c->path);
+    free(c);
+}
+
+static CachedList* read_list(const char* path, const struct stat* st) {
+    int dir_alloc = 0, file_alloc = 0;
+    char full[PATH_MAX];
+    size_t len = strlen(path);
+
+    if (len + 2 >= sizeof(full)) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    DIR* d = opendir(path);
+    if (d == NULL)
+        return NULL;
+
+    CachedList* c = calloc(1, sizeof(*c));
+    if (c == NULL || (c->path = strdup(path)) == NULL) {
+        free(c);
+        closedir(d);
+        return NULL;
+    }
+    c->refs = 1;
+    c->dev = st->st_dev;
+    c->ino = st->st_ino;
+    c->mtime = st->st_mtime;
+    c->ctime = st->st_ctime;
+    c->size = st->st_size;
+    c->listed = time(NULL);
+
+    memcpy(full, path, len);
+    if (len == 0 || full[len - 1] != '/')
+        full[len++] = '/';
+
+    struct dirent* de;
+    int failed = 0;
+    while (!failed && (de = readdir(d)) != NULL) {
+        const char* name = de->d_name;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+            continue;
+
+        int is_dir = de->d_type == DT_DIR;
+        if (de->d_type == DT_UNKNOWN) {
+            // some filesystems don't fill in d_type
+            struct stat info;
+            strlcpy(full + len, name, sizeof(full) - len);
+            is_dir = lstat(full, &info) == 0 && S_ISDIR(info.st_mode);
+        }
+
+        if (is_dir) {
+            size_t n = strlen(name);
+            char* entry = malloc(n + 2);
+            if (entry != NULL) {
+                memcpy(entry, name, n);
+                entry[n] = '/';
+                entry[n + 1] = '\0';
+            }
+            failed = append(&c->list.dirs, &c->list.num_dirs, &dir_alloc, entry);
+        } else {
+            failed = append(&c->list.files, &c->list.num_files, &file_alloc, strdup(name));
+        }
+    }
+    closedir(d);
+    if (failed) {
+        free_list(c);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    qsort(c->list.dirs, c->list.num_dirs, sizeof(char*), compare_names);
+    qsort(c->list.files, c->list.num_files, sizeof(char*), compare_names);
+    return c;
+}
+
+static int unchanged(const CachedList* c, const struct stat* st) {
+    // mtime has one second resolution on some filesystems, so a listing
+    // made in the same second as the last change may already be stale
+    return c->dev == st->st_dev && c->ino == st->st_ino &&
+           c->mtime == st->st_mtime && c->ctime == st->st_ctime &&
+           c->size == st->st_size && c->listed > st->st_mtime;
+}
+
+const DirList* dirlist_open(const char* path) {
+    struct stat st;
+    int i;
+
+    if (stat(path, &st) < 0)
+        return NULL;
+    if (!S_ISDIR(st.st_mode)) {
+        errno = ENOTDIR;
+        return NULL;
+    }
+
+    for (i = 0; i < DIRLIST_CACHE_SIZE; i++) {
+        CachedList* c = cache[i];
+        if (c == NULL || strcmp(c->path, path) != 0)
+            continue;
+        if (unchanged(c, &st)) {
+            // move to the front so the least recent one gets evicted
+            memmove(cache + 1, cache, i * sizeof(cache[0]));
+            cache[0] = c;
+            c->refs++;
+            return &c->list;
+        }
+        dirlist_release(&c->list);
+        memmove(cache + i, cache + i + 1, (DIRLIST_CACHE_SIZE - i - 1) * sizeof(cache[0]));
+        cache[DIRLIST_CACHE_SIZE - 1] = NULL;
+        break;
+    }
+
+    CachedList* c = read_list(path, &st);
+    if (c == NULL)
+        return NULL;
+    if (cache[DIRLIST_CACHE_SIZE - 1] != NULL)
+        dirlist_release(&cache[DIRLIST_CACHE_SIZE - 1]->list);
+    memmove(cache + 1, cache, (DIRLIST_CACHE_SIZE - 1) * sizeof(cache[0]));
+    cache[0] = c;
+    c->refs++;
+    return &c->list;
+}
+
+void dirlist_release(const DirList* list) {
+    if (list == NULL)
+        return;
+    CachedList* c = (CachedList*) list;
+    if (--c->refs == 0)
+        free_list(c);
+}
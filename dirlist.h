@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RECOVERY_DIRLIST_H
+#define RECOVERY_DIRLIST_H
+
+// Listing of one directory for the file browsers, split into
+// subdirectories and everything else and sorted in natural order
+// ("rom2.zip" before "rom10.zip").  "." and ".." are left out; hidden
+// entries are kept for the caller to filter.
+typedef struct {
+    int num_dirs;
+    char** dirs;        // names with a trailing '/'
+    int num_files;
+    char** files;
+} DirList;
+
+// Returns the listing of path, reusing the one from the last visit if
+// the directory hasn't changed since.  The result stays valid until
+// released, even if the directory changes meanwhile.  Returns NULL with
+// errno set if path can't be read.
+const DirList* dirlist_open(const char* path);
+void dirlist_release(const DirList* list);
+
+// strcmp() that compares runs of digits by value and ignores case.
+int natural_compare(const char* a, const char* b);
+
+#endif  // RECOVERY_DIRLIST_H
@@ -5,7 +5,8 @@ LOCAL_PATH := $(call my-dir)
 edify_src_files := \
 	lexer.l \
 	parser.y \
-	expr.c
+	expr.c \
+	bytecode.c
 
 # "-x c" forces the lex/yacc files to be compiled as c;
 # the build system otherwise forces them to be c++.
@@ -26,6 +27,20 @@ LOCAL_YACCFLAGS := -v
 
 include $(BUILD_HOST_EXECUTABLE)
 
+#
+# Build the host-side script compiler
+#
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+		$(edify_src_files) \
+		edifyc.c
+
+LOCAL_CFLAGS := $(edify_cflags)
+LOCAL_MODULE := edifyc
+
+include $(BUILD_HOST_EXECUTABLE)
+
 #
 # Build the device-side library
 #
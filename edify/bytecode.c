@@ -0,0 +1,514 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bytecode.h"
+#include "expr.h"
+
+// -----------------------------------------------------------------
+//   constant folding
+// -----------------------------------------------------------------
+
+static Expr* FoldedLiteral(const Expr* e, const char* value) {
+    YYLTYPE loc;
+    loc.start = e->start;
+    loc.end = e->end;
+    char* copy = strdup(value);
+    if (copy == NULL) return NULL;
+    return BuildLiteral(copy, loc);
+}
+
+// e replaced by one of its operands, which takes over e's source span.
+static Expr* Replace(Expr* e, Expr* with) {
+    with->start = e->start;
+    with->end = e->end;
+    return with;
+}
+
+static Expr* FoldNode(Expr* e) {
+    int i;
+    for (i = 0; i < e->argc; ++i) {
+        if (!IsLiteral(e->argv[i])) break;
+    }
+    bool all_literal = i == e->argc;
+    bool first_literal = e->argc > 0 && IsLiteral(e->argv[0]);
+    Expr* folded = e;
+
+    if (e->fn == ConcatFn && all_literal) {
+        size_t length = 0;
+        for (i = 0; i < e->argc; ++i) {
+            length += strlen(e->argv[i]->name);
+        }
+        char* buffer = malloc(length + 1);
+        if (buffer == NULL) return e;
+        size_t p = 0;
+        for (i = 0; i < e->argc; ++i) {
+            size_t n = strlen(e->argv[i]->name);
+            memcpy(buffer + p, e->argv[i]->name, n);
+            p += n;
+        }
+        buffer[p] = '\0';
+        folded = FoldedLiteral(e, buffer);
+        free(buffer);
+    } else if ((e->fn == EqualityFn || e->fn == InequalityFn) && e->argc == 2 && all_literal) {
+        bool equal = strcmp(e->argv[0]->name, e->argv[1]->name) == 0;
+        folded = FoldedLiteral(e, equal == (e->fn == EqualityFn) ? "t" : "");
+    } else if (e->fn == SubstringFn && e->argc == 2 && all_literal) {
+        bool found = strstr(e->argv[1]->name, e->argv[0]->name) != NULL;
+        folded = FoldedLiteral(e, found ? "t" : "");
+    } else if (e->fn == LogicalNotFn && e->argc == 1 && all_literal) {
+        folded = FoldedLiteral(e, e->argv[0]->name[0] ? "" : "t");
+    } else if (e->fn == LogicalAndFn && e->argc == 2 && first_literal) {
+        folded = Replace(e, e->argv[0]->name[0] ? e->argv[1] : e->argv[0]);
+    } else if (e->fn == LogicalOrFn && e->argc == 2 && first_literal) {
+        folded = Replace(e, e->argv[0]->name[0] ? e->argv[0] : e->argv[1]);
+    } else if (e->fn == IfElseFn && (e->argc == 2 || e->argc == 3) && first_literal) {
+        if (e->argv[0]->name[0]) {
+            folded = Replace(e, e->argv[1]);
+        } else {
+            folded = Replace(e, e->argc == 3 ? e->argv[2] : e->argv[0]);
+        }
+    } else if (e->fn == SequenceFn && e->argc == 2 && first_literal) {
+        folded = e->argv[1];
+    }
+    return folded != NULL ? folded : e;
+}
+
+Expr* FoldConstants(Expr* root) {
+    // Post order without recursion: the ';' chain of a long script is as
+    // deep as the script has statements.
+    int size = 64;
+    int top = 0;
+    struct { Expr** slot; int visited; } *stack = malloc(size * sizeof(*stack));
+    if (stack == NULL) return root;
+
+    stack[top].slot = &root;
+    stack[top].visited = 0;
+    ++top;
+    while (top > 0) {
+        Expr** slot = stack[top-1].slot;
+        Expr* e = *slot;
+        if (!stack[top-1].visited && e->argc > 0) {
+            stack[top-1].visited = 1;
+            if (top + e->argc > size) {
+                size = (top + e->argc) * 2;
+                void* grown = realloc(stack, size * sizeof(*stack));
+                if (grown == NULL) break;
+                stack = grown;
+            }
+            int i;
+            for (i = e->argc - 1; i >= 0; --i) {
+                stack[top].slot = &e->argv[i];
+                stack[top].visited = 0;
+                ++top;
+            }
+            continue;
+        }
+        --top;
+        *slot = FoldNode(e);
+    }
+    free(stack);
+    return root;
+}
+
+// -----------------------------------------------------------------
+//   the statement loop
+// -----------------------------------------------------------------
+
+Program* BuildProgram(Expr* root) {
+    Program* program = malloc(sizeof(Program));
+    int stack_size = 64;
+    int top = 0;
+    Expr** stack = malloc(stack_size * sizeof(Expr*));
+    int size = 64;
+    if (program == NULL || stack == NULL) goto fail;
+    program->count = 0;
+    program->stmts = malloc(size * sizeof(Expr*));
+    if (program->stmts == NULL) goto fail;
+
+    stack[top++] = root;
+    while (top > 0) {
+        Expr* e = stack[--top];
+        if (e->fn == SequenceFn && e->argc == 2) {
+            if (top + 2 > stack_size) {
+                stack_size *= 2;
+                Expr** grown = realloc(stack, stack_size * sizeof(Expr*));
+                if (grown == NULL) goto fail;
+                stack = grown;
+            }
+            stack[top++] = e->argv[1];
+            stack[top++] = e->argv[0];
+            continue;
+        }
+        if (program->count == size) {
+            size *= 2;
+            Expr** grown = realloc(program->stmts, size * sizeof(Expr*));
+            if (grown == NULL) goto fail;
+            program->stmts = grown;
+        }
+        program->stmts[program->count++] = e;
+    }
+    free(stack);
+    return program;
+
+  fail:
+    fprintf(stderr, "out of memory building program\n");
+    if (program != NULL) free(program->stmts);
+    free(program);
+    free(stack);
+    return NULL;
+}
+
+static long long NowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+Value* RunProgram(State* state, const Program* program,
+                  StatementTimer timer, void* cookie) {
+    Value* v = NULL;
+    int i;
+    for (i = 0; i < program->count; ++i) {
+        Expr* stmt = program->stmts[i];
+        long long start = timer != NULL ? NowNs() : 0;
+        bool last = i == program->count - 1;
+        // Only the last value is handed back, so the others don't need
+        // the private copy EvaluateValue() makes of shared values.
+        v = last ? EvaluateValue(state, stmt)
+                 : stmt->fn(stmt->name, state, stmt->argc, stmt->argv);
+        if (timer != NULL) {
+            timer(stmt, NowNs() - start, v != NULL, cookie);
+        }
+        if (v == NULL) {
+            return NULL;
+        }
+        if (!last) {
+            FreeValue(v);
+        }
+    }
+    return v;
+}
+
+// -----------------------------------------------------------------
+//   bytecode
+// -----------------------------------------------------------------
+
+#define BYTECODE_MAGIC "EDIFYBC1"
+#define BYTECODE_MAGIC_LEN 8
+
+enum { NODE_LITERAL = 0, NODE_CALL = 1, NODE_OPERATOR = 2 };
+
+// The operators of the grammar; Build() names them all "(operator)".
+static const Function kOperators[] = {
+    SequenceFn, ConcatFn, EqualityFn, InequalityFn,
+    LogicalAndFn, LogicalOrFn, LogicalNotFn, IfElseFn,
+};
+#define NUM_OPERATORS (sizeof(kOperators) / sizeof(kOperators[0]))
+
+static uint64_t HashScript(const char* script, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+    size_t i;
+    for (i = 0; i < len; ++i) {
+        h ^= (unsigned char) script[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static void PutVarint(FILE* f, uint64_t v) {
+    while (v >= 0x80) {
+        fputc((int) (v & 0x7f) | 0x80, f);
+        v >>= 7;
+    }
+    fputc((int) v, f);
+}
+
+// Strings in the order they are first used, with a hash table on the
+// side so the writer stays linear on big scripts.
+typedef struct {
+    const char** strings;
+    int count;
+    int alloc;
+    int* table;
+    int table_size;
+} StringTable;
+
+static int StringIndex(StringTable* t, const char* s) {
+    if (t->count * 2 >= t->table_size) {
+        int size = t->table_size ? t->table_size * 2 : 1024;
+        int* table = malloc(size * sizeof(int));
+        if (table == NULL) return -1;
+        memset(table, -1, size * sizeof(int));
+        int i;
+        for (i = 0; i < t->count; ++i) {
+            uint64_t h = HashScript(t->strings[i], strlen(t->strings[i])) & (size - 1);
+            while (table[h] >= 0) h = (h + 1) & (size - 1);
+            table[h] = i;
+        }
+        free(t->table);
+        t->table = table;
+        t->table_size = size;
+    }
+    uint64_t h = HashScript(s, strlen(s)) & (t->table_size - 1);
+    while (t->table[h] >= 0) {
+        if (strcmp(t->strings[t->table[h]], s) == 0) {
+            return t->table[h];
+        }
+        h = (h + 1) & (t->table_size - 1);
+    }
+    if (t->count == t->alloc) {
+        t->alloc = t->alloc ? t->alloc * 2 : 256;
+        const char** grown = realloc(t->strings, t->alloc * sizeof(char*));
+        if (grown == NULL) return -1;
+        t->strings = grown;
+    }
+    t->strings[t->count] = s;
+    t->table[h] = t->count;
+    return t->count++;
+}
+
+typedef struct {
+    int kind;
+    int index;
+    const Expr* e;
+} Node;
+
+int WriteBytecode(FILE* f, Expr* root, const char* script, size_t script_len) {
+    StringTable strings;
+    memset(&strings, 0, sizeof(strings));
+    int count = 0;
+    int alloc = 256;
+    Node* nodes = malloc(alloc * sizeof(Node));
+    int stack_size = 64;
+    int top = 0;
+    struct { Expr* e; int visited; } *stack = malloc(stack_size * sizeof(*stack));
+    int ret = -1;
+    int i;
+
+    if (nodes == NULL || stack == NULL) goto done;
+
+    // Post order, so the reader can rebuild the tree with a stack.
+    stack[top].e = root;
+    stack[top].visited = 0;
+    ++top;
+    while (top > 0) {
+        Expr* e = stack[top-1].e;
+        if (!stack[top-1].visited && e->argc > 0) {
+            stack[top-1].visited = 1;
+            if (top + e->argc > stack_size) {
+                stack_size = (top + e->argc) * 2;
+                void* grown = realloc(stack, stack_size * sizeof(*stack));
+                if (grown == NULL) goto done;
+                stack = grown;
+            }
+            for (i = e->argc - 1; i >= 0; --i) {
+                stack[top].e = e->argv[i];
+                stack[top].visited = 0;
+                ++top;
+            }
+            continue;
+        }
+        --top;
+
+        if (count == alloc) {
+            alloc *= 2;
+            Node* grown = realloc(nodes, alloc * sizeof(Node));
+            if (grown == NULL) goto done;
+            nodes = grown;
+        }
+        Node* n = &nodes[count++];
+        n->e = e;
+        if (IsLiteral(e)) {
+            n->kind = NODE_LITERAL;
+            n->index = StringIndex(&strings, e->name);
+        } else if (strcmp(e->name, "(operator)") == 0) {
+            n->kind = NODE_OPERATOR;
+            for (n->index = 0; n->index < (int) NUM_OPERATORS; ++n->index) {
+                if (kOperators[n->index] == e->fn) break;
+            }
+            if (n->index == (int) NUM_OPERATORS) {
+                fprintf(stderr, "unknown operator in script\n");
+                goto done;
+            }
+        } else {
+            n->kind = NODE_CALL;
+            n->index = StringIndex(&strings, e->name);
+        }
+        if (n->index < 0) goto done;
+    }
+
+    fwrite(BYTECODE_MAGIC, 1, BYTECODE_MAGIC_LEN, f);
+    PutVarint(f, script_len);
+    PutVarint(f, HashScript(script, script_len));
+    PutVarint(f, strings.count);
+    for (i = 0; i < strings.count; ++i) {
+        size_t len = strlen(strings.strings[i]);
+        PutVarint(f, len);
+        fwrite(strings.strings[i], 1, len, f);
+    }
+    PutVarint(f, count);
+    for (i = 0; i < count; ++i) {
+        const Expr* e = nodes[i].e;
+        PutVarint(f, nodes[i].kind);
+        PutVarint(f, nodes[i].index);
+        if (nodes[i].kind != NODE_LITERAL) {
+            PutVarint(f, e->argc);
+        }
+        PutVarint(f, e->start);
+        PutVarint(f, e->end - e->start);
+    }
+    ret = ferror(f) ? -1 : 0;
+
+  done:
+    free(nodes);
+    free(stack);
+    free(strings.strings);
+    free(strings.table);
+    return ret;
+}
+
+typedef struct {
+    const unsigned char* p;
+    const unsigned char* end;
+    bool bad;
+} Reader;
+
+static uint64_t GetVarint(Reader* r) {
+    uint64_t v = 0;
+    int shift = 0;
+    while (r->p < r->end && shift < 64) {
+        unsigned char c = *r->p++;
+        v |= (uint64_t) (c & 0x7f) << shift;
+        if (!(c & 0x80)) return v;
+        shift += 7;
+    }
+    r->bad = true;
+    return 0;
+}
+
+Expr* ReadBytecode(const unsigned char* data, size_t size,
+                   const char* script, size_t script_len) {
+    Reader r = { data, data + size, false };
+    char** strings = NULL;
+    Expr** stack = NULL;
+    uint64_t nstrings = 0;
+    uint64_t i;
+    int top = 0;
+    Expr* root = NULL;
+
+    if (size < BYTECODE_MAGIC_LEN || memcmp(data, BYTECODE_MAGIC, BYTECODE_MAGIC_LEN) != 0) {
+        fprintf(stderr, "bytecode: bad magic\n");
+        return NULL;
+    }
+    r.p += BYTECODE_MAGIC_LEN;
+    if (GetVarint(&r) != script_len || GetVarint(&r) != HashScript(script, script_len)) {
+        fprintf(stderr, "bytecode: compiled from a different script\n");
+        return NULL;
+    }
+
+    nstrings = GetVarint(&r);
+    if (r.bad || nstrings > size) goto bad;
+    strings = calloc(nstrings ? nstrings : 1, sizeof(char*));
+    if (strings == NULL) goto bad;
+    for (i = 0; i < nstrings; ++i) {
+        uint64_t len = GetVarint(&r);
+        if (r.bad || len > (uint64_t) (r.end - r.p)) goto bad;
+        strings[i] = malloc(len + 1);
+        if (strings[i] == NULL) goto bad;
+        memcpy(strings[i], r.p, len);
+        strings[i][len] = '\0';
+        r.p += len;
+    }
+
+    uint64_t nnodes = GetVarint(&r);
+    if (r.bad || nnodes == 0 || nnodes > size) goto bad;
+    stack = malloc(nnodes * sizeof(Expr*));
+    if (stack == NULL) goto bad;
+    for (i = 0; i < nnodes; ++i) {
+        uint64_t kind = GetVarint(&r);
+        uint64_t index = GetVarint(&r);
+        uint64_t argc = kind == NODE_LITERAL ? 0 : GetVarint(&r);
+        YYLTYPE loc;
+        uint64_t start = GetVarint(&r);
+        uint64_t len = GetVarint(&r);
+        if (r.bad || argc > (uint64_t) top || start + len > script_len) goto bad;
+        loc.start = start;
+        loc.end = start + len;
+
+        Expr* e;
+        if (kind == NODE_LITERAL) {
+            if (index >= nstrings) goto bad;
+            char* copy = strdup(strings[index]);
+            if (copy == NULL) goto bad;
+            e = BuildLiteral(copy, loc);
+        } else {
+            Function fn;
+            const char* name;
+            if (kind == NODE_OPERATOR && index < NUM_OPERATORS) {
+                fn = kOperators[index];
+                name = "(operator)";
+            } else if (kind == NODE_CALL && index < nstrings) {
+                name = strings[index];
+                fn = FindFunction(name);
+                if (fn == NULL) {
+                    fprintf(stderr, "bytecode: unknown function \"%s\"\n", name);
+                    goto fail;
+                }
+                // the tree keeps the name
+                strings[index] = strdup(name);
+                if (strings[index] == NULL) goto bad;
+            } else {
+                goto bad;
+            }
+            e = malloc(sizeof(Expr));
+            if (e == NULL) goto bad;
+            e->fn = fn;
+            e->name = (char*) name;
+            e->argc = argc;
+            e->argv = argc > 0 ? malloc(argc * sizeof(Expr*)) : NULL;
+            if (argc > 0 && e->argv == NULL) goto bad;
+            top -= argc;
+            if (argc > 0) memcpy(e->argv, stack + top, argc * sizeof(Expr*));
+            e->start = loc.start;
+            e->end = loc.end;
+        }
+        stack[top++] = e;
+    }
+    if (top != 1 || r.p != r.end) goto bad;
+    root = stack[0];
+    goto done;
+
+  bad:
+    fprintf(stderr, "bytecode: malformed\n");
+  fail:
+    // nodes built so far are left to leak, like a failed parse's
+    root = NULL;
+  done:
+    if (strings != NULL) {
+        for (i = 0; i < nstrings; ++i) {
+            free(strings[i]);
+        }
+    }
+    free(strings);
+    free(stack);
+    return root;
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _EDIFY_BYTECODE_H
+#define _EDIFY_BYTECODE_H
+
+#include <stdio.h>
+
+#include "expr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Replace the parts of the tree at root that only depend on literals
+// with the literal they evaluate to: concatenation, ==, != and
+// is_substring of literals, ! of a literal, and &&, ||, ifelse and ';'
+// whose first operand is a literal.  A folded node keeps the source
+// span of the expression it replaces, so assert() messages don't
+// change.  Returns the new root.
+Expr* FoldConstants(Expr* root);
+
+// A script ready to run: the top-level ';' chain flattened into a list
+// of statements, so running it is a loop instead of a recursion as deep
+// as the script is long.
+typedef struct {
+    int count;
+    Expr** stmts;
+} Program;
+
+Program* BuildProgram(Expr* root);
+
+// Called after each top-level statement with how long it took, and
+// whether it returned a value (false means the script aborts).
+typedef void (*StatementTimer)(const Expr* stmt, long long elapsed_ns,
+                               int ok, void* cookie);
+
+// Run the statements in order and return the value of the last one,
+// like EvaluateValue() on the whole script.  timer may be NULL.
+Value* RunProgram(State* state, const Program* program,
+                  StatementTimer timer, void* cookie);
+
+// The bytecode form of a script is its parse tree in post order, with
+// the literals and function names in a table of their own, all in
+// variable-length integers.  It is tied to the text it was compiled
+// from, which is still needed for error messages, by its length and
+// hash.
+
+// Write the tree at root, compiled from script, to f.  Returns 0 on
+// success.
+int WriteBytecode(FILE* f, Expr* root, const char* script, size_t script_len);
+
+// Rebuild the tree from bytecode, resolving function names against the
+// registered functions.  Returns NULL (having printed why) if the data
+// is malformed, doesn't belong to script, or calls a function that
+// isn't registered; the caller should parse the text instead.
+Expr* ReadBytecode(const unsigned char* data, size_t size,
+                   const char* script, size_t script_len);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // _EDIFY_BYTECODE_H
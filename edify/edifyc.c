@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// edifyc compiles an updater-script to the bytecode the updater loads
+// from updater-script.edc.  Functions other than the builtins are only
+// known to the updater, so their names are checked when it loads the
+// bytecode, not here.
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bytecode.h"
+#include "expr.h"
+#include "parser.h"
+
+extern int yyparse(Expr** root, int* error_count);
+
+int main(int argc, char** argv) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <updater-script> <output>\n", argv[0]);
+        return 1;
+    }
+
+    FILE* f = fopen(argv[1], "rb");
+    if (f == NULL) {
+        fprintf(stderr, "%s: %s: %s\n", argv[0], argv[1], strerror(errno));
+        return 1;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    rewind(f);
+    char* script = malloc(size + 1);
+    if (script == NULL || fread(script, 1, size, f) != (size_t) size) {
+        fprintf(stderr, "%s: failed to read %s\n", argv[0], argv[1]);
+        return 1;
+    }
+    script[size] = '\0';
+    fclose(f);
+
+    RegisterBuiltins();
+    FinishRegistration();
+    AllowUnknownFunctions(true);
+
+    Expr* root;
+    int error_count = 0;
+    yy_scan_bytes(script, size);
+    int error = yyparse(&root, &error_count);
+    if (error != 0 || error_count > 0) {
+        fprintf(stderr, "%s: %d parse errors\n", argv[1], error_count);
+        return 1;
+    }
+    root = FoldConstants(root);
+
+    f = fopen(argv[2], "wb");
+    if (f == NULL) {
+        fprintf(stderr, "%s: %s: %s\n", argv[0], argv[2], strerror(errno));
+        return 1;
+    }
+    if (WriteBytecode(f, root, script, size) != 0 || fclose(f) != 0) {
+        fprintf(stderr, "%s: failed to write %s\n", argv[0], argv[2]);
+        unlink(argv[2]);
+        return 1;
+    }
+    free(script);
+    return 0;
+}
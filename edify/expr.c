@@ -16,6 +16,8 @@
 
 #include <string.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
@@ -32,21 +34,185 @@ int BooleanString(const char* s) {
     return s[0] != '\0';
 }
 
-char* Evaluate(State* state, Expr* expr) {
-    Value* v = expr->fn(expr->name, state, expr->argc, expr->argv);
-    if (v == NULL) return NULL;
-    if (v->type != VAL_STRING) {
+// -----------------------------------------------------------------
+//   shared values
+// -----------------------------------------------------------------
+
+// Literals are interned when the script is parsed: each distinct string
+// gets one Value, allocated with its data from an arena that lives as
+// long as the parse trees do (which is until the process exits).
+// Evaluating a literal returns that Value, and the builtins return the
+// two static ones below for booleans, so conditions built from
+// literals, comparisons and the logical operators don't allocate.
+// FreeValue() leaves all of these alone.  Code outside this file only
+// ever sees them through the Function it calls; EvaluateValue(),
+// Evaluate() and the Read*Args() helpers hand out private copies, so
+// callers can keep treating results as theirs.
+
+static Value kTrueValue = { VAL_STRING, 1, (char*) "t" };
+static Value kEmptyValue = { VAL_STRING, 0, (char*) "" };
+
+#define ARENA_CHUNK_SIZE 65536
+
+typedef struct ArenaChunk {
+    struct ArenaChunk* next;
+    size_t used;
+    size_t size;
+    char data[];
+} ArenaChunk;
+
+static ArenaChunk* arena = NULL;
+
+static void* ArenaAlloc(size_t size) {
+    size = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+    if (arena == NULL || arena->size - arena->used < size) {
+        size_t chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        ArenaChunk* c = malloc(sizeof(ArenaChunk) + chunk_size);
+        if (c == NULL) return NULL;
+        c->used = 0;
+        c->size = chunk_size;
+        if (arena != NULL && size > ARENA_CHUNK_SIZE) {
+            // an oversized chunk is used up at once; keep filling the
+            // current one
+            c->next = arena->next;
+            arena->next = c;
+        } else {
+            c->next = arena;
+            arena = c;
+        }
+        c->used = size;
+        return c->data;
+    }
+    void* p = arena->data + arena->used;
+    arena->used += size;
+    return p;
+}
+
+static bool IsSharedValue(const Value* v) {
+    if (v == &kTrueValue || v == &kEmptyValue) return true;
+    const ArenaChunk* c;
+    for (c = arena; c != NULL; c = c->next) {
+        if ((const char*) v >= c->data && (const char*) v < c->data + c->used) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static Value* BoolValue(bool b) {
+    return b ? &kTrueValue : &kEmptyValue;
+}
+
+typedef struct {
+    Value value;
+    char data[];
+} InternedLiteral;
+
+static InternedLiteral** intern_table = NULL;
+static size_t intern_size = 0;     // always a power of two
+static size_t intern_count = 0;
+
+static uint32_t HashString(const char* s) {
+    uint32_t h = 2166136261u;
+    while (*s) {
+        h ^= (unsigned char) *s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static bool GrowInternTable() {
+    size_t size = intern_size ? intern_size * 2 : 256;
+    InternedLiteral** table = calloc(size, sizeof(InternedLiteral*));
+    if (table == NULL) return false;
+    size_t i;
+    for (i = 0; i < intern_size; ++i) {
+        InternedLiteral* lit = intern_table[i];
+        if (lit == NULL) continue;
+        size_t h = HashString(lit->data) & (size - 1);
+        while (table[h] != NULL) h = (h + 1) & (size - 1);
+        table[h] = lit;
+    }
+    free(intern_table);
+    intern_table = table;
+    intern_size = size;
+    return true;
+}
+
+static InternedLiteral* Intern(const char* str) {
+    if (intern_count * 2 >= intern_size && !GrowInternTable()) {
+        return NULL;
+    }
+    size_t h = HashString(str) & (intern_size - 1);
+    while (intern_table[h] != NULL) {
+        if (strcmp(intern_table[h]->data, str) == 0) {
+            return intern_table[h];
+        }
+        h = (h + 1) & (intern_size - 1);
+    }
+
+    size_t len = strlen(str);
+    InternedLiteral* lit = ArenaAlloc(sizeof(InternedLiteral) + len + 1);
+    if (lit == NULL) return NULL;
+    memcpy(lit->data, str, len + 1);
+    lit->value.type = VAL_STRING;
+    lit->value.size = len;
+    lit->value.data = lit->data;
+    intern_table[h] = lit;
+    ++intern_count;
+    return lit;
+}
+
+static Value* CopyValue(const Value* v) {
+    Value* copy = malloc(sizeof(Value));
+    if (copy == NULL) return NULL;
+    size_t size = v->size < 0 ? 0 : v->size;
+    copy->type = v->type;
+    copy->size = v->size;
+    copy->data = malloc(size + 1);
+    if (copy->data == NULL) {
+        free(copy);
+        return NULL;
+    }
+    if (v->data != NULL) memcpy(copy->data, v->data, size);
+    copy->data[size] = '\0';
+    return copy;
+}
+
+// Evaluates expr for the builtins, which only look at the result: a
+// shared Value comes back as is.  Release it with FreeValue().
+static Value* EvaluateShared(State* state, Expr* expr) {
+    return expr->fn(expr->name, state, expr->argc, expr->argv);
+}
+
+// EvaluateShared() for a string result.
+static Value* EvaluateString(State* state, Expr* expr) {
+    Value* v = EvaluateShared(state, expr);
+    if (v != NULL && v->type != VAL_STRING) {
         ErrorAbort(state, "expecting string, got value type %d", v->type);
         FreeValue(v);
         return NULL;
     }
+    return v;
+}
+
+char* Evaluate(State* state, Expr* expr) {
+    Value* v = EvaluateString(state, expr);
+    if (v == NULL) return NULL;
+    if (IsSharedValue(v)) {
+        return strdup(v->data);
+    }
     char* result = v->data;
     free(v);
     return result;
 }
 
 Value* EvaluateValue(State* state, Expr* expr) {
-    return expr->fn(expr->name, state, expr->argc, expr->argv);
+    Value* v = EvaluateShared(state, expr);
+    if (v != NULL && IsSharedValue(v)) {
+        return CopyValue(v);
+    }
+    return v;
 }
 
 Value* StringValue(char* str) {
@@ -59,43 +225,49 @@ Value* StringValue(char* str) {
 }
 
 void FreeValue(Value* v) {
-    if (v == NULL) return;
+    if (v == NULL || IsSharedValue(v)) return;
     free(v->data);
     free(v);
 }
 
 Value* ConcatFn(const char* name, State* state, int argc, Expr* argv[]) {
     if (argc == 0) {
-        return StringValue(strdup(""));
+        return BoolValue(false);
+    }
+    if (argc == 1) {
+        return EvaluateString(state, argv[0]);
     }
-    char** strings = malloc(argc * sizeof(char*));
+    Value* small[8];
+    Value** strings = argc <= 8 ? small : malloc(argc * sizeof(Value*));
     int i;
     for (i = 0; i < argc; ++i) {
         strings[i] = NULL;
     }
     char* result = NULL;
-    int length = 0;
+    size_t length = 0;
     for (i = 0; i < argc; ++i) {
-        strings[i] = Evaluate(state, argv[i]);
+        strings[i] = EvaluateString(state, argv[i]);
         if (strings[i] == NULL) {
             goto done;
         }
-        length += strlen(strings[i]);
+        length += strings[i]->size;
     }
 
     result = malloc(length+1);
-    int p = 0;
+    size_t p = 0;
     for (i = 0; i < argc; ++i) {
-        strcpy(result+p, strings[i]);
-        p += strlen(strings[i]);
+        memcpy(result+p, strings[i]->data, strings[i]->size);
+        p += strings[i]->size;
     }
     result[p] = '\0';
 
   done:
     for (i = 0; i < argc; ++i) {
-        free(strings[i]);
+        FreeValue(strings[i]);
+    }
+    if (strings != small) {
+        free(strings);
     }
-    free(strings);
     return StringValue(result);
 }
 
@@ -105,20 +277,20 @@ Value* IfElseFn(const char* name, State* state, int argc, Expr* argv[]) {
         state->errmsg = strdup("ifelse expects 2 or 3 arguments");
         return NULL;
     }
-    char* cond = Evaluate(state, argv[0]);
+    Value* cond = EvaluateString(state, argv[0]);
     if (cond == NULL) {
         return NULL;
     }
 
-    if (BooleanString(cond) == true) {
-        free(cond);
-        return EvaluateValue(state, argv[1]);
+    if (BooleanString(cond->data) == true) {
+        FreeValue(cond);
+        return EvaluateShared(state, argv[1]);
     } else {
         if (argc == 3) {
-            free(cond);
-            return EvaluateValue(state, argv[2]);
+            FreeValue(cond);
+            return EvaluateShared(state, argv[2]);
         } else {
-            return StringValue(cond);
+            return cond;
         }
     }
 }
@@ -140,12 +312,12 @@ Value* AbortFn(const char* name, State* state, int argc, Expr* argv[]) {
 Value* AssertFn(const char* name, State* state, int argc, Expr* argv[]) {
     int i;
     for (i = 0; i < argc; ++i) {
-        char* v = Evaluate(state, argv[i]);
+        Value* v = EvaluateString(state, argv[i]);
         if (v == NULL) {
             return NULL;
         }
-        int b = BooleanString(v);
-        free(v);
+        int b = BooleanString(v->data);
+        FreeValue(v);
         if (!b) {
             int prefix_len;
             int len = argv[i]->end - argv[i]->start;
@@ -159,7 +331,7 @@ Value* AssertFn(const char* name, State* state, int argc, Expr* argv[]) {
             return NULL;
         }
     }
-    return StringValue(strdup(""));
+    return BoolValue(false);
 }
 
 Value* SleepFn(const char* name, State* state, int argc, Expr* argv[]) {
@@ -175,100 +347,100 @@ Value* SleepFn(const char* name, State* state, int argc, Expr* argv[]) {
 Value* StdoutFn(const char* name, State* state, int argc, Expr* argv[]) {
     int i;
     for (i = 0; i < argc; ++i) {
-        char* v = Evaluate(state, argv[i]);
+        Value* v = EvaluateString(state, argv[i]);
         if (v == NULL) {
             return NULL;
         }
-        fputs(v, stdout);
-        free(v);
+        fputs(v->data, stdout);
+        FreeValue(v);
     }
-    return StringValue(strdup(""));
+    return BoolValue(false);
 }
 
 Value* LogicalAndFn(const char* name, State* state,
                    int argc, Expr* argv[]) {
-    char* left = Evaluate(state, argv[0]);
+    Value* left = EvaluateString(state, argv[0]);
     if (left == NULL) return NULL;
-    if (BooleanString(left) == true) {
-        free(left);
-        return EvaluateValue(state, argv[1]);
+    if (BooleanString(left->data) == true) {
+        FreeValue(left);
+        return EvaluateShared(state, argv[1]);
     } else {
-        return StringValue(left);
+        return left;
     }
 }
 
 Value* LogicalOrFn(const char* name, State* state,
                    int argc, Expr* argv[]) {
-    char* left = Evaluate(state, argv[0]);
+    Value* left = EvaluateString(state, argv[0]);
     if (left == NULL) return NULL;
-    if (BooleanString(left) == false) {
-        free(left);
-        return EvaluateValue(state, argv[1]);
+    if (BooleanString(left->data) == false) {
+        FreeValue(left);
+        return EvaluateShared(state, argv[1]);
     } else {
-        return StringValue(left);
+        return left;
     }
 }
 
 Value* LogicalNotFn(const char* name, State* state,
                     int argc, Expr* argv[]) {
-    char* val = Evaluate(state, argv[0]);
+    Value* val = EvaluateString(state, argv[0]);
     if (val == NULL) return NULL;
-    bool bv = BooleanString(val);
-    free(val);
-    return StringValue(strdup(bv ? "" : "t"));
+    bool bv = BooleanString(val->data);
+    FreeValue(val);
+    return BoolValue(!bv);
 }
 
 Value* SubstringFn(const char* name, State* state,
                    int argc, Expr* argv[]) {
-    char* needle = Evaluate(state, argv[0]);
+    Value* needle = EvaluateString(state, argv[0]);
     if (needle == NULL) return NULL;
-    char* haystack = Evaluate(state, argv[1]);
+    Value* haystack = EvaluateString(state, argv[1]);
     if (haystack == NULL) {
-        free(needle);
+        FreeValue(needle);
         return NULL;
     }
 
-    char* result = strdup(strstr(haystack, needle) ? "t" : "");
-    free(needle);
-    free(haystack);
-    return StringValue(result);
+    bool result = strstr(haystack->data, needle->data) != NULL;
+    FreeValue(needle);
+    FreeValue(haystack);
+    return BoolValue(result);
 }
 
 Value* EqualityFn(const char* name, State* state, int argc, Expr* argv[]) {
-    char* left = Evaluate(state, argv[0]);
+    Value* left = EvaluateString(state, argv[0]);
     if (left == NULL) return NULL;
-    char* right = Evaluate(state, argv[1]);
+    Value* right = EvaluateString(state, argv[1]);
     if (right == NULL) {
-        free(left);
+        FreeValue(left);
         return NULL;
     }
 
-    char* result = strdup(strcmp(left, right) == 0 ? "t" : "");
-    free(left);
-    free(right);
-    return StringValue(result);
+    bool result = strcmp(left->data, right->data) == 0;
+    FreeValue(left);
+    FreeValue(right);
+    return BoolValue(result);
 }
 
 Value* InequalityFn(const char* name, State* state, int argc, Expr* argv[]) {
-    char* left = Evaluate(state, argv[0]);
+    Value* left = EvaluateString(state, argv[0]);
     if (left == NULL) return NULL;
-    char* right = Evaluate(state, argv[1]);
+    Value* right = EvaluateString(state, argv[1]);
     if (right == NULL) {
-        free(left);
+        FreeValue(left);
         return NULL;
     }
 
-    char* result = strdup(strcmp(left, right) != 0 ? "t" : "");
-    free(left);
-    free(right);
-    return StringValue(result);
+    bool result = strcmp(left->data, right->data) != 0;
+    FreeValue(left);
+    FreeValue(right);
+    return BoolValue(result);
 }
 
 Value* SequenceFn(const char* name, State* state, int argc, Expr* argv[]) {
-    Value* left = EvaluateValue(state, argv[0]);
+    Value* left = EvaluateShared(state, argv[0]);
     if (left == NULL) return NULL;
     FreeValue(left);
-    return EvaluateValue(state, argv[1]);
+    return EvaluateShared(state, argv[1]);
 }
 
 Value* LessThanIntFn(const char* name, State* state, int argc, Expr* argv[]) {
@@ -278,9 +450,15 @@ Value* LessThanIntFn(const char* name, State* state, int argc, Expr* argv[]) {
         return NULL;
     }
 
-    char* left;
-    char* right;
-    if (ReadArgs(state, argv, 2, &left, &right) < 0) return NULL;
+    Value* left_value = EvaluateString(state, argv[0]);
+    if (left_value == NULL) return NULL;
+    Value* right_value = EvaluateString(state, argv[1]);
+    if (right_value == NULL) {
+        FreeValue(left_value);
+        return NULL;
+    }
+    const char* left = left_value->data;
+    const char* right = right_value->data;
 
     bool result = false;
     char* end;
@@ -300,9 +478,9 @@ Value* LessThanIntFn(const char* name, State* state, int argc, Expr* argv[]) {
     result = l_int < r_int;
 
   done:
-    free(left);
-    free(right);
-    return StringValue(strdup(result ? "t" : ""));
+    FreeValue(left_value);
+    FreeValue(right_value);
+    return BoolValue(result);
 }
 
 Value* GreaterThanIntFn(const char* name, State* state,
@@ -324,6 +502,33 @@ Value* Literal(const char* name, State* state, int argc, Expr* argv[]) {
     return StringValue(strdup(name));
 }
 
+// The Function of literals made by BuildLiteral(), whose name is the
+// data of their interned Value.
+static Value* InternedLiteralFn(const char* name, State* state, int argc, Expr* argv[]) {
+    return &((InternedLiteral*) (name - offsetof(InternedLiteral, data)))->value;
+}
+
+bool IsLiteral(const Expr* e) {
+    return e->fn == InternedLiteralFn || e->fn == Literal;
+}
+
+Expr* BuildLiteral(char* str, YYLTYPE loc) {
+    InternedLiteral* lit = Intern(str);
+    Expr* e = ArenaAlloc(sizeof(Expr));
+    if (lit == NULL || e == NULL) {
+        fprintf(stderr, "out of memory interning \"%s\"\n", str);
+        exit(1);
+    }
+    free(str);
+    e->fn = InternedLiteralFn;
+    e->name = lit->data;
+    e->argc = 0;
+    e->argv = NULL;
+    e->start = loc.start;
+    e->end = loc.end;
+    return e;
+}
+
 Expr* Build(Function fn, YYLTYPE loc, int count, ...) {
     va_list v;
     va_start(v, count);
@@ -346,9 +551,14 @@ Expr* Build(Function fn, YYLTYPE loc, int count, ...) {
 //   the function table
 // -----------------------------------------------------------------
 
+static Value* UnknownFunctionFn(const char* name, State* state, int argc, Expr* argv[]) {
+    return ErrorAbort(state, "unknown function \"%s\"", name);
+}
+
 static int fn_entries = 0;
 static int fn_size = 0;
 NamedFunction* fn_table = NULL;
+static bool allow_unknown_functions = false;
 
 void RegisterFunction(const char* name, Function fn) {
     if (fn_entries >= fn_size) {
@@ -376,11 +586,15 @@ Function FindFunction(const char* name) {
     NamedFunction* nf = bsearch(&key, fn_table, fn_entries,
                                 sizeof(NamedFunction), fn_entry_compare);
     if (nf == NULL) {
-        return NULL;
+        return allow_unknown_functions ? UnknownFunctionFn : NULL;
     }
     return nf->fn;
 }
 
+void AllowUnknownFunctions(bool allow) {
+    allow_unknown_functions = allow;
+}
+
 void RegisterBuiltins() {
     RegisterFunction("ifelse", IfElseFn);
     RegisterFunction("abort", AbortFn);
@@ -403,25 +617,25 @@ void RegisterBuiltins() {
 // zero or more char** to put them in).  If any expression evaluates
 // to NULL, free the rest and return -1.  Return 0 on success.
 int ReadArgs(State* state, Expr* argv[], int count, ...) {
-    char** args = malloc(count * sizeof(char*));
-    va_list v;
+    va_list v, done;
     va_start(v, count);
+    va_copy(done, v);
     int i;
     for (i = 0; i < count; ++i) {
-        args[i] = Evaluate(state, argv[i]);
-        if (args[i] == NULL) {
-            va_end(v);
+        char* arg = Evaluate(state, argv[i]);
+        if (arg == NULL) {
             int j;
             for (j = 0; j < i; ++j) {
-                free(args[j]);
+                free(*(va_arg(done, char**)));
             }
-            free(args);
+            va_end(done);
+            va_end(v);
             return -1;
         }
-        *(va_arg(v, char**)) = args[i];
+        *(va_arg(v, char**)) = arg;
     }
+    va_end(done);
     va_end(v);
-    free(args);
     return 0;
 }
 
@@ -429,25 +643,25 @@ int ReadArgs(State* state, Expr* argv[], int count, ...) {
 // zero or more Value** to put them in).  If any expression evaluates
 // to NULL, free the rest and return -1.  Return 0 on success.
 int ReadValueArgs(State* state, Expr* argv[], int count, ...) {
-    Value** args = malloc(count * sizeof(Value*));
-    va_list v;
+    va_list v, done;
     va_start(v, count);
+    va_copy(done, v);
     int i;
     for (i = 0; i < count; ++i) {
-        args[i] = EvaluateValue(state, argv[i]);
-        if (args[i] == NULL) {
-            va_end(v);
+        Value* arg = EvaluateValue(state, argv[i]);
+        if (arg == NULL) {
             int j;
             for (j = 0; j < i; ++j) {
-                FreeValue(args[j]);
+                FreeValue(*(va_arg(done, Value**)));
             }
-            free(args);
+            va_end(done);
+            va_end(v);
             return -1;
         }
-        *(va_arg(v, Value**)) = args[i];
+        *(va_arg(v, Value**)) = arg;
     }
+    va_end(done);
     va_end(v);
-    free(args);
     return 0;
 }
 
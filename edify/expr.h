@@ -17,6 +17,7 @@
 #ifndef _EXPRESSION_H
 #define _EXPRESSION_H
 
+#include <stdbool.h>
 #include <unistd.h>
 
 #include "yydefs.h"
@@ -54,6 +55,11 @@ typedef struct {
     char* data;
 } Value;
 
+// A Function may return a Value it doesn't own, such as an interned
+// literal or a boolean result shared by all the builtins.  FreeValue()
+// knows to leave those alone; the evaluation functions below always
+// hand back a copy the caller owns.
+
 typedef Value* (*Function)(const char* name, State* state,
                            int argc, Expr* argv[]);
 
@@ -80,6 +86,14 @@ char* Evaluate(State* state, Expr* expr);
 // Glue to make an Expr out of a literal.
 Value* Literal(const char* name, State* state, int argc, Expr* argv[]);
 
+// Make an Expr for the literal str (taking ownership of it).  Equal
+// literals share one interned Value, which evaluating the Expr returns
+// without allocating anything.
+Expr* BuildLiteral(char* str, YYLTYPE loc);
+
+// True if e is a literal, whose value is e->name.
+bool IsLiteral(const Expr* e);
+
 // Functions corresponding to various syntactic sugar operators.
 // ("concat" is also available as a builtin function, to concatenate
 // more than two strings.)
@@ -129,6 +143,11 @@ void FinishRegistration();
 // exists.
 Function FindFunction(const char* name);
 
+// Tools that only compile scripts don't have the device's functions
+// registered.  With this set, FindFunction() returns a stand-in for
+// unknown names that aborts the script if it is ever called.
+void AllowUnknownFunctions(bool allow);
+
 
 // --- convenience functions for use in functions ---
 
@@ -18,11 +18,62 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "bytecode.h"
 #include "expr.h"
 #include "parser.h"
 
 extern int yyparse(Expr** root, int* error_count);
 
+// Fold e, round-trip it through bytecode, and run it as a program;
+// the result must be the same as evaluating the tree.
+int expect_compiled(const char* expr_str, Expr* e, const char* expected, int* errors) {
+    e = FoldConstants(e);
+
+    FILE* f = tmpfile();
+    if (f == NULL || WriteBytecode(f, e, expr_str, strlen(expr_str)) != 0) {
+        fprintf(stderr, "error compiling \"%s\"\n", expr_str);
+        ++*errors;
+        if (f != NULL) fclose(f);
+        return 0;
+    }
+    long size = ftell(f);
+    unsigned char* data = malloc(size);
+    rewind(f);
+    fread(data, 1, size, f);
+    fclose(f);
+    e = ReadBytecode(data, size, expr_str, strlen(expr_str));
+    free(data);
+    Program* program = e == NULL ? NULL : BuildProgram(e);
+    if (program == NULL) {
+        fprintf(stderr, "error loading bytecode for \"%s\"\n", expr_str);
+        ++*errors;
+        return 0;
+    }
+
+    State state;
+    state.cookie = NULL;
+    state.script = strdup(expr_str);
+    state.errmsg = NULL;
+
+    Value* v = RunProgram(&state, program, NULL, NULL);
+    free(state.errmsg);
+    free(state.script);
+    free(program->stmts);
+    free(program);
+
+    int ok = (v == NULL && expected == NULL) ||
+             (v != NULL && expected != NULL && v->type == VAL_STRING &&
+              strcmp(v->data, expected) == 0);
+    if (!ok) {
+        fprintf(stderr, "running compiled \"%s\": expected \"%s\", got \"%s\"\n",
+                expr_str, expected == NULL ? "(NULL)" : expected,
+                v == NULL ? "(NULL)" : v->type == VAL_STRING ? v->data : "(blob)");
+        ++*errors;
+    }
+    FreeValue(v);
+    return ok;
+}
+
 int expect(const char* expr_str, const char* expected, int* errors) {
     Expr* e;
     int error;
@@ -55,7 +106,7 @@ int expect(const char* expr_str, const char* expected, int* errors) {
     }
 
     if (result == NULL && expected == NULL) {
-        return 1;
+        return expect_compiled(expr_str, e, expected, errors);
     }
 
     if (strcmp(result, expected) != 0) {
@@ -67,7 +118,7 @@ int expect(const char* expr_str, const char* expected, int* errors) {
     }
 
     free(result);
-    return 1;
+    return expect_compiled(expr_str, e, expected, errors);
 }
 
 int test() {
@@ -95,6 +146,9 @@ int test() {
     expect("concat(a,\n \"b\")", "ab", &errors);
     expect("concat(a + b,\nc,\"d\")", "abcd", &errors);
     expect("\"concat\"(a + b,\nc,\"d\")", "abcd", &errors);
+    expect("concat()", "", &errors);
+    expect("concat(a)", "a", &errors);
+    expect("concat(a, a, a) == aaa", "t", &errors);
 
     // logical and
     expect("a && b", "b", &errors);
@@ -112,6 +166,20 @@ int test() {
     expect("a || abort()", "a", &errors);     // test short-circuiting
     expect("\"\" || abort()", NULL, &errors);
 
+    // shared literals and booleans come back as separate copies
+    expect("a == a", "t", &errors);
+    expect("(a == a) + (b == b)", "tt", &errors);
+    expect("ifelse(a == a, a, b) + a", "aa", &errors);
+    expect("assert(t); a", "a", &errors);
+    expect("assert(t, \"\")", NULL, &errors);
+
+    // folded away before the program runs
+    expect("ifelse(a + b == ab, yes, abort())", "yes", &errors);
+    expect("is_substring(b, abc) && ! \"\" && c", "c", &errors);
+    expect("a; b + c; d", "d", &errors);
+    expect("a; abort(); d", NULL, &errors);
+    expect("ifelse(\"\", a)", "", &errors);
+
     // logical not
     expect("!a", "", &errors);
     expect("! \"\"", "t", &errors);
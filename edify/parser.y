@@ -65,15 +65,7 @@ int yyparse(Expr** root, int* error_count);
 input:  expr           { *root = $1; }
 ;
 
-expr:  STRING {
-    $$ = malloc(sizeof(Expr));
-    $$->fn = Literal;
-    $$->name = $1;
-    $$->argc = 0;
-    $$->argv = NULL;
-    $$->start = @$.start;
-    $$->end = @$.end;
-}
+expr:  STRING                        { $$ = BuildLiteral($1, @$); }
 |  '(' expr ')'                      { $$ = $2; $$->start=@$.start; $$->end=@$.end; }
 |  expr ';'                          { $$ = $1; $$->start=@1.start; $$->end=@1.end; }
 |  expr ';' expr                     { $$ = Build(SequenceFn, @$, 2, $1, $3); }
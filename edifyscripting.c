@@ -40,6 +40,7 @@
 #include "edify/expr.h"
 #include "edifyscripting.h"
 #include "extendedcommands.h"
+#include "libcrecovery/common.h"
 #include "firmware.h"
 #include "flashutils/flashutils.h"
 #include "install.h"
@@ -102,6 +103,7 @@ Value* RunProgramFn(const char* name, State* state, int argc, Expr* argv[]) {
 
     fprintf(stderr, "about to run program [%s] with %d args\n", args2[0], argc);
 
+    fflush(stdout);
     pid_t child = fork();
     if (child == 0) {
         execv(args2[0], args2);
@@ -294,6 +296,8 @@ static int run_script_from_buffer(char* script_data, int script_len, char* filen
         state.errmsg = NULL;
 
         char* result = Evaluate(&state, root);
+        // scripts write where they please
+        dir_stats_invalidate();
         if (result == NULL) {
             printf("result was NULL, message is: %s\n",
                    (state.errmsg == NULL ? "(NULL)" : state.errmsg));
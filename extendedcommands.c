@@ -29,6 +29,7 @@
 #include <sys/limits.h>
 #include <sys/reboot.h>
 #include <sys/stat.h>
+#include <sys/statfs.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <time.h>
@@ -40,11 +41,13 @@
 #include "common.h"
 #include "cutils/android_reboot.h"
 #include "cutils/properties.h"
+#include "dirlist.h"
 #include "edify/expr.h"
 #include "extendedcommands.h"
 #include "firmware.h"
 #include "flashutils/flashutils.h"
 #include "install.h"
+#include "libcrecovery/common.h"
 #include "make_ext4fs.h"
 #include "minui/minui.h"
 #include "minzip/DirUtil.h"
@@ -62,14 +65,14 @@
 // top fixed menu items, those before extra storage volumes
 #define FIXED_TOP_INSTALL_ZIP_MENUS 1
 // bottom fixed menu items, those after extra storage volumes
-#define FIXED_BOTTOM_INSTALL_ZIP_MENUS 3
+#define FIXED_BOTTOM_INSTALL_ZIP_MENUS 4
 #define FIXED_INSTALL_ZIP_MENUS (FIXED_TOP_INSTALL_ZIP_MENUS + FIXED_BOTTOM_INSTALL_ZIP_MENUS)
 
 // number of actions added for each volume by add_nandroid_options_for_volume()
 // these go on top of menu list
 #define NANDROID_ACTIONS_NUM 3
 // number of fixed bottom entries after volume actions
-#define NANDROID_FIXED_ENTRIES 4
+#define NANDROID_FIXED_ENTRIES 5
 
 #if defined(ENABLE_LOKI) && defined(BOARD_NATIVE_DUALBOOT_SINGLEDATA)
 #define FIXED_ADVANCED_ENTRIES 10
@@ -105,6 +108,7 @@ typedef struct {
 
 // Prototypes of private functions that are used before defined
 static void show_choose_zip_menu(const char *mount_point);
+static void show_install_queue_menu(const char *mount_point);
 static void format_sdcard(const char* volume);
 static int can_partition(const char* volume);
 static int is_path_mounted(const char* path);
@@ -305,6 +309,41 @@ int install_zip(const char* packagefilepath) {
     return 0;
 }
 
+// Installs the packages in order and stops at the first that fails.
+// Each package's signature is checked in the background while the one
+// before it installs, so only the first is verified up front.
+// Batches from the command file go straight to install_package(), the
+// same as a single --update_package, without the menu's MTD bootloader
+// message and loki handling.
+int install_zips(char* const paths[], int count, int from_command) {
+    int i, failed = -1;
+
+    for (i = 0; i < count && failed < 0; i++) {
+        // paths[i] was verified while the one before installed
+        wait_package_verification();
+        if (i + 1 < count)
+            verify_package_async(paths[i + 1]);
+        if (from_command) {
+            ui_print("\n-- Installing: %s\n", paths[i]);
+            if (install_package(paths[i]) != INSTALL_SUCCESS) {
+                ui_print("Installation aborted.\n");
+                failed = i;
+            }
+        } else if (install_zip(paths[i]) != 0) {
+            failed = i;
+        }
+    }
+    wait_package_verification();
+
+    ui_print("\n-- Installed %d of %d zips:\n", failed < 0 ? count : failed, count);
+    for (i = 0; i < count; i++) {
+        const char *result = (failed < 0 || i < failed) ? "ok" :
+                             i == failed ? "FAILED" : "skipped";
+        ui_print("%-8s%s\n", result, paths[i]);
+    }
+    return failed < 0 ? 0 : 1;
+}
+
 int show_install_update_menu() {
     char buf[100];
     int i = 0, chosen_item = 0;
@@ -330,11 +369,12 @@ int show_install_update_menu() {
 
     // FIXED_BOTTOM_INSTALL_ZIP_MENUS
     install_menu_items[FIXED_TOP_INSTALL_ZIP_MENUS + num_extra_volumes] = "Install zip from last folder";
-    install_menu_items[FIXED_TOP_INSTALL_ZIP_MENUS + num_extra_volumes + 1] = "Install zip from sideload";
-    install_menu_items[FIXED_TOP_INSTALL_ZIP_MENUS + num_extra_volumes + 2] = "Toggle Signature Verification";
+    install_menu_items[FIXED_TOP_INSTALL_ZIP_MENUS + num_extra_volumes + 1] = "Install a queue of zips";
+    install_menu_items[FIXED_TOP_INSTALL_ZIP_MENUS + num_extra_volumes + 2] = "Install zip from sideload";
+    install_menu_items[FIXED_TOP_INSTALL_ZIP_MENUS + num_extra_volumes + 3] = "Toggle Signature Verification";
 
     // extra NULL for GO_BACK
-    install_menu_items[FIXED_TOP_INSTALL_ZIP_MENUS + num_extra_volumes + 3] = NULL;
+    install_menu_items[FIXED_TOP_INSTALL_ZIP_MENUS + num_extra_volumes + 4] = NULL;
 
     for (;;) {
         chosen_item = get_menu_selection(headers, install_menu_items, 0, 0);
@@ -349,8 +389,11 @@ int show_install_update_menu() {
             else
                 show_choose_zip_menu(last_path_used);
         } else if (chosen_item == FIXED_TOP_INSTALL_ZIP_MENUS + num_extra_volumes + 1) {
-            apply_from_adb();
+            char *last_path_used = read_last_install_path();
+            show_install_queue_menu(last_path_used == NULL ? primary_path : last_path_used);
         } else if (chosen_item == FIXED_TOP_INSTALL_ZIP_MENUS + num_extra_volumes + 2) {
+            apply_from_adb();
+        } else if (chosen_item == FIXED_TOP_INSTALL_ZIP_MENUS + num_extra_volumes + 3) {
             toggle_signature_check();
         } else {
             // GO_BACK or REFRESH (chosen_item < 0)
@@ -424,97 +467,51 @@ void free_string_array(char** array) {
 }
 
 static char** gather_files(const char* directory, const char* fileExtensionOrDirectory, int* numFiles) {
-    char path[PATH_MAX] = "";
-    DIR *dir;
-    struct dirent *de;
-    int total = 0;
-    int i;
-    char** files = NULL;
-    int pass;
+    int i, total = 0;
     *numFiles = 0;
-    int dirLen = strlen(directory);
 
-    dir = opendir(directory);
-    if (dir == NULL) {
+    const DirList* list = dirlist_open(directory);
+    if (list == NULL) {
         ui_print("Couldn't open directory.\n");
         return NULL;
     }
 
+    // NULL means that we are gathering directories
+    int count = fileExtensionOrDirectory == NULL ? list->num_dirs : list->num_files;
+    char** names = fileExtensionOrDirectory == NULL ? list->dirs : list->files;
     unsigned int extension_length = 0;
     if (fileExtensionOrDirectory != NULL)
         extension_length = strlen(fileExtensionOrDirectory);
 
-    int isCounting = 1;
-    i = 0;
-    for (pass = 0; pass < 2; pass++) {
-        while ((de = readdir(dir)) != NULL) {
-            // skip hidden files
-            if (de->d_name[0] == '.')
-                continue;
-
-            // NULL means that we are gathering directories, so skip this
-            if (fileExtensionOrDirectory != NULL) {
-                // make sure that we can have the desired extension (prevent seg fault)
-                if (strlen(de->d_name) < extension_length)
-                    continue;
-                // compare the extension
-                if (strcmp(de->d_name + strlen(de->d_name) - extension_length, fileExtensionOrDirectory) != 0)
-                    continue;
-            } else {
-                struct stat info;
-                char fullFileName[PATH_MAX];
-                strcpy(fullFileName, directory);
-                strcat(fullFileName, de->d_name);
-                lstat(fullFileName, &info);
-                // make sure it is a directory
-                if (!(S_ISDIR(info.st_mode)))
-                    continue;
-            }
-
-            if (pass == 0) {
-                total++;
-                continue;
-            }
-
-            files[i] = (char*)malloc(dirLen + strlen(de->d_name) + 2);
-            strcpy(files[i], directory);
-            strcat(files[i], de->d_name);
-            if (fileExtensionOrDirectory == NULL)
-                strcat(files[i], "/");
-            i++;
-        }
-        if (pass == 1)
-            break;
-        if (total == 0)
-            break;
-        rewinddir(dir);
-        *numFiles = total;
-        files = (char**)malloc((total + 1) * sizeof(char*));
-        files[total] = NULL;
+    char** files = (char**)malloc((count + 1) * sizeof(char*));
+    if (files == NULL) {
+        dirlist_release(list);
+        return NULL;
     }
+    for (i = 0; i < count; i++) {
+        const char* name = names[i];
+        size_t len = strlen(name);
+        // skip hidden files
+        if (name[0] == '.')
+            continue;
+        // compare the extension
+        if (fileExtensionOrDirectory != NULL &&
+            (len < extension_length || strcmp(name + len - extension_length, fileExtensionOrDirectory) != 0))
+            continue;
 
-    if (closedir(dir) < 0) {
-        LOGE("Failed to close directory.\n");
+        files[total] = (char*)malloc(strlen(directory) + len + 1);
+        strcpy(files[total], directory);
+        strcat(files[total], name);
+        total++;
     }
+    files[total] = NULL;
+    dirlist_release(list);
 
     if (total == 0) {
+        free(files);
         return NULL;
     }
-    // sort the result
-    if (files != NULL) {
-        for (i = 0; i < total; i++) {
-            int curMax = -1;
-            int j;
-            for (j = 0; j < total - i; j++) {
-                if (curMax == -1 || strcmp(files[curMax], files[j]) < 0)
-                    curMax = j;
-            }
-            char* temp = files[curMax];
-            files[curMax] = files[total - i - 1];
-            files[total - i - 1] = temp;
-        }
-    }
-
+    *numFiles = total;
     return files;
 }
 
@@ -611,6 +608,63 @@ static void show_choose_zip_menu(const char *mount_point) {
     free(file);
 }
 
+#define MAX_INSTALL_QUEUE 16
+
+static void show_install_queue_menu(const char *mount_point) {
+    if (ensure_path_mounted(mount_point) != 0) {
+        LOGE("Can't mount %s\n", mount_point);
+        return;
+    }
+
+    static const char* headers[] = { "Install a queue of zips", "Select a queued zip to drop it", "", NULL };
+    static const char* choose_headers[] = { "Choose a zip to queue", "", NULL };
+    char* queue[MAX_INSTALL_QUEUE];
+    char* items[MAX_INSTALL_QUEUE + 3];
+    char install_item[64];
+    int count = 0, i;
+
+    for (;;) {
+        items[0] = "Add a zip to the queue";
+        snprintf(install_item, sizeof(install_item), "Install the queued zips (%d)", count);
+        items[1] = install_item;
+        for (i = 0; i < count; i++)
+            items[2 + i] = queue[i];
+        items[2 + count] = NULL;
+
+        int chosen_item = get_menu_selection(headers, items, 0, 0);
+        if (chosen_item == 0) {
+            if (count == MAX_INSTALL_QUEUE) {
+                ui_print("Can't queue more than %d zips.\n", MAX_INSTALL_QUEUE);
+                continue;
+            }
+            char* file = choose_file_menu(mount_point, ".zip", choose_headers);
+            if (file != NULL)
+                queue[count++] = file;
+        } else if (chosen_item == 1) {
+            if (count == 0)
+                continue;
+            char confirm[64];
+            snprintf(confirm, sizeof(confirm), "Yes - Install %d zips in order", count);
+            if (confirm_selection("Confirm install?", confirm)) {
+                install_zips(queue, count, 0);
+                write_last_install_path(dirname(queue[count - 1]));
+                break;
+            }
+        } else if (chosen_item >= 2) {
+            free(queue[chosen_item - 2]);
+            memmove(queue + chosen_item - 2, queue + chosen_item - 1,
+                    (count - (chosen_item - 1)) * sizeof(char*));
+            count--;
+        } else {
+            // GO_BACK or REFRESH (chosen_item < 0)
+            break;
+        }
+    }
+
+    for (i = 0; i < count; i++)
+        free(queue[i]);
+}
+
 static void show_nandroid_restore_menu(const char* path) {
     if (ensure_path_mounted(path) != 0) {
         LOGE("Can't mount %s\n", path);
@@ -781,6 +835,7 @@ int confirm_selection(const char* title, const char* confirm) {
 }
 
 int format_device(const char *device, const char *path, const char *fs_type) {
+    dir_stats_invalidate();
 #ifdef BOARD_NATIVE_DUALBOOT_SINGLEDATA
     if(device_truedualboot_format_device(device, path, fs_type) <= 0)
         return 0;
@@ -877,8 +932,44 @@ int format_device(const char *device, const char *path, const char *fs_type) {
     return format_unknown_device(device, path, fs_type);
 }
 
+static void wipe_progress(long removed, void* cookie) {
+    long total = *(long*) cookie;
+    ui_set_progress((float) removed / (float) total);
+}
+
+// Deletes everything under path but the top-level names in exclude.  The
+// inodes in use on the volume, less those of the excluded trees, are a
+// close enough estimate of the total for the progress bar; filesystems
+// without inode counts get none.
+static int wipe_volume_files(const char* path, const char* const exclude[]) {
+    struct statfs sfs;
+    long total = 0;
+    int i;
+    if (statfs(path, &sfs) == 0 && sfs.f_files > sfs.f_ffree)
+        total = sfs.f_files - sfs.f_ffree;
+    for (i = 0; total > 0 && exclude != NULL && exclude[i] != NULL; i++) {
+        char kept[PATH_MAX];
+        struct dir_stats stats;
+        snprintf(kept, sizeof(kept), "%s/%s", path, exclude[i]);
+        if (dir_stats(kept, NULL, &stats) == 0)
+            total -= stats.entries;
+    }
+    if (total > 0) {
+        ui_reset_progress();
+        ui_show_progress(1, 0);
+    }
+
+    int ret = wipe_dir(path, exclude, total > 0 ? wipe_progress : NULL, &total);
+    if (ret != 0)
+        LOGE("Error wiping %s (%s)\n", path, strerror(errno));
+    if (total > 0)
+        ui_reset_progress();
+    return ret;
+}
+
 int format_unknown_device(const char *device, const char* path, const char *fs_type) {
     LOGI("Formatting unknown device.\n");
+    dir_stats_invalidate();
 
     if (fs_type != NULL && get_flash_type(fs_type) != UNSUPPORTED)
         return erase_raw_partition(fs_type, device);
@@ -919,10 +1010,9 @@ int format_unknown_device(const char *device, const char* path, const char *fs_t
         return 0;
     }
 
-    char tmp[PATH_MAX];
     if (strcmp(path, "/data") == 0) {
-        sprintf(tmp, "cd /data ; for f in $(ls -a | grep -v ^media$); do rm -rf $f; done");
-        __system(tmp);
+        static const char* const keep[] = { "media", NULL };
+        wipe_volume_files(path, keep);
         // if the /data/media sdcard has already been migrated for android 4.2,
         // prevent the migration from happening again by writing the .layout_version
         struct stat st;
@@ -939,10 +1029,7 @@ int format_unknown_device(const char *device, const char* path, const char *fs_t
             LOGI("/data/media/0 not found. migration may occur.\n");
         }
     } else {
-        sprintf(tmp, "rm -rf %s/*", path);
-        __system(tmp);
-        sprintf(tmp, "rm -rf %s/.*", path);
-        __system(tmp);
+        wipe_volume_files(path, NULL);
     }
 
     ensure_path_unmounted(path);
@@ -1407,6 +1494,21 @@ static void run_dedupe_gc() {
     }
 }
 
+// raw partition images (boot, recovery, nvram...) are written as sparse
+// images while this marker file exists
+static void toggle_sparse_raw_backup() {
+    char path[PATH_MAX];
+    sprintf(path, "%s%s%s", get_primary_storage_path(), (is_data_media() ? "/0/" : "/"), NANDROID_SPARSE_RAW_FILE);
+    ensure_path_mounted(path);
+    if (access(path, F_OK) == 0) {
+        unlink(path);
+        ui_print("Sparse Raw Backups: Disabled\n");
+    } else {
+        write_string_to_file(path, "1");
+        ui_print("Sparse Raw Backups: Enabled\n");
+    }
+}
+
 static void choose_default_backup_format() {
     static const char* headers[] = { "Default Backup Format", "", NULL };
 
@@ -1572,6 +1674,7 @@ int show_nandroid_menu() {
     list[offset + 1] = "Toggle MD5 Verification";
     list[offset + 2] = "Default backup format";
     list[offset + 3] = "Delete unused Old Backup Data";
+    list[offset + 4] = "Toggle Sparse Raw Backups";
     offset += NANDROID_FIXED_ENTRIES;
 
 #ifdef RECOVERY_EXTEND_NANDROID_MENU
@@ -1597,6 +1700,8 @@ int show_nandroid_menu() {
             choose_default_backup_format();
         } else if (chosen_item == (action_entries_num + 3)) {
             run_dedupe_gc();
+        } else if (chosen_item == (action_entries_num + 4)) {
+            toggle_sparse_raw_backup();
         } else if (chosen_item < action_entries_num) {
             // get nandroid volume actions path
             if (chosen_item < NANDROID_ACTIONS_NUM) {
@@ -28,6 +28,7 @@ int show_partition_menu();
 int show_install_update_menu();
 int confirm_selection(const char* title, const char* confirm);
 int install_zip(const char* packagefilepath);
+int install_zips(char* const paths[], int count, int from_command);
 
 void show_power_menu();
 int show_nandroid_advanced_menu();
@@ -3,7 +3,7 @@ LOCAL_PATH := $(call my-dir)
 ifneq ($(TARGET_SIMULATOR),true)
 
 include $(CLEAR_VARS)
-LOCAL_SRC_FILES := flashutils.c
+LOCAL_SRC_FILES := flashutils.c sparse_image.c
 LOCAL_MODULE := libflashutils
 LOCAL_MODULE_TAGS := optional
 LOCAL_C_INCLUDES += $(LOCAL_PATH)/..
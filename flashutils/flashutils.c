@@ -1,10 +1,17 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <signal.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/wait.h>
 #include <stdio.h>
 
 #include "flashutils/flashutils.h"
+#include "flashutils/sparse_image.h"
+#include "mmcutils/mmcutils.h"
+#include "mtdutils/mtdutils.h"
 
 #ifndef BOARD_BML_BOOT
 #define BOARD_BML_BOOT              "/dev/block/bml7"
@@ -64,9 +71,315 @@ static int detect_partition(const char *partitionType, const char *partition)
 
     return type;
 }
+//=========================================/
+//=   sparse raw partition images         =/
+//=========================================/
+
+#define SPARSE_BLOCK_SIZE 4096
+#define SPARSE_IO_SIZE    (1024 * 1024)
+
+static int sparse_write_all(int fd, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t w = write(fd, data, len);
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            printf("error writing sparse image data: %s\n", strerror(errno));
+            return -1;
+        }
+        data += w;
+        len -= w;
+    }
+    return 0;
+}
+
+// fill 'buf' with 'len' bytes of the repeated little endian word 'value'
+static void sparse_fill_pattern(char *buf, size_t len, uint32_t value)
+{
+    size_t i;
+    for (i = 0; i + sizeof(value) <= len; i += sizeof(value))
+        memcpy(buf + i, &value, sizeof(value));
+}
+
+static int sparse_observer(const char *data, size_t len, void *cookie)
+{
+    return sparse_writer_write((SparseWriter*)cookie, data, len);
+}
+
+static int backup_mmc_sparse(const char *partition, const char *filename)
+{
+    char device[PATH_MAX];
+    unsigned sz;
+    if (cmd_mmc_get_raw_dump_source(partition, device, &sz) != 0)
+        return -1;
+
+    unsigned long long size = sz;
+    if (size == 0) {
+        int fd = open(device, O_RDONLY);
+        if (fd < 0) {
+            printf("error opening %s: %s\n", device, strerror(errno));
+            return -1;
+        }
+        off64_t end = lseek64(fd, 0, SEEK_END);
+        close(fd);
+        if (end <= 0) {
+            printf("can't get size of %s\n", device);
+            return -1;
+        }
+        size = end;
+    }
+
+    // sparse images hold whole blocks only
+    unsigned blk_sz = SPARSE_BLOCK_SIZE;
+    if (size % blk_sz)
+        blk_sz = 512;
+    if (size % blk_sz) {
+        printf("%s is not block aligned, dumping it raw\n", partition);
+        return cmd_mmc_backup_raw_partition(partition, filename);
+    }
+
+    SparseWriter *w = sparse_writer_open(filename, blk_sz);
+    if (w == NULL)
+        return -1;
+    int ret = mmc_raw_copy_file(device, NULL, size, sparse_observer, w);
+    if (sparse_writer_close(w) != 0)
+        ret = -1;
+    if (ret != 0)
+        unlink(filename);
+    return ret;
+}
+
+static int backup_mtd_sparse(const char *partition_name, const char *filename)
+{
+    if (mtd_scan_partitions() <= 0) {
+        printf("error scanning partitions");
+        return -1;
+    }
+    const MtdPartition *mtd = mtd_find_partition_by_name(partition_name);
+    if (mtd == NULL) {
+        printf("can't find %s partition", partition_name);
+        return -1;
+    }
+
+    MtdReadContext *in = mtd_read_partition(mtd);
+    if (in == NULL) {
+        printf("error opening %s: %s\n", partition_name, strerror(errno));
+        return -1;
+    }
+    SparseWriter *w = sparse_writer_open(filename, SPARSE_BLOCK_SIZE);
+    char *buf = malloc(SPARSE_IO_SIZE);
+    if (w == NULL || buf == NULL) {
+        mtd_read_close(in);
+        if (w != NULL)
+            sparse_writer_close(w);
+        free(buf);
+        return -1;
+    }
+
+    int ret = 0;
+    ssize_t len;
+    while ((len = mtd_read_data(in, buf, SPARSE_IO_SIZE)) > 0) {
+        if (sparse_writer_write(w, buf, len) != 0) {
+            ret = -1;
+            break;
+        }
+    }
+    // reads end with ENOSPC once the last block is past
+    if (len < 0 && errno != ENOSPC)
+        ret = -1;
+    mtd_read_close(in);
+    free(buf);
+
+    if (sparse_writer_close(w) != 0)
+        ret = -1;
+    if (ret != 0)
+        unlink(filename);
+    return ret;
+}
+
+int backup_raw_partition_sparse(const char* partitionType, const char *partition, const char *filename)
+{
+    int type = detect_partition(partitionType, partition);
+    switch (type) {
+        case MTD:
+            return backup_mtd_sparse(partition, filename);
+        case MMC:
+            return backup_mmc_sparse(partition, filename);
+        default:
+            return backup_raw_partition(partitionType, partition, filename);
+    }
+}
+
+typedef struct {
+    int fd;
+    char *pattern;
+} MmcSparseTarget;
+
+static int mmc_sparse_data(const char *data, size_t len, void *cookie)
+{
+    return sparse_write_all(((MmcSparseTarget*)cookie)->fd, data, len);
+}
+
+static int mmc_sparse_fill(uint32_t value, uint64_t len, void *cookie)
+{
+    MmcSparseTarget *t = (MmcSparseTarget*)cookie;
+    sparse_fill_pattern(t->pattern, SPARSE_IO_SIZE, value);
+    while (len > 0) {
+        size_t n = len > SPARSE_IO_SIZE ? SPARSE_IO_SIZE : len;
+        if (sparse_write_all(t->fd, t->pattern, n) != 0)
+            return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+static int mmc_sparse_skip(uint64_t len, void *cookie)
+{
+    return lseek64(((MmcSparseTarget*)cookie)->fd, len, SEEK_CUR) < 0 ? -1 : 0;
+}
+
+static int restore_mmc_sparse(const char *partition, const char *filename)
+{
+    static const SparseReadOps ops = { mmc_sparse_data, mmc_sparse_fill, mmc_sparse_skip };
+    char device[PATH_MAX];
+    MmcSparseTarget t;
+
+    if (partition[0] != '/') {
+        if (cmd_mmc_get_partition_device(partition, device) != 0)
+            return -1;
+    } else {
+        strcpy(device, partition);
+    }
+
+    t.fd = open(device, O_WRONLY);
+    if (t.fd < 0) {
+        printf("error opening %s: %s\n", device, strerror(errno));
+        return -1;
+    }
+    t.pattern = malloc(SPARSE_IO_SIZE);
+    int ret = -1;
+    if (t.pattern != NULL)
+        ret = sparse_read_image(filename, &ops, &t);
+    free(t.pattern);
+    if (fsync(t.fd) != 0)
+        ret = -1;
+    close(t.fd);
+    return ret;
+}
+
+// Erased NAND reads back as 0xff, so 0xff fill and don't care runs are
+// only written out when more data follows them; a trailing run is left
+// to the final erase.
+typedef struct {
+    MtdWriteContext *ctx;
+    char *pattern;
+    uint64_t erased;
+} MtdSparseTarget;
+
+static int mtd_sparse_write(MtdSparseTarget *t, const char *data, size_t len)
+{
+    return mtd_write_data(t->ctx, data, len) == (ssize_t)len ? 0 : -1;
+}
+
+static int mtd_sparse_write_fill(MtdSparseTarget *t, uint32_t value, uint64_t len)
+{
+    sparse_fill_pattern(t->pattern, SPARSE_IO_SIZE, value);
+    while (len > 0) {
+        size_t n = len > SPARSE_IO_SIZE ? SPARSE_IO_SIZE : len;
+        if (mtd_sparse_write(t, t->pattern, n) != 0)
+            return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+static int mtd_sparse_flush_erased(MtdSparseTarget *t)
+{
+    uint64_t len = t->erased;
+    t->erased = 0;
+    return len ? mtd_sparse_write_fill(t, 0xffffffff, len) : 0;
+}
+
+static int mtd_sparse_data(const char *data, size_t len, void *cookie)
+{
+    MtdSparseTarget *t = (MtdSparseTarget*)cookie;
+    if (mtd_sparse_flush_erased(t) != 0)
+        return -1;
+    return mtd_sparse_write(t, data, len);
+}
+
+static int mtd_sparse_fill(uint32_t value, uint64_t len, void *cookie)
+{
+    MtdSparseTarget *t = (MtdSparseTarget*)cookie;
+    if (value == 0xffffffff) {
+        t->erased += len;
+        return 0;
+    }
+    if (mtd_sparse_flush_erased(t) != 0)
+        return -1;
+    return mtd_sparse_write_fill(t, value, len);
+}
+
+static int mtd_sparse_skip(uint64_t len, void *cookie)
+{
+    ((MtdSparseTarget*)cookie)->erased += len;
+    return 0;
+}
+
+static int restore_mtd_sparse(const char *partition_name, const char *filename)
+{
+    static const SparseReadOps ops = { mtd_sparse_data, mtd_sparse_fill, mtd_sparse_skip };
+    MtdSparseTarget t;
+
+    if (mtd_scan_partitions() <= 0) {
+        printf("error scanning partitions");
+        return -1;
+    }
+    const MtdPartition *mtd = mtd_find_partition_by_name(partition_name);
+    if (mtd == NULL) {
+        printf("can't find %s partition", partition_name);
+        return -1;
+    }
+
+    t.ctx = mtd_write_partition(mtd);
+    if (t.ctx == NULL) {
+        printf("error writing %s", partition_name);
+        return -1;
+    }
+    t.erased = 0;
+    t.pattern = malloc(SPARSE_IO_SIZE);
+
+    int ret = -1;
+    if (t.pattern != NULL)
+        ret = sparse_read_image(filename, &ops, &t);
+    free(t.pattern);
+
+    if (mtd_erase_blocks(t.ctx, -1) == -1) {
+        printf("error erasing blocks of %s\n", partition_name);
+        ret = -1;
+    }
+    if (mtd_write_close(t.ctx) != 0) {
+        printf("error closing write of %s\n", partition_name);
+        ret = -1;
+    }
+    return ret;
+}
+
 int restore_raw_partition(const char* partitionType, const char *partition, const char *filename)
 {
     int type = detect_partition(partitionType, partition);
+    if (sparse_is_image(filename)) {
+        switch (type) {
+            case MTD:
+                return restore_mtd_sparse(partition, filename);
+            case MMC:
+                return restore_mmc_sparse(partition, filename);
+            default:
+                printf("sparse images can't be restored to this partition type\n");
+                return -1;
+        }
+    }
     switch (type) {
         case MTD:
             return cmd_mtd_restore_raw_partition(partition, filename);
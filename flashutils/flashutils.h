@@ -3,6 +3,10 @@
 
 int restore_raw_partition(const char* partitionType, const char *partition, const char *filename);
 int backup_raw_partition(const char* partitionType, const char *partition, const char *filename);
+/* Like backup_raw_partition(), but writes an Android sparse image where
+ * the partition type allows it.  restore_raw_partition() recognizes
+ * sparse images on its own. */
+int backup_raw_partition_sparse(const char* partitionType, const char *partition, const char *filename);
 int erase_raw_partition(const char* partitionType, const char *partition);
 int erase_partition(const char *partition, const char *filesystem);
 int mount_partition(const char *partition, const char *mount_point, const char *filesystem, int read_only);
@@ -28,6 +32,7 @@ extern int cmd_mmc_erase_raw_partition(const char *partition);
 extern int cmd_mmc_erase_partition(const char *partition, const char *filesystem);
 extern int cmd_mmc_mount_partition(const char *partition, const char *mount_point, const char *filesystem, int read_only);
 extern int cmd_mmc_get_partition_device(const char *partition, char *device);
+extern int cmd_mmc_get_raw_dump_source(const char *partition, char *device, unsigned *size);
 
 extern int cmd_bml_restore_raw_partition(const char *partition, const char *filename);
 extern int cmd_bml_backup_raw_partition(const char *partition, const char *filename);
@@ -0,0 +1,326 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "flashutils/sparse_image.h"
+
+/* Raw blocks are collected up to this many bytes before being flushed
+ * out as a single raw chunk. */
+#define SPARSE_RAW_BUFFER_SIZE (1024 * 1024)
+
+struct SparseWriter {
+    int fd;
+    int error;
+    unsigned blk_sz;
+    uint32_t total_blks;
+    uint32_t total_chunks;
+
+    /* partial block carried over between writes */
+    char *block;
+    size_t block_len;
+
+    /* pending raw run */
+    char *raw;
+    size_t raw_len;
+
+    /* pending fill run */
+    uint32_t fill_value;
+    uint32_t fill_blks;
+};
+
+static int write_all(int fd, const void *data, size_t len) {
+    const char *p = (const char*)data;
+    while (len > 0) {
+        ssize_t w = write(fd, p, len);
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += w;
+        len -= w;
+    }
+    return 0;
+}
+
+static int read_all(int fd, void *data, size_t len) {
+    char *p = (char*)data;
+    while (len > 0) {
+        ssize_t r = read(fd, p, len);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (r == 0)
+            return -1;
+        p += r;
+        len -= r;
+    }
+    return 0;
+}
+
+static int write_chunk_header(SparseWriter *w, uint16_t type, uint32_t blks, uint32_t data_sz) {
+    SparseChunkHeader chunk;
+    chunk.chunk_type = type;
+    chunk.reserved1 = 0;
+    chunk.chunk_sz = blks;
+    chunk.total_sz = sizeof(chunk) + data_sz;
+    w->total_chunks++;
+    w->total_blks += blks;
+    return write_all(w->fd, &chunk, sizeof(chunk));
+}
+
+static int flush_raw(SparseWriter *w) {
+    if (w->raw_len == 0)
+        return 0;
+    if (write_chunk_header(w, SPARSE_CHUNK_TYPE_RAW, w->raw_len / w->blk_sz, w->raw_len) ||
+        write_all(w->fd, w->raw, w->raw_len))
+        return -1;
+    w->raw_len = 0;
+    return 0;
+}
+
+static int flush_fill(SparseWriter *w) {
+    if (w->fill_blks == 0)
+        return 0;
+    if (write_chunk_header(w, SPARSE_CHUNK_TYPE_FILL, w->fill_blks, sizeof(w->fill_value)) ||
+        write_all(w->fd, &w->fill_value, sizeof(w->fill_value)))
+        return -1;
+    w->fill_blks = 0;
+    return 0;
+}
+
+static int add_block(SparseWriter *w, const char *block) {
+    uint32_t value;
+    memcpy(&value, block, sizeof(value));
+
+    /* a block equal to itself shifted by one word is a single repeated word */
+    if (memcmp(block, block + sizeof(value), w->blk_sz - sizeof(value)) == 0) {
+        if (flush_raw(w))
+            return -1;
+        if (w->fill_blks > 0 && w->fill_value != value && flush_fill(w))
+            return -1;
+        w->fill_value = value;
+        w->fill_blks++;
+        return 0;
+    }
+
+    if (flush_fill(w))
+        return -1;
+    memcpy(w->raw + w->raw_len, block, w->blk_sz);
+    w->raw_len += w->blk_sz;
+    if (w->raw_len == SPARSE_RAW_BUFFER_SIZE)
+        return flush_raw(w);
+    return 0;
+}
+
+static int write_header(SparseWriter *w) {
+    SparseHeader header;
+    header.magic = SPARSE_HEADER_MAGIC;
+    header.major_version = SPARSE_MAJOR_VERSION;
+    header.minor_version = SPARSE_MINOR_VERSION;
+    header.file_hdr_sz = sizeof(SparseHeader);
+    header.chunk_hdr_sz = sizeof(SparseChunkHeader);
+    header.blk_sz = w->blk_sz;
+    header.total_blks = w->total_blks;
+    header.total_chunks = w->total_chunks;
+    header.image_checksum = 0;
+    if (lseek(w->fd, 0, SEEK_SET) != 0)
+        return -1;
+    return write_all(w->fd, &header, sizeof(header));
+}
+
+SparseWriter *sparse_writer_open(const char *filename, unsigned blk_sz) {
+    if (blk_sz == 0 || blk_sz % 4 != 0 || SPARSE_RAW_BUFFER_SIZE % blk_sz != 0) {
+        printf("invalid sparse block size %u\n", blk_sz);
+        return NULL;
+    }
+
+    SparseWriter *w = calloc(1, sizeof(SparseWriter));
+    if (w == NULL)
+        return NULL;
+    w->blk_sz = blk_sz;
+    w->block = malloc(blk_sz);
+    w->raw = malloc(SPARSE_RAW_BUFFER_SIZE);
+    w->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (w->block == NULL || w->raw == NULL || w->fd < 0) {
+        printf("error opening %s: %s\n", filename, strerror(errno));
+        goto error;
+    }
+
+    /* placeholder, rewritten with the final counts on close */
+    if (write_header(w)) {
+        printf("error writing %s: %s\n", filename, strerror(errno));
+        goto error;
+    }
+    return w;
+
+error:
+    if (w->fd >= 0)
+        close(w->fd);
+    free(w->raw);
+    free(w->block);
+    free(w);
+    return NULL;
+}
+
+int sparse_writer_write(SparseWriter *w, const char *data, size_t len) {
+    if (w->error)
+        return -1;
+
+    if (w->block_len > 0) {
+        size_t n = w->blk_sz - w->block_len;
+        if (n > len)
+            n = len;
+        memcpy(w->block + w->block_len, data, n);
+        w->block_len += n;
+        data += n;
+        len -= n;
+        if (w->block_len < w->blk_sz)
+            return 0;
+        w->block_len = 0;
+        if (add_block(w, w->block))
+            goto error;
+    }
+
+    while (len >= w->blk_sz) {
+        if (add_block(w, data))
+            goto error;
+        data += w->blk_sz;
+        len -= w->blk_sz;
+    }
+
+    memcpy(w->block, data, len);
+    w->block_len = len;
+    return 0;
+
+error:
+    printf("error writing sparse image: %s\n", strerror(errno));
+    w->error = 1;
+    return -1;
+}
+
+int sparse_writer_close(SparseWriter *w) {
+    int ret = w->error ? -1 : 0;
+
+    if (ret == 0 && w->block_len != 0) {
+        printf("sparse image data is not a multiple of %u bytes\n", w->blk_sz);
+        ret = -1;
+    }
+    if (ret == 0 && (flush_raw(w) || flush_fill(w) || write_header(w))) {
+        printf("error finishing sparse image: %s\n", strerror(errno));
+        ret = -1;
+    }
+    if (fsync(w->fd) || close(w->fd))
+        ret = -1;
+
+    free(w->raw);
+    free(w->block);
+    free(w);
+    return ret;
+}
+
+static int read_header(int fd, SparseHeader *header) {
+    if (read_all(fd, header, sizeof(*header)))
+        return -1;
+    if (header->magic != SPARSE_HEADER_MAGIC ||
+        header->major_version != SPARSE_MAJOR_VERSION ||
+        header->file_hdr_sz < sizeof(SparseHeader) ||
+        header->chunk_hdr_sz < sizeof(SparseChunkHeader) ||
+        header->blk_sz == 0 || header->blk_sz % 4 != 0)
+        return -1;
+    if (header->file_hdr_sz > sizeof(SparseHeader) &&
+        lseek(fd, header->file_hdr_sz - sizeof(SparseHeader), SEEK_CUR) < 0)
+        return -1;
+    return 0;
+}
+
+int sparse_is_image(const char *filename) {
+    SparseHeader header;
+    struct stat st;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    // only regular files can be probed: on a pipe (/proc/self/fd/0) the
+    // header would be gone by the time the raw restore reads it
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return 0;
+    }
+    int ret = read_header(fd, &header) == 0;
+    close(fd);
+    return ret;
+}
+
+int sparse_read_image(const char *filename, const SparseReadOps *ops, void *cookie) {
+    SparseHeader header;
+    SparseChunkHeader chunk;
+    char *buffer = NULL;
+    uint32_t i;
+    int ret = -1;
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        printf("error opening %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+    if (read_header(fd, &header)) {
+        printf("%s is not a valid sparse image\n", filename);
+        goto done;
+    }
+    buffer = malloc(SPARSE_RAW_BUFFER_SIZE);
+    if (buffer == NULL)
+        goto done;
+
+    for (i = 0; i < header.total_chunks; i++) {
+        if (read_all(fd, &chunk, sizeof(chunk)) ||
+            (header.chunk_hdr_sz > sizeof(chunk) &&
+             lseek(fd, header.chunk_hdr_sz - sizeof(chunk), SEEK_CUR) < 0)) {
+            printf("truncated sparse image %s\n", filename);
+            goto done;
+        }
+
+        uint64_t len = (uint64_t)chunk.chunk_sz * header.blk_sz;
+        uint32_t value;
+        switch (chunk.chunk_type) {
+            case SPARSE_CHUNK_TYPE_RAW:
+                while (len > 0) {
+                    size_t n = len > SPARSE_RAW_BUFFER_SIZE ? SPARSE_RAW_BUFFER_SIZE : len;
+                    if (read_all(fd, buffer, n)) {
+                        printf("truncated sparse image %s\n", filename);
+                        goto done;
+                    }
+                    if (ops->data(buffer, n, cookie))
+                        goto done;
+                    len -= n;
+                }
+                break;
+            case SPARSE_CHUNK_TYPE_FILL:
+                if (read_all(fd, &value, sizeof(value)) || ops->fill(value, len, cookie))
+                    goto done;
+                break;
+            case SPARSE_CHUNK_TYPE_DONT_CARE:
+                if (ops->skip(len, cookie))
+                    goto done;
+                break;
+            case SPARSE_CHUNK_TYPE_CRC32:
+                if (read_all(fd, &value, sizeof(value)))
+                    goto done;
+                break;
+            default:
+                printf("unknown sparse chunk type 0x%04x in %s\n", chunk.chunk_type, filename);
+                goto done;
+        }
+    }
+    ret = 0;
+
+done:
+    free(buffer);
+    close(fd);
+    return ret;
+}
@@ -0,0 +1,65 @@
+#ifndef SPARSE_IMAGE_H
+#define SPARSE_IMAGE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Android sparse image format, as produced by img2simg/make_ext4fs -s
+ * and understood by fastboot.  All fields are little endian.
+ */
+#define SPARSE_HEADER_MAGIC         0xed26ff3a
+#define SPARSE_MAJOR_VERSION        1
+#define SPARSE_MINOR_VERSION        0
+
+#define SPARSE_CHUNK_TYPE_RAW       0xCAC1
+#define SPARSE_CHUNK_TYPE_FILL      0xCAC2
+#define SPARSE_CHUNK_TYPE_DONT_CARE 0xCAC3
+#define SPARSE_CHUNK_TYPE_CRC32     0xCAC4
+
+typedef struct {
+    uint32_t magic;
+    uint16_t major_version;
+    uint16_t minor_version;
+    uint16_t file_hdr_sz;
+    uint16_t chunk_hdr_sz;
+    uint32_t blk_sz;
+    uint32_t total_blks;
+    uint32_t total_chunks;
+    uint32_t image_checksum;
+} __attribute__((packed)) SparseHeader;
+
+typedef struct {
+    uint16_t chunk_type;
+    uint16_t reserved1;
+    uint32_t chunk_sz;      /* in blocks of the output image */
+    uint32_t total_sz;      /* in bytes of the chunk, header included */
+} __attribute__((packed)) SparseChunkHeader;
+
+/* Writer: blocks fed to it are scanned as they arrive and any block
+ * consisting of a single repeated 32-bit word (zeroes, erased 0xff flash)
+ * is stored as a fill chunk instead of raw data.  The output must be
+ * seekable since the header is completed on close.
+ */
+typedef struct SparseWriter SparseWriter;
+
+SparseWriter *sparse_writer_open(const char *filename, unsigned blk_sz);
+int sparse_writer_write(SparseWriter *w, const char *data, size_t len);
+/* returns 0 only when everything was written and the data was a whole
+ * number of blocks; the writer is freed either way. */
+int sparse_writer_close(SparseWriter *w);
+
+/* Reader: replays an image through callbacks.  'data' gets raw bytes in
+ * order, 'fill' a run of 'len' bytes of the repeated word 'value', and
+ * 'skip' a run whose contents don't matter.  Any callback returning
+ * non-zero aborts the read.
+ */
+typedef struct {
+    int (*data)(const char *data, size_t len, void *cookie);
+    int (*fill)(uint32_t value, uint64_t len, void *cookie);
+    int (*skip)(uint64_t len, void *cookie);
+} SparseReadOps;
+
+int sparse_is_image(const char *filename);
+int sparse_read_image(const char *filename, const SparseReadOps *ops, void *cookie);
+
+#endif
@@ -16,9 +16,14 @@
 
 #include <stdio.h>
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -26,9 +31,12 @@
 #include "common.h"
 #include "install.h"
 #include "mincrypt/rsa.h"
+#include "mincrypt/sha.h"
 #include "minui/minui.h"
 #include "minzip/SysUtil.h"
 #include "minzip/Zip.h"
+#include "minelf/Strings.h"
+#include "libcrecovery/common.h"
 #include "mounts.h"
 #include "mtdutils/mtdutils.h"
 #include "roots.h"
@@ -41,6 +49,7 @@
 #include "recovery_settings.h"
 
 #include "propsrvc/legacy_property_service.h"
+#include "updater/frames.h"
 
 #define ASSUMED_UPDATE_BINARY_NAME  "META-INF/com/google/android/update-binary"
 #define ASSUMED_UPDATE_SCRIPT_NAME  "META-INF/com/google/android/update-script"
@@ -108,6 +117,7 @@ handle_firmware_update(char* type, char* filename, ZipArchive* zip) {
 }
 
 static const char *LAST_INSTALL_FILE = "/cache/recovery/last_install";
+static const char *LAST_INSTALL_PROFILE_FILE = "/cache/recovery/last_install_profile";
 static const char *DEV_PROP_PATH = "/dev/__properties__";
 static const char *DEV_PROP_BACKUP_PATH = "/dev/__properties_backup__";
 static bool legacy_props_env_initd = false;
@@ -147,6 +157,515 @@ static int unset_legacy_props() {
     return 0;
 }
 
+// What the updater reports with "profile" for each top-level statement
+// of its script.
+struct profile_entry {
+    char name[64];
+    int line;
+    int count;          // statements added up in a per-function total
+    long long ns;
+    unsigned long long rchar, wchar, syscr, syscw;
+};
+
+struct install_profile {
+    struct profile_entry *entries;
+    int count;
+    int alloc;
+};
+
+static void add_profile_entry(struct install_profile *profile, const char *args) {
+    struct profile_entry e;
+    if (args == NULL ||
+        sscanf(args, "%63s %d %lld %llu %llu %llu %llu", e.name, &e.line, &e.ns,
+               &e.rchar, &e.wchar, &e.syscr, &e.syscw) != 7)
+        return;
+    e.count = 1;
+    if (profile->count == profile->alloc) {
+        int alloc = profile->alloc ? profile->alloc * 2 : 256;
+        struct profile_entry *grown = realloc(profile->entries, alloc * sizeof(e));
+        if (grown == NULL)
+            return;
+        profile->entries = grown;
+        profile->alloc = alloc;
+    }
+    profile->entries[profile->count++] = e;
+}
+
+static int compare_profile_time(const void *a, const void *b) {
+    long long x = ((const struct profile_entry *)a)->ns;
+    long long y = ((const struct profile_entry *)b)->ns;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static int compare_profile_name(const void *a, const void *b) {
+    return strcmp(((const struct profile_entry *)a)->name,
+                  ((const struct profile_entry *)b)->name);
+}
+
+static void print_profile_entry(FILE *f, const struct profile_entry *e, const char *where) {
+    fprintf(f, "%10.1f %10llu %10llu %8llu %8llu  %s%s\n",
+            e->ns / 1000000.0, e->rchar / 1024, e->wchar / 1024,
+            e->syscr, e->syscw, e->name, where);
+}
+
+// Writes the statements slowest first, then the same totalled per
+// function.  Sorts (and so reorders) the entries.
+static void write_install_profile(const char *path, struct install_profile *profile) {
+    int i, j;
+    if (profile->count == 0)
+        return;
+
+    FILE *f = fopen_path(LAST_INSTALL_PROFILE_FILE, "w");
+    if (f == NULL) {
+        LOGE("failed to open %s: %s\n", LAST_INSTALL_PROFILE_FILE, strerror(errno));
+        return;
+    }
+
+    struct profile_entry total;
+    memset(&total, 0, sizeof(total));
+    strcpy(total.name, "total");
+    for (i = 0; i < profile->count; i++) {
+        total.ns += profile->entries[i].ns;
+        total.rchar += profile->entries[i].rchar;
+        total.wchar += profile->entries[i].wchar;
+        total.syscr += profile->entries[i].syscr;
+        total.syscw += profile->entries[i].syscw;
+    }
+
+    fprintf(f, "%s\n\n", path);
+    fprintf(f, "%10s %10s %10s %8s %8s  %s\n",
+            "ms", "read KiB", "write KiB", "reads", "writes", "statement");
+    print_profile_entry(f, &total, "");
+    qsort(profile->entries, profile->count, sizeof(struct profile_entry), compare_profile_time);
+    for (i = 0; i < profile->count; i++) {
+        char where[32];
+        snprintf(where, sizeof(where), " (line %d)", profile->entries[i].line);
+        print_profile_entry(f, &profile->entries[i], where);
+    }
+
+    // mergesort isn't in bionic; stable order within a name doesn't
+    // matter once they are added up
+    qsort(profile->entries, profile->count, sizeof(struct profile_entry), compare_profile_name);
+    int nfunctions = 0;
+    for (i = 0; i < profile->count; i = j) {
+        struct profile_entry *sum = &profile->entries[nfunctions++];
+        *sum = profile->entries[i];
+        for (j = i + 1; j < profile->count &&
+                 strcmp(profile->entries[j].name, sum->name) == 0; j++) {
+            sum->ns += profile->entries[j].ns;
+            sum->rchar += profile->entries[j].rchar;
+            sum->wchar += profile->entries[j].wchar;
+            sum->syscr += profile->entries[j].syscr;
+            sum->syscw += profile->entries[j].syscw;
+            sum->count += profile->entries[j].count;
+        }
+    }
+    qsort(profile->entries, nfunctions, sizeof(struct profile_entry), compare_profile_time);
+    fprintf(f, "\n%10s %10s %10s %8s %8s  %s\n",
+            "ms", "read KiB", "write KiB", "reads", "writes", "function");
+    for (i = 0; i < nfunctions; i++) {
+        char where[32];
+        snprintf(where, sizeof(where), " (%d call%s)", profile->entries[i].count,
+                 profile->entries[i].count == 1 ? "" : "s");
+        print_profile_entry(f, &profile->entries[i], where);
+    }
+
+    fclose(f);
+    chmod(LAST_INSTALL_PROFILE_FILE, 0644);
+}
+
+// Update binaries and scripts, named for their CRC and size, so
+// packages flashed repeatedly in a session aren't inflated again.  The
+// updater is told about it with UPDATE_CACHE_DIR.
+#define UPDATE_CACHE_DIR "/tmp/update_cache"
+#define UPDATE_CACHE_MAX_BYTES (32 * 1024 * 1024)
+
+struct cached_file {
+    char name[NAME_MAX + 1];
+    time_t used;
+    off_t size;
+};
+
+static int compare_cached_used(const void *a, const void *b) {
+    time_t x = ((const struct cached_file *)a)->used;
+    time_t y = ((const struct cached_file *)b)->used;
+    return x < y ? -1 : x > y;
+}
+
+// Removes the least recently used files until need more bytes fit.
+static void prune_update_cache(long need) {
+    DIR *d = opendir(UPDATE_CACHE_DIR);
+    if (d == NULL)
+        return;
+
+    struct cached_file *files = NULL;
+    int count = 0, alloc = 0, i;
+    long long total = 0;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        struct stat st;
+        if (de->d_name[0] == '.' || fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0 ||
+            !S_ISREG(st.st_mode))
+            continue;
+        if (count == alloc) {
+            alloc = alloc ? alloc * 2 : 16;
+            struct cached_file *grown = realloc(files, alloc * sizeof(*files));
+            if (grown == NULL)
+                break;
+            files = grown;
+        }
+        strlcpy(files[count].name, de->d_name, sizeof(files[count].name));
+        files[count].used = st.st_mtime;
+        files[count].size = st.st_size;
+        total += st.st_size;
+        count++;
+    }
+
+    qsort(files, count, sizeof(*files), compare_cached_used);
+    for (i = 0; i < count && total + need > UPDATE_CACHE_MAX_BYTES; i++) {
+        if (unlinkat(dirfd(d), files[i].name, 0) == 0)
+            total -= files[i].size;
+    }
+    free(files);
+    closedir(d);
+}
+
+// What scan_update_binary() found in the last few update binaries, by
+// the CRC and size the package lists for them, for packages flashed
+// again in the same session.
+#define BINARY_SCAN_CACHE_SIZE 8
+
+struct binary_scan {
+    long crc32;
+    long size;
+    bool set_perm;
+    bool set_metadata;
+};
+
+static struct binary_scan binary_scan_cache[BINARY_SCAN_CACHE_SIZE];
+static int binary_scan_count;
+
+// Looks for the names of the set_perm and set_metadata families of
+// functions in the string data of the update binary extracted from
+// entry to path.
+static int scan_update_binary(const char *path, const ZipEntry *entry,
+                              bool *set_perm, bool *set_metadata) {
+    static const char *const patterns[] = { "set_perm_", "set_metadata_" };
+    bool found[2];
+    int i;
+
+    for (i = 0; i < binary_scan_count; i++) {
+        struct binary_scan *scan = &binary_scan_cache[i];
+        if (scan->crc32 == entry->crc32 && scan->size == entry->uncompLen) {
+            *set_perm = scan->set_perm;
+            *set_metadata = scan->set_metadata;
+            return 0;
+        }
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        return -1;
+    }
+    // just written to /tmp, so this is all in the page cache already
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return -1;
+    elf_find_strings(data, st.st_size, patterns, 2, found);
+    munmap(data, st.st_size);
+
+    *set_perm = found[0];
+    *set_metadata = found[1];
+    struct binary_scan *scan = &binary_scan_cache[binary_scan_count < BINARY_SCAN_CACHE_SIZE ?
+            binary_scan_count++ : (unsigned long)entry->crc32 % BINARY_SCAN_CACHE_SIZE];
+    scan->crc32 = entry->crc32;
+    scan->size = entry->uncompLen;
+    scan->set_perm = found[0];
+    scan->set_metadata = found[1];
+    return 0;
+}
+
+// The command pipe is drained by a thread of its own into a short
+// queue, so the updater never waits for us to draw.  A print is joined
+// to the last queued print and a set_progress replaces the last queued
+// one, as long as no other command is queued after them; the two may
+// pass each other, which only changes when the bar moves.  The queue
+// only fills up, and holds the updater back, if it sends other
+// commands faster than we handle them.
+#define UPDATER_QUEUE_MAX 64
+#define UPDATER_PRINT_MAX 16384
+
+struct updater_msg {
+    struct updater_msg *next;
+    int type;                   // FRAME_*
+    float fraction;
+    int seconds;
+    char *data;                 // print text, or a command line
+    size_t len;
+};
+
+struct updater_channel {
+    int fd;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        // queued, dequeued, or eof
+    struct updater_msg *head, *tail;
+    struct updater_msg *last_print, *last_set_progress;
+    struct install_profile *profile;    // only the reader touches it
+    int queued;
+    int max_queued;
+    int eof;
+};
+
+static void free_updater_msg(struct updater_msg *msg) {
+    free(msg->data);
+    free(msg);
+}
+
+// Takes ownership of msg.
+static void queue_updater_msg(struct updater_channel *ch, struct updater_msg *msg) {
+    pthread_mutex_lock(&ch->lock);
+    if (msg->type == FRAME_SET_PROGRESS && ch->last_set_progress != NULL) {
+        ch->last_set_progress->fraction = msg->fraction;
+        pthread_mutex_unlock(&ch->lock);
+        free_updater_msg(msg);
+        return;
+    }
+    struct updater_msg *last = ch->last_print;
+    if (msg->type == FRAME_PRINT && last != NULL &&
+            last->len + msg->len <= UPDATER_PRINT_MAX) {
+        char *data = realloc(last->data, last->len + msg->len + 1);
+        if (data != NULL) {
+            memcpy(data + last->len, msg->data, msg->len + 1);
+            last->data = data;
+            last->len += msg->len;
+            pthread_mutex_unlock(&ch->lock);
+            free_updater_msg(msg);
+            return;
+        }
+    }
+    while (ch->queued >= ch->max_queued)
+        pthread_cond_wait(&ch->cond, &ch->lock);
+    msg->next = NULL;
+    if (ch->tail != NULL)
+        ch->tail->next = msg;
+    else
+        ch->head = msg;
+    ch->tail = msg;
+    ch->queued++;
+    if (msg->type == FRAME_PRINT) {
+        ch->last_print = msg;
+    } else if (msg->type == FRAME_SET_PROGRESS) {
+        ch->last_set_progress = msg;
+    } else {
+        ch->last_print = NULL;
+        ch->last_set_progress = NULL;
+    }
+    pthread_cond_broadcast(&ch->cond);
+    pthread_mutex_unlock(&ch->lock);
+}
+
+static struct updater_msg *new_updater_msg(int type, const char *data, size_t len) {
+    struct updater_msg *msg = calloc(1, sizeof(*msg));
+    if (msg == NULL)
+        return NULL;
+    msg->type = type;
+    msg->data = malloc(len + 1);
+    if (msg->data == NULL) {
+        free(msg);
+        return NULL;
+    }
+    memcpy(msg->data, data, len);
+    msg->data[len] = '\0';
+    msg->len = len;
+    return msg;
+}
+
+// A text command line, as updaters before API v4 send them and as
+// scripts echo them to the fd.
+static struct updater_msg *parse_text_command(char *line, size_t len) {
+    line[len] = '\0';
+    char *copy = strdup(line);
+    if (copy == NULL)
+        return NULL;
+
+    struct updater_msg *msg = NULL;
+    char *command = strtok(copy, " \n");
+    if (command == NULL) {
+        // blank line
+    } else if (strcmp(command, "progress") == 0) {
+        char* fraction_s = strtok(NULL, " \n");
+        char* seconds_s = strtok(NULL, " \n");
+        if ((msg = new_updater_msg(FRAME_PROGRESS, "", 0)) != NULL) {
+            msg->fraction = fraction_s ? strtof(fraction_s, NULL) : 0;
+            msg->seconds = seconds_s ? strtol(seconds_s, NULL, 10) : 0;
+        }
+    } else if (strcmp(command, "set_progress") == 0) {
+        char* fraction_s = strtok(NULL, " \n");
+        if ((msg = new_updater_msg(FRAME_SET_PROGRESS, "", 0)) != NULL)
+            msg->fraction = fraction_s ? strtof(fraction_s, NULL) : 0;
+    } else if (strcmp(command, "ui_print") == 0) {
+        char* str = strtok(NULL, "\n");
+        msg = str ? new_updater_msg(FRAME_PRINT, str, strlen(str))
+                  : new_updater_msg(FRAME_PRINT, "\n", 1);
+    } else {
+        msg = new_updater_msg(FRAME_COMMAND, line, len);
+    }
+    free(copy);
+    return msg;
+}
+
+static struct updater_msg *parse_frame(const unsigned char *payload, int type, size_t len) {
+    struct updater_msg *msg = NULL;
+    switch (type) {
+        case FRAME_PRINT:
+        case FRAME_COMMAND:
+            msg = new_updater_msg(type, (const char *)payload, len);
+            break;
+        case FRAME_PROGRESS: {
+            struct frame_progress progress;
+            if (len != sizeof(progress))
+                break;
+            memcpy(&progress, payload, sizeof(progress));
+            if ((msg = new_updater_msg(type, "", 0)) != NULL) {
+                msg->fraction = progress.fraction;
+                msg->seconds = progress.seconds;
+            }
+            break;
+        }
+        case FRAME_SET_PROGRESS:
+            if (len != sizeof(float))
+                break;
+            if ((msg = new_updater_msg(type, "", 0)) != NULL)
+                memcpy(&msg->fraction, payload, sizeof(float));
+            break;
+    }
+    if (msg == NULL)
+        LOGE("bad command frame (type 0x%02x, %zu bytes)\n", type, len);
+    return msg;
+}
+
+// The size of the frame starting buf, 0 if the header isn't all there
+// yet, or -1 if buf doesn't start with a frame.  Only the known types
+// with a length the updater can send count; anything else, stray high
+// bytes from a script included, is read as text.
+static int frame_size(const char *buf, size_t len) {
+    switch ((unsigned char)buf[0]) {
+        case FRAME_PRINT:
+        case FRAME_PROGRESS:
+        case FRAME_SET_PROGRESS:
+        case FRAME_COMMAND:
+            break;
+        default:
+            return -1;
+    }
+    if (len < FRAME_HEADER_SIZE)
+        return 0;
+    size_t payload = (unsigned char)buf[1] | ((unsigned char)buf[2] << 8);
+    if (payload > FRAME_MAX_PAYLOAD)
+        return -1;
+    return FRAME_HEADER_SIZE + payload;
+}
+
+// Returns how much of buf was one complete frame or line, or 0 if it
+// needs more data.
+static size_t parse_updater_msg(struct updater_channel *ch, char *buf, size_t len) {
+    struct updater_msg *msg;
+    size_t used;
+    int frame = frame_size(buf, len);
+
+    if (frame == 0)
+        return 0;
+    if (frame > 0) {
+        if (len < (size_t)frame)
+            return 0;
+        msg = parse_frame((unsigned char *)buf + FRAME_HEADER_SIZE,
+                          (unsigned char)buf[0], frame - FRAME_HEADER_SIZE);
+        used = frame;
+    } else {
+        char *nl = memchr(buf, '\n', len);
+        if (nl == NULL)
+            return 0;
+        msg = parse_text_command(buf, nl - buf);
+        used = nl - buf + 1;
+    }
+    if (msg != NULL && msg->type == FRAME_COMMAND &&
+            strncmp(msg->data, "profile ", 8) == 0) {
+        // one of these per statement; recorded here instead of queued so
+        // they can't fill the queue and hold up the updater
+        add_profile_entry(ch->profile, msg->data + 8);
+        free_updater_msg(msg);
+    } else if (msg != NULL) {
+        queue_updater_msg(ch, msg);
+    }
+    return used;
+}
+
+static void *updater_reader_thread(void *cookie) {
+    struct updater_channel *ch = cookie;
+    char buf[2 * PIPE_BUF + 1];
+    size_t have = 0;
+
+    for (;;) {
+        ssize_t n = read(ch->fd, buf + have, sizeof(buf) - 1 - have);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        have += n;
+
+        size_t pos = 0, used;
+        while (pos < have && (used = parse_updater_msg(ch, buf + pos, have - pos)) > 0)
+            pos += used;
+        memmove(buf, buf + pos, have - pos);
+        have -= pos;
+
+        // frames always fit, so a full buffer is a text line longer than
+        // that: take what we have as a line
+        if (have == sizeof(buf) - 1) {
+            buf[have++] = '\n';
+            parse_updater_msg(ch, buf, have);
+            have = 0;
+        }
+    }
+    if (have > 0 && frame_size(buf, have) < 0) {
+        buf[have++] = '\n';
+        parse_updater_msg(ch, buf, have);
+    }
+
+    pthread_mutex_lock(&ch->lock);
+    ch->eof = 1;
+    pthread_cond_broadcast(&ch->cond);
+    pthread_mutex_unlock(&ch->lock);
+    return NULL;
+}
+
+// Returns the next command, or NULL once the updater has closed its end
+// and everything it sent has been handled.
+static struct updater_msg *next_updater_msg(struct updater_channel *ch) {
+    pthread_mutex_lock(&ch->lock);
+    while (ch->head == NULL && !ch->eof)
+        pthread_cond_wait(&ch->cond, &ch->lock);
+    struct updater_msg *msg = ch->head;
+    if (msg != NULL) {
+        ch->head = msg->next;
+        if (ch->head == NULL)
+            ch->tail = NULL;
+        if (ch->last_print == msg)
+            ch->last_print = NULL;
+        if (ch->last_set_progress == msg)
+            ch->last_set_progress = NULL;
+        ch->queued--;
+        pthread_cond_broadcast(&ch->cond);
+    }
+    pthread_mutex_unlock(&ch->lock);
+    return msg;
+}
+
 // If the package contains an update binary, extract it and run it.
 static int
 try_update_binary(const char *path, ZipArchive *zip) {
@@ -173,18 +692,11 @@ try_update_binary(const char *path, ZipArchive *zip) {
         return INSTALL_UPDATE_BINARY_MISSING;
     }
 
-    char* binary = "/tmp/update_binary";
-    unlink(binary);
-    int fd = creat(binary, 0755);
-    if (fd < 0) {
-        mzCloseZipArchive(zip);
-        LOGE("Can't make %s\n", binary);
-        return 1;
-    }
-    bool ok = mzExtractZipEntryToFile(zip, binary_entry, fd);
-    close(fd);
-
-    if (!ok) {
+    // Packages flashed again reuse the binary already in the cache.
+    char binary[PATH_MAX];
+    prune_update_cache(binary_entry->uncompLen);
+    if (!mzExtractZipEntryToCache(zip, binary_entry, UPDATE_CACHE_DIR, 0755,
+                                  binary, sizeof(binary))) {
         LOGE("Can't copy %s\n", ASSUMED_UPDATE_BINARY_NAME);
         mzCloseZipArchive(zip);
         return 1;
@@ -200,41 +712,12 @@ try_update_binary(const char *path, ZipArchive *zip) {
      *
      * Also, I hate matching strings in binary blobs */
 
-    FILE *updaterfile = fopen(binary, "rb");
-    char tmpbuf;
-    char setpermmatch[9] = { 's','e','t','_','p','e','r','m','_' };
-    char setmetamatch[13] = { 's','e','t','_','m','e','t','a','d','a','t','a','_' };
-    size_t pos = 0;
     bool foundsetperm = false;
     bool foundsetmeta = false;
-
-    if (updaterfile == NULL) {
+    if (scan_update_binary(binary, binary_entry, &foundsetperm, &foundsetmeta) != 0) {
         LOGE("Can't find %s for validation\n", ASSUMED_UPDATE_BINARY_NAME);
         return 1;
     }
-    fseek(updaterfile, 0, SEEK_SET);
-    while (!feof(updaterfile)) {
-        fread(&tmpbuf, 1, 1, updaterfile);
-        if (!foundsetperm && pos < sizeof(setpermmatch) && tmpbuf == setpermmatch[pos]) {
-            pos++;
-            if (pos == sizeof(setpermmatch)) {
-                foundsetperm = true;
-                pos = 0;
-            }
-            continue;
-        }
-        if (!foundsetmeta && tmpbuf == setmetamatch[pos]) {
-            pos++;
-            if (pos == sizeof(setmetamatch)) {
-                foundsetmeta = true;
-                pos = 0;
-            }
-            continue;
-        }
-        /* None of the match loops got a continuation, reset the counter */
-        pos = 0;
-    }
-    fclose(updaterfile);
 
     /* Set legacy properties */
     if (foundsetperm && !foundsetmeta) {
@@ -280,6 +763,16 @@ try_update_binary(const char *path, ZipArchive *zip) {
     //        ui_print <string>
     //            display <string> on the screen.
     //
+    //        profile <function> <line> <ns> <rchar> <wchar> <syscr> <syscw>
+    //            after each top-level statement of the script, when
+    //            UPDATE_PROFILE is set in the environment: what it
+    //            called, where, and the time and I/O it took.
+    //
+    //     (API v4: with UPDATE_COMMAND_API=4 in its environment, the
+    //     program sends the same commands as the frames described in
+    //     updater/frames.h.  Text lines are still accepted, since
+    //     scripts the program runs echo them to the same fd.)
+    //
     //   - the name of the package zip file.
     //
 
@@ -291,9 +784,16 @@ try_update_binary(const char *path, ZipArchive *zip) {
     args[3] = (char*)path;
     args[4] = NULL;
 
+    // the child writes to the same log; get our side of it out first
+    log_flush();
     pid_t pid = fork();
     if (pid == 0) {
         setenv("UPDATE_PACKAGE", path, 1);
+        setenv("UPDATE_PROFILE", "1", 1);
+        setenv("UPDATE_CACHE_DIR", UPDATE_CACHE_DIR, 1);
+        char api[12];
+        snprintf(api, sizeof(api), "%d", COMMAND_API_FRAMED);
+        setenv(COMMAND_API_ENV, api, 1);
         close(pipefd[0]);
         execve(binary, args, environ);
         fprintf(stdout, "E:Can't run %s (%s)\n", binary, strerror(errno));
@@ -303,54 +803,71 @@ try_update_binary(const char *path, ZipArchive *zip) {
 
     char* firmware_type = NULL;
     char* firmware_filename = NULL;
+    struct install_profile profile;
+    memset(&profile, 0, sizeof(profile));
 
-    char buffer[1024];
-    FILE* from_child = fdopen(pipefd[0], "r");
-    while (fgets(buffer, sizeof(buffer), from_child) != NULL) {
-        char* command = strtok(buffer, " \n");
-        if (command == NULL) {
-            continue;
-        } else if (strcmp(command, "progress") == 0) {
-            char* fraction_s = strtok(NULL, " \n");
-            char* seconds_s = strtok(NULL, " \n");
-
-            float fraction = strtof(fraction_s, NULL);
-            int seconds = strtol(seconds_s, NULL, 10);
-
-            ui_show_progress(fraction * (1-VERIFICATION_PROGRESS_FRACTION),
-                             seconds);
-        } else if (strcmp(command, "set_progress") == 0) {
-            char* fraction_s = strtok(NULL, " \n");
-            float fraction = strtof(fraction_s, NULL);
-            ui_set_progress(fraction);
-        } else if (strcmp(command, "firmware") == 0) {
-            char* type = strtok(NULL, " \n");
-            char* filename = strtok(NULL, " \n");
-
-            if (type != NULL && filename != NULL) {
-                if (firmware_type != NULL) {
-                    LOGE("ignoring attempt to do multiple firmware updates");
-                } else {
-                    firmware_type = strdup(type);
-                    firmware_filename = strdup(filename);
+    struct updater_channel channel;
+    pthread_t reader;
+    memset(&channel, 0, sizeof(channel));
+    channel.fd = pipefd[0];
+    channel.max_queued = UPDATER_QUEUE_MAX;
+    channel.profile = &profile;
+    pthread_mutex_init(&channel.lock, NULL);
+    pthread_cond_init(&channel.cond, NULL);
+    bool threaded = pthread_create(&reader, NULL, updater_reader_thread, &channel) == 0;
+    if (!threaded) {
+        // read it all first, then handle it
+        channel.max_queued = INT_MAX;
+        updater_reader_thread(&channel);
+    }
+
+    struct updater_msg* msg;
+    while ((msg = next_updater_msg(&channel)) != NULL) {
+        if (msg->type == FRAME_PROGRESS) {
+            ui_show_progress(msg->fraction * (1-VERIFICATION_PROGRESS_FRACTION),
+                             msg->seconds);
+        } else if (msg->type == FRAME_SET_PROGRESS) {
+            ui_set_progress(msg->fraction);
+        } else if (msg->type == FRAME_PRINT) {
+            // ui_print() formats into 256 bytes
+            size_t pos;
+            for (pos = 0; pos < msg->len; pos += 255)
+                ui_print("%.255s", msg->data + pos);
+        } else {
+            char* command = strtok(msg->data, " \n");
+            if (command == NULL) {
+                // empty
+            } else if (strcmp(command, "firmware") == 0) {
+                char* type = strtok(NULL, " \n");
+                char* filename = strtok(NULL, " \n");
+
+                if (type != NULL && filename != NULL) {
+                    if (firmware_type != NULL) {
+                        LOGE("ignoring attempt to do multiple firmware updates");
+                    } else {
+                        firmware_type = strdup(type);
+                        firmware_filename = strdup(filename);
+                    }
                 }
-            }
-        } else if (strcmp(command, "ui_print") == 0) {
-            char* str = strtok(NULL, "\n");
-            if (str) {
-                ui_print("%s", str);
             } else {
-                ui_print("\n");
+                LOGE("unknown command [%s]\n", command);
             }
-        } else {
-            LOGE("unknown command [%s]\n", command);
         }
+        free_updater_msg(msg);
     }
-    fclose(from_child);
+    if (threaded)
+        pthread_join(reader, NULL);
+    pthread_cond_destroy(&channel.cond);
+    pthread_mutex_destroy(&channel.lock);
+    close(pipefd[0]);
 
     int status;
     waitpid(pid, &status, 0);
 
+    // also for a failed install: where it stopped is worth knowing
+    write_install_profile(path, &profile);
+    free(profile.entries);
+
     /* Unset legacy properties */
     if (legacy_props_path_modified) {
         if (unset_legacy_props() != 0) {
@@ -375,6 +892,215 @@ try_update_binary(const char *path, ZipArchive *zip) {
     return INSTALL_SUCCESS;
 }
 
+// The package is installed straight from where it lives, so it is held
+// open from verification until update-binary is done with it.  A read
+// lease makes anyone opening it for writing wait and tells us about it;
+// on filesystems without leases the inode and timestamps still have to
+// match at every step.
+typedef struct {
+    int fd;
+    struct stat st;
+    int leased;
+    struct sigaction old_sigio;
+} Package;
+
+static volatile sig_atomic_t package_lease_broken = 0;
+
+static void lease_break_handler(int sig) {
+    package_lease_broken = 1;
+}
+
+static int
+open_package(const char *path, Package *pkg)
+{
+    pkg->leased = 0;
+    pkg->fd = open(path, O_RDONLY);
+    if (pkg->fd < 0)
+        return -1;
+    fcntl(pkg->fd, F_SETFD, FD_CLOEXEC);
+    if (fstat(pkg->fd, &pkg->st) != 0) {
+        close(pkg->fd);
+        return -1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = lease_break_handler;
+    sigaction(SIGIO, &sa, &pkg->old_sigio);
+    package_lease_broken = 0;
+    fcntl(pkg->fd, F_SETOWN, getpid());
+    pkg->leased = fcntl(pkg->fd, F_SETLEASE, F_RDLCK) == 0;
+    if (!pkg->leased)
+        LOGI("no lease on %s (%s)\n", path, strerror(errno));
+    return 0;
+}
+
+static int
+package_unchanged(const char *path, const Package *pkg)
+{
+    struct stat now, named;
+    if (package_lease_broken)
+        return 0;
+    if (fstat(pkg->fd, &now) != 0 ||
+        now.st_size != pkg->st.st_size ||
+        now.st_mtime != pkg->st.st_mtime ||
+        now.st_ctime != pkg->st.st_ctime)
+        return 0;
+    // update-binary opens it again by name
+    if (stat(path, &named) != 0 ||
+        named.st_dev != pkg->st.st_dev ||
+        named.st_ino != pkg->st.st_ino)
+        return 0;
+    return 1;
+}
+
+static void
+close_package(Package *pkg)
+{
+    if (pkg->leased)
+        fcntl(pkg->fd, F_SETLEASE, F_UNLCK);
+    close(pkg->fd);
+    sigaction(SIGIO, &pkg->old_sigio, NULL);
+}
+
+// Packages that passed signature verification this session.  A
+// package is known by its inode, size and times, which any write
+// changes, and by a hash of its tail: the central directory and the
+// signature itself.
+#define VERIFIED_CACHE_SIZE 16
+#define VERIFIED_TAIL_BYTES 65536
+
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    time_t ctime;
+    uint8_t tail_sha[SHA_DIGEST_SIZE];
+} VerifiedPackage;
+
+static VerifiedPackage verified_packages[VERIFIED_CACHE_SIZE];
+static int verified_count;
+// also used by the thread verify_package_async() starts
+static pthread_mutex_t verified_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+package_key(const Package *pkg, VerifiedPackage *key)
+{
+    off_t len = pkg->st.st_size < VERIFIED_TAIL_BYTES ? pkg->st.st_size : VERIFIED_TAIL_BYTES;
+    uint8_t *tail = malloc(len);
+    if (tail == NULL || pread(pkg->fd, tail, len, pkg->st.st_size - len) != len) {
+        free(tail);
+        return -1;
+    }
+    memset(key, 0, sizeof(*key));
+    key->dev = pkg->st.st_dev;
+    key->ino = pkg->st.st_ino;
+    key->size = pkg->st.st_size;
+    key->mtime = pkg->st.st_mtime;
+    key->ctime = pkg->st.st_ctime;
+    SHA_hash(tail, len, key->tail_sha);
+    free(tail);
+    return 0;
+}
+
+static int
+find_verified_package_locked(const VerifiedPackage *key)
+{
+    int i;
+    for (i = 0; i < verified_count; i++) {
+        if (memcmp(&verified_packages[i], key, sizeof(*key)) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+static int
+package_verified_before(const VerifiedPackage *key)
+{
+    pthread_mutex_lock(&verified_lock);
+    int found = find_verified_package_locked(key);
+    pthread_mutex_unlock(&verified_lock);
+    return found;
+}
+
+static void
+remember_verified_package(const VerifiedPackage *key)
+{
+    pthread_mutex_lock(&verified_lock);
+    if (!find_verified_package_locked(key)) {
+        if (verified_count < VERIFIED_CACHE_SIZE) {
+            verified_packages[verified_count++] = *key;
+        } else {
+            memmove(verified_packages, verified_packages + 1,
+                    (VERIFIED_CACHE_SIZE - 1) * sizeof(VerifiedPackage));
+            verified_packages[VERIFIED_CACHE_SIZE - 1] = *key;
+        }
+    }
+    pthread_mutex_unlock(&verified_lock);
+}
+
+// Verification of the next package of a batch, done while the current
+// one installs.  It only records packages that pass; anything else is
+// verified again, with the usual prompt, when it is installed.
+static pthread_t background_verify_thread;
+static int background_verify_running;
+static char background_verify_path[PATH_MAX];
+
+static void *
+verify_package_thread(void *cookie)
+{
+    const char *path = background_verify_path;
+    Package pkg;
+    VerifiedPackage key;
+
+    memset(&pkg, 0, sizeof(pkg));
+    pkg.fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (pkg.fd < 0)
+        return NULL;
+    if (fstat(pkg.fd, &pkg.st) == 0 && package_key(&pkg, &key) == 0 &&
+        !package_verified_before(&key)) {
+        int numKeys;
+        Certificate* loadedKeys = load_keys(PUBLIC_KEYS_FILE, &numKeys);
+        if (loadedKeys != NULL) {
+            struct stat now;
+            int err = verify_fd_silent(pkg.fd, path, loadedKeys, numKeys);
+            free(loadedKeys);
+            LOGI("background verification of %s returned %d\n", path, err);
+            if (err == VERIFY_SUCCESS && fstat(pkg.fd, &now) == 0 &&
+                now.st_size == pkg.st.st_size &&
+                now.st_mtime == pkg.st.st_mtime &&
+                now.st_ctime == pkg.st.st_ctime)
+                remember_verified_package(&key);
+        }
+    }
+    close(pkg.fd);
+    return NULL;
+}
+
+void
+verify_package_async(const char *path)
+{
+    wait_package_verification();
+    if (!signature_check_enabled)
+        return;
+    // mount it here; roots.c isn't safe to use from two threads
+    if (ensure_path_mounted(path) != 0)
+        return;
+    strlcpy(background_verify_path, path, sizeof(background_verify_path));
+    background_verify_running =
+        pthread_create(&background_verify_thread, NULL, verify_package_thread, NULL) == 0;
+}
+
+void
+wait_package_verification(void)
+{
+    if (background_verify_running) {
+        pthread_join(background_verify_thread, NULL);
+        background_verify_running = 0;
+    }
+}
+
 static int
 really_install_package(const char *path)
 {
@@ -412,12 +1138,23 @@ really_install_package(const char *path)
     ui_print("Opening update package...\n");
 
     int err;
+    Package pkg;
+    if (open_package(path, &pkg) != 0) {
+        LOGE("Can't open %s\n(%s)\n", path, strerror(errno));
+        return INSTALL_CORRUPT;
+    }
 
-    if (signature_check_enabled) {
+    VerifiedPackage key;
+    int have_key = signature_check_enabled && package_key(&pkg, &key) == 0;
+    int verified = 0;
+    if (have_key && package_verified_before(&key)) {
+        LOGI("%s was verified earlier; skipping verification\n", path);
+    } else if (signature_check_enabled) {
         int numKeys;
         Certificate* loadedKeys = load_keys(PUBLIC_KEYS_FILE, &numKeys);
         if (loadedKeys == NULL) {
             LOGE("Failed to load keys\n");
+            close_package(&pkg);
             return INSTALL_CORRUPT;
         }
         LOGI("%d key(s) loaded from %s\n", numKeys, PUBLIC_KEYS_FILE);
@@ -428,30 +1165,48 @@ really_install_package(const char *path)
                 VERIFICATION_PROGRESS_FRACTION,
                 VERIFICATION_PROGRESS_TIME);
 
-        err = verify_file(path, loadedKeys, numKeys);
+        err = verify_fd(pkg.fd, path, loadedKeys, numKeys);
         free(loadedKeys);
         LOGI("verify_file returned %d\n", err);
         if (err != VERIFY_SUCCESS) {
             LOGE("signature verification failed\n");
             ui_show_text(1);
-            if (!confirm_selection("Install Untrusted Package?", "Yes - Install untrusted zip"))
+            if (!confirm_selection("Install Untrusted Package?", "Yes - Install untrusted zip")) {
+                close_package(&pkg);
                 return INSTALL_CORRUPT;
+            }
+        } else {
+            verified = 1;
         }
     }
 
     /* Try to open the package.
      */
     ZipArchive zip;
-    err = mzOpenZipArchive(path, &zip);
+    err = mzOpenZipArchiveFd(pkg.fd, &zip);
     if (err != 0) {
         LOGE("Can't open %s\n(%s)\n", path, err != -1 ? strerror(err) : "bad");
+        close_package(&pkg);
+        return INSTALL_CORRUPT;
+    }
+
+    if (!package_unchanged(path, &pkg)) {
+        LOGE("%s changed while it was being verified\n", path);
+        mzCloseZipArchive(&zip);
+        close_package(&pkg);
         return INSTALL_CORRUPT;
     }
+    if (verified && have_key)
+        remember_verified_package(&key);
 
     /* Verify and install the contents of the package.
      */
     ui_print("Installing update...\n");
-    return try_update_binary(path, &zip);
+    int result = try_update_binary(path, &zip);
+    if (result == INSTALL_SUCCESS && !package_unchanged(path, &pkg))
+        LOGW("%s was modified during the install\n", path);
+    close_package(&pkg);
+    return result;
 }
 
 int
@@ -465,6 +1220,8 @@ install_package(const char* path)
         LOGE("failed to open last_install: %s\n", strerror(errno));
     }
     int result = really_install_package(path);
+    // whatever the script wrote, backup totals scanned before are stale
+    dir_stats_invalidate();
     if (install_log) {
         fputc(result == INSTALL_SUCCESS ? '1' : '0', install_log);
         fputc('\n', install_log);
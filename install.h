@@ -22,4 +22,10 @@
 enum { INSTALL_SUCCESS, INSTALL_ERROR, INSTALL_CORRUPT, INSTALL_UPDATE_SCRIPT_MISSING, INSTALL_UPDATE_BINARY_MISSING };
 int install_package(const char *root_path);
 
+// Start verifying the signature of a package that will be installed
+// next, on a thread of its own, so install_package() can skip it.
+// Waits for the one started before, if any.
+void verify_package_async(const char *path);
+void wait_package_verification(void);
+
 #endif  // RECOVERY_INSTALL_H_
@@ -3,7 +3,7 @@ LOCAL_PATH := $(call my-dir)
 ifneq ($(TARGET_SIMULATOR),true)
 
 include $(CLEAR_VARS)
-LOCAL_SRC_FILES := system.c popen.c
+LOCAL_SRC_FILES := system.c popen.c fileops.c dirstats.c wipe.c
 LOCAL_MODULE := libcrecovery
 LOCAL_MODULE_TAGS := eng
 include $(BUILD_STATIC_LIBRARY)
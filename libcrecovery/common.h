@@ -2,9 +2,60 @@
 #define LIBCRECOVERY_COMMON_H
 
 #include <stdio.h>
+#include <sys/types.h>
 
 int __system(const char *command);
 FILE * __popen(const char *program, const char *type);
 int __pclose(FILE *iop);
 
-#endif
\ No newline at end of file
+// Same as above, but run argv[0] directly with an argument vector instead
+// of going through "sh -c", so nothing needs quoting and no shell is forked.
+int __systemv(char *const argv[]);
+FILE * __popenv(char *const argv[], const char *type);
+
+struct dir_sizes;
+
+struct dir_stats {
+    long long entries;      // what find would print, path itself included
+    long long bytes;        // total size of the regular files
+    struct dir_sizes *sizes;  // per file, from dir_stats_cached() only
+};
+
+// Scan the tree at path with several threads, skipping the subtree at
+// exclude (may be NULL).  Symlinks are counted but not followed.
+int dir_stats(const char *path, const char *exclude, struct dir_stats *stats);
+
+// Same, but reuses an earlier result for path while its volume stays
+// mounted.  Call dir_stats_invalidate() after changing files in place.
+// The sizes of the files are kept too, and stay valid until the next
+// dir_stats_cached() or dir_stats_invalidate().
+int dir_stats_cached(const char *path, const char *exclude, struct dir_stats *stats);
+void dir_stats_invalidate(void);
+
+// Size of the regular file at path as seen by the scan behind stats:
+// 0 for anything it didn't see as a non-empty file, -1 without sizes.
+long long dir_stats_file_size(const struct dir_stats *stats, const char *path);
+
+// chmod everything under path (symlinks excepted) to
+// (mode & ~clear) | set, e.g. (07777, 0777) for "chmod -R 777" and
+// (0, 0666) for "chmod -R a+rw".
+int chmod_recursive(const char *path, mode_t clear, mode_t set);
+
+// NULL-terminated, malloc'd list of the non-directories under dir whose
+// names end in suffix.  Free with free_file_list().
+char **find_files(const char *dir, const char *suffix, int *count);
+void free_file_list(char **files);
+
+// Remove everything inside the directory path, leaving path itself, with
+// several threads.  Top-level entries named in exclude (NULL-terminated,
+// may be NULL) are kept, and so is anything mounted below path.  While it
+// runs, progress (may be NULL) is called from the calling thread every
+// so often with the number of entries removed so far.  Keeps going past
+// errors; returns -1 with the errno of the first one.
+int wipe_dir(const char *path, const char *const exclude[],
+             void (*progress)(long removed, void *cookie), void *cookie);
+
+// malloc'd copy of the last nb_lines lines of path, or NULL on error.
+char *tail_file(const char *path, int nb_lines);
+
+#endif
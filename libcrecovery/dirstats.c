@@ -0,0 +1,462 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Parallel directory tree statistics.  Directories go on a shared queue
+// and a few worker threads pull from it, reading each one with raw
+// getdents64 so d_type can skip the stat for everything but regular
+// files.  Subtrees on flash are mostly waiting on I/O, so overlapping
+// several of them is what makes this faster than a single find.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "common.h"
+
+#define DIRSTATS_MAX_THREADS 8
+#define DIRENT_BUF_SIZE 32768
+
+struct linux_dirent64 {
+    unsigned long long d_ino;
+    long long d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+#ifndef DT_DIR
+#define DT_UNKNOWN 0
+#define DT_DIR 4
+#define DT_REG 8
+#endif
+
+struct dir_work {
+    struct dir_work *next;
+    char path[];
+};
+
+// The size of each non-empty regular file, by a 64-bit hash of its
+// path, so progress can be reported as tar names the files without a
+// stat for each of them.  Open addressing; a zero hash marks a free slot.
+struct file_size {
+    uint64_t hash;
+    long long size;
+};
+
+struct dir_sizes {
+    struct file_size *slots;
+    size_t mask;
+};
+
+// What one worker found, merged into the table at the end.
+struct size_list {
+    struct file_size *items;
+    size_t count;
+    size_t alloc;
+};
+
+struct scan {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct dir_work *queue;
+    int busy;               // workers currently scanning a directory
+    int error;              // something was left out for lack of memory
+    const char *exclude;
+    int want_sizes;
+    long long entries;
+    long long bytes;
+    struct size_list sizes;
+};
+
+static uint64_t path_hash(const char *path) {
+    uint64_t h = 14695981039346656037ULL;       // FNV-1a
+    while (*path != '\0') {
+        h ^= (unsigned char) *path++;
+        h *= 1099511628211ULL;
+    }
+    return h != 0 ? h : 1;
+}
+
+static int add_size(struct size_list *list, uint64_t hash, long long size) {
+    if (list->count == list->alloc) {
+        size_t alloc = list->alloc ? list->alloc * 2 : 1024;
+        struct file_size *grown = realloc(list->items, alloc * sizeof(*grown));
+        if (grown == NULL)
+            return -1;
+        list->items = grown;
+        list->alloc = alloc;
+    }
+    list->items[list->count].hash = hash;
+    list->items[list->count].size = size;
+    list->count++;
+    return 0;
+}
+
+static struct dir_sizes *build_sizes(const struct size_list *list) {
+    struct dir_sizes *sizes = malloc(sizeof(*sizes));
+    if (sizes == NULL)
+        return NULL;
+    size_t n = 64;
+    while (n < list->count * 2)
+        n *= 2;
+    sizes->slots = calloc(n, sizeof(struct file_size));
+    if (sizes->slots == NULL) {
+        free(sizes);
+        return NULL;
+    }
+    sizes->mask = n - 1;
+
+    size_t i;
+    for (i = 0; i < list->count; i++) {
+        size_t slot = list->items[i].hash & sizes->mask;
+        while (sizes->slots[slot].hash != 0)
+            slot = (slot + 1) & sizes->mask;
+        sizes->slots[slot] = list->items[i];
+    }
+    return sizes;
+}
+
+static void free_sizes(struct dir_sizes *sizes) {
+    if (sizes != NULL) {
+        free(sizes->slots);
+        free(sizes);
+    }
+}
+
+long long dir_stats_file_size(const struct dir_stats *stats, const char *path) {
+    const struct dir_sizes *sizes = stats->sizes;
+    if (sizes == NULL)
+        return -1;
+    uint64_t hash = path_hash(path);
+    size_t slot = hash & sizes->mask;
+    while (sizes->slots[slot].hash != 0) {
+        if (sizes->slots[slot].hash == hash)
+            return sizes->slots[slot].size;
+        slot = (slot + 1) & sizes->mask;
+    }
+    return 0;
+}
+
+static int queue_dir(struct scan *s, const char *path, size_t len) {
+    struct dir_work *w = malloc(sizeof(*w) + len + 1);
+    if (w == NULL) {
+        pthread_mutex_lock(&s->lock);
+        s->error = 1;
+        pthread_mutex_unlock(&s->lock);
+        return -1;
+    }
+    memcpy(w->path, path, len + 1);
+    pthread_mutex_lock(&s->lock);
+    w->next = s->queue;
+    s->queue = w;
+    pthread_cond_signal(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+    return 0;
+}
+
+static void scan_dir(struct scan *s, const char *path, char *buf,
+                     long long *entries, long long *bytes, struct size_list *sizes) {
+    char child[PATH_MAX];
+    size_t len = strlen(path);
+    int fd = open(path, O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+        return;
+
+    memcpy(child, path, len);
+    child[len++] = '/';
+
+    int n;
+    while ((n = syscall(__NR_getdents64, fd, buf, DIRENT_BUF_SIZE)) > 0) {
+        int off;
+        for (off = 0; off < n; ) {
+            struct linux_dirent64 *de = (struct linux_dirent64 *) (buf + off);
+            off += de->d_reclen;
+
+            const char *name = de->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+                continue;
+            size_t name_len = strlen(name);
+            if (len + name_len >= sizeof(child))
+                continue;
+            memcpy(child + len, name, name_len + 1);
+            if (s->exclude != NULL && strcmp(child, s->exclude) == 0)
+                continue;
+
+            (*entries)++;
+            int type = de->d_type;
+            if (type == DT_UNKNOWN || type == DT_REG) {
+                struct stat st;
+                if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+                    continue;
+                if (S_ISREG(st.st_mode)) {
+                    *bytes += st.st_size;
+                    if (s->want_sizes && st.st_size > 0 &&
+                        add_size(sizes, path_hash(child), st.st_size) < 0) {
+                        pthread_mutex_lock(&s->lock);
+                        s->error = 1;
+                        pthread_mutex_unlock(&s->lock);
+                    }
+                }
+                type = S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+            }
+            if (type == DT_DIR)
+                queue_dir(s, child, len + name_len);
+        }
+    }
+    close(fd);
+}
+
+static void *scan_thread(void *cookie) {
+    struct scan *s = cookie;
+    long long entries = 0, bytes = 0;
+    struct size_list sizes;
+    char *buf = malloc(DIRENT_BUF_SIZE);
+
+    memset(&sizes, 0, sizeof(sizes));
+    pthread_mutex_lock(&s->lock);
+    if (buf == NULL)
+        s->error = 1;
+    for (;;) {
+        while (s->queue == NULL && s->busy > 0)
+            pthread_cond_wait(&s->cond, &s->lock);
+        if (s->queue == NULL)
+            break;  // nothing queued and nobody left to queue more
+        struct dir_work *w = s->queue;
+        s->queue = w->next;
+        s->busy++;
+        pthread_mutex_unlock(&s->lock);
+
+        if (buf != NULL)
+            scan_dir(s, w->path, buf, &entries, &bytes, &sizes);
+        free(w);
+
+        pthread_mutex_lock(&s->lock);
+        if (--s->busy == 0 && s->queue == NULL)
+            pthread_cond_broadcast(&s->cond);
+    }
+    s->entries += entries;
+    s->bytes += bytes;
+    if (sizes.count > 0) {
+        if (s->sizes.count == 0) {
+            free(s->sizes.items);
+            s->sizes = sizes;
+            sizes.items = NULL;
+        } else {
+            size_t i;
+            for (i = 0; i < sizes.count; i++) {
+                if (add_size(&s->sizes, sizes.items[i].hash, sizes.items[i].size) < 0) {
+                    s->error = 1;
+                    break;
+                }
+            }
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    free(sizes.items);
+    free(buf);
+    return NULL;
+}
+
+static int scan_tree(const char *path, const char *exclude, struct dir_stats *stats,
+                     struct dir_sizes **sizes) {
+    pthread_t threads[DIRSTATS_MAX_THREADS];
+    struct scan s;
+    struct stat st;
+    char root[PATH_MAX];
+    int i, nthreads = 0;
+
+    stats->entries = 0;
+    stats->bytes = 0;
+    stats->sizes = NULL;
+    if (sizes != NULL)
+        *sizes = NULL;
+
+    size_t len = strlen(path);
+    if (len >= sizeof(root)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memcpy(root, path, len + 1);
+    while (len > 1 && root[len - 1] == '/')
+        root[--len] = '\0';
+    if (exclude != NULL && strcmp(root, exclude) == 0)
+        return 0;
+    if (lstat(root, &st) < 0)
+        return -1;
+
+    // the root counts as an entry, just like the first line of find
+    stats->entries = 1;
+    if (!S_ISDIR(st.st_mode)) {
+        if (S_ISREG(st.st_mode))
+            stats->bytes = st.st_size;
+        if (sizes != NULL) {
+            struct size_list one;
+            memset(&one, 0, sizeof(one));
+            if (st.st_size > 0 && S_ISREG(st.st_mode) &&
+                add_size(&one, path_hash(root), st.st_size) < 0)
+                return -1;
+            *sizes = build_sizes(&one);
+            free(one.items);
+            if (*sizes == NULL)
+                return -1;
+        }
+        return 0;
+    }
+
+    memset(&s, 0, sizeof(s));
+    pthread_mutex_init(&s.lock, NULL);
+    pthread_cond_init(&s.cond, NULL);
+    s.exclude = exclude;
+    s.want_sizes = sizes != NULL;
+    if (queue_dir(&s, root, len) < 0) {
+        pthread_cond_destroy(&s.cond);
+        pthread_mutex_destroy(&s.lock);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int want = cpus < 2 ? 2 : cpus > DIRSTATS_MAX_THREADS ? DIRSTATS_MAX_THREADS : cpus;
+    for (i = 0; i < want; i++) {
+        if (pthread_create(&threads[nthreads], NULL, scan_thread, &s) == 0)
+            nthreads++;
+    }
+    if (nthreads == 0)
+        scan_thread(&s);
+    for (i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+
+    pthread_cond_destroy(&s.cond);
+    pthread_mutex_destroy(&s.lock);
+
+    if (!s.error && sizes != NULL && (*sizes = build_sizes(&s.sizes)) == NULL)
+        s.error = 1;
+    free(s.sizes.items);
+    if (s.error) {
+        // an undercount would leave the progress bar short
+        errno = ENOMEM;
+        return -1;
+    }
+    stats->entries += s.entries;
+    stats->bytes += s.bytes;
+    return 0;
+}
+
+int dir_stats(const char *path, const char *exclude, struct dir_stats *stats) {
+    return scan_tree(path, exclude, stats, NULL);
+}
+
+// Backups tend to scan the same volumes again and again (a second backup,
+// backup after restore) without anything else writing to them, so the
+// last few results are kept.  A volume that was remounted since gets a
+// new mount id in /proc/self/mountinfo, which invalidates the entry;
+// callers that modify a volume in place (formats, restores, installs)
+// call dir_stats_invalidate().
+
+#define DIRSTATS_CACHE_SIZE 4
+
+static struct {
+    char path[PATH_MAX];
+    char exclude[PATH_MAX];
+    int mount_id;
+    struct dir_stats stats;     // stats.sizes is owned by the entry
+} cache[DIRSTATS_CACHE_SIZE];
+static int cache_next = 0;
+// sizes of a result that couldn't be cached, kept until the next call
+// just like the cached ones
+static struct dir_sizes *uncached_sizes = NULL;
+
+// id of the mount holding path, or -1
+static int mount_id_for(const char *path) {
+    char line[1024];
+    char mount_point[PATH_MAX];
+    size_t best_len = 0;
+    int best = -1;
+
+    FILE *f = fopen("/proc/self/mountinfo", "r");
+    if (f == NULL)
+        return -1;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        int id;
+        if (sscanf(line, "%d %*d %*s %*s %4095s", &id, mount_point) != 2)
+            continue;
+        size_t len = strlen(mount_point);
+        if (strncmp(path, mount_point, len) != 0 ||
+            (len > 1 && path[len] != '/' && path[len] != '\0'))
+            continue;
+        if (len >= best_len) {
+            best_len = len;
+            best = id;
+        }
+    }
+    fclose(f);
+    return best;
+}
+
+int dir_stats_cached(const char *path, const char *exclude, struct dir_stats *stats) {
+    const char *ex = exclude != NULL ? exclude : "";
+    int id = mount_id_for(path);
+    int i;
+
+    if (id >= 0 && strlen(path) < PATH_MAX && strlen(ex) < PATH_MAX) {
+        for (i = 0; i < DIRSTATS_CACHE_SIZE; i++) {
+            if (cache[i].mount_id == id && !strcmp(cache[i].path, path) &&
+                !strcmp(cache[i].exclude, ex)) {
+                *stats = cache[i].stats;
+                return 0;
+            }
+        }
+    }
+
+    struct dir_sizes *sizes;
+    if (scan_tree(path, exclude, stats, &sizes) < 0)
+        return -1;
+    free_sizes(uncached_sizes);
+    uncached_sizes = NULL;
+    if (id >= 0 && strlen(path) < PATH_MAX && strlen(ex) < PATH_MAX) {
+        i = cache_next;
+        cache_next = (cache_next + 1) % DIRSTATS_CACHE_SIZE;
+        free_sizes(cache[i].stats.sizes);
+        strcpy(cache[i].path, path);
+        strcpy(cache[i].exclude, ex);
+        cache[i].mount_id = id;
+        stats->sizes = sizes;
+        cache[i].stats = *stats;
+    } else {
+        uncached_sizes = sizes;
+        stats->sizes = sizes;
+    }
+    return 0;
+}
+
+void dir_stats_invalidate(void) {
+    int i;
+    for (i = 0; i < DIRSTATS_CACHE_SIZE; i++)
+        free_sizes(cache[i].stats.sizes);
+    memset(cache, 0, sizeof(cache));
+    free_sizes(uncached_sizes);
+    uncached_sizes = NULL;
+}
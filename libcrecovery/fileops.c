@@ -0,0 +1,212 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// In-process versions of the find/chmod/tail pipelines recovery used to
+// run through the shell.
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "common.h"
+
+typedef int (*walk_fn)(const char *path, const struct stat *st, void *cookie);
+
+// Calls fn for path and, if it is a directory, everything below it, in
+// the same pre-order as find.  Symlinks are reported but not followed.
+// path must point to a PATH_MAX buffer; it is extended in place.
+static int walk(char *path, size_t len, const char *exclude, walk_fn fn, void *cookie) {
+    struct stat st;
+    int ret = 0;
+
+    if (exclude != NULL && strcmp(path, exclude) == 0)
+        return 0;
+    if (lstat(path, &st) < 0)
+        return -1;
+    if (fn(path, &st, cookie) < 0)
+        return -1;
+    if (!S_ISDIR(st.st_mode))
+        return 0;
+
+    DIR *d = opendir(path);
+    if (d == NULL)
+        return -1;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+        size_t n = strlen(de->d_name);
+        if (len + 1 + n >= PATH_MAX) {
+            ret = -1;
+            continue;
+        }
+        path[len] = '/';
+        memcpy(path + len + 1, de->d_name, n + 1);
+        if (walk(path, len + 1 + n, exclude, fn, cookie) < 0)
+            ret = -1;
+    }
+    path[len] = '\0';
+    closedir(d);
+    return ret;
+}
+
+static int walk_tree(const char *root, const char *exclude, walk_fn fn, void *cookie) {
+    char path[PATH_MAX];
+    size_t len = strlen(root);
+
+    if (len >= sizeof(path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memcpy(path, root, len + 1);
+    // "find /data/" prints "/data/" and then "/data//app"; don't mimic that
+    while (len > 1 && path[len - 1] == '/')
+        path[--len] = '\0';
+    return walk(path, len, exclude, fn, cookie);
+}
+
+struct chmod_args {
+    mode_t clear;
+    mode_t set;
+};
+
+static int chmod_one(const char *path, const struct stat *st, void *cookie) {
+    const struct chmod_args *args = cookie;
+    if (S_ISLNK(st->st_mode))
+        return 0;
+    mode_t mode = ((st->st_mode & 07777) & ~args->clear) | args->set;
+    if (mode != (st->st_mode & 07777) && chmod(path, mode) < 0)
+        return -1;
+    return 0;
+}
+
+int chmod_recursive(const char *path, mode_t clear, mode_t set) {
+    struct chmod_args args = { clear, set };
+    return walk_tree(path, NULL, chmod_one, &args);
+}
+
+struct find_args {
+    const char *suffix;
+    size_t suffix_len;
+    char **files;
+    int count;
+    int alloc;
+};
+
+static int find_one(const char *path, const struct stat *st, void *cookie) {
+    struct find_args *args = cookie;
+    size_t len = strlen(path);
+
+    if (S_ISDIR(st->st_mode) || len < args->suffix_len ||
+        strcmp(path + len - args->suffix_len, args->suffix) != 0)
+        return 0;
+    // keep room for a NULL terminator
+    if (args->count + 1 >= args->alloc) {
+        int alloc = args->alloc ? args->alloc * 2 : 16;
+        char **files = realloc(args->files, alloc * sizeof(char *));
+        if (files == NULL)
+            return -1;
+        args->files = files;
+        args->alloc = alloc;
+    }
+    if ((args->files[args->count] = strdup(path)) == NULL)
+        return -1;
+    args->count++;
+    return 0;
+}
+
+char **find_files(const char *dir, const char *suffix, int *count) {
+    struct find_args args = { suffix, strlen(suffix), NULL, 0, 0 };
+
+    walk_tree(dir, NULL, find_one, &args);
+    if (args.files == NULL)
+        args.files = malloc(sizeof(char *));
+    if (args.files != NULL)
+        args.files[args.count] = NULL;
+    if (count != NULL)
+        *count = args.count;
+    return args.files;
+}
+
+void free_file_list(char **files) {
+    char **f;
+    if (files == NULL)
+        return;
+    for (f = files; *f != NULL; f++)
+        free(*f);
+    free(files);
+}
+
+char *tail_file(const char *path, int nb_lines) {
+    char *buf = NULL;
+    if (nb_lines <= 0)
+        return strdup("");
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    // read backwards a block at a time until we have seen enough newlines
+    off_t end = lseek(fd, 0, SEEK_END);
+    off_t start = end;
+    size_t size = 0;
+    int lines = 0;
+    while (start > 0 && lines <= nb_lines) {
+        size_t chunk = start > 4096 ? 4096 : start;
+        char *grown = realloc(buf, size + chunk + 1);
+        if (grown == NULL)
+            goto fail;
+        buf = grown;
+        memmove(buf + chunk, buf, size);
+        start -= chunk;
+        if (pread(fd, buf, chunk, start) != (ssize_t) chunk)
+            goto fail;
+        size += chunk;
+
+        size_t i;
+        lines = 0;
+        // a trailing newline ends the last line rather than starting one
+        for (i = 0; i + 1 < size; i++) {
+            if (buf[i] == '\n')
+                lines++;
+        }
+    }
+    close(fd);
+
+    if (buf == NULL)
+        return strdup("");
+    buf[size] = '\0';
+
+    // drop the extra lines from the front; every newline counted above
+    // has text after it, so memchr() can't run off the end
+    char *p = buf;
+    for (; lines >= nb_lines; lines--)
+        p = (char *) memchr(p, '\n', buf + size - p) + 1;
+    if (p != buf)
+        memmove(buf, p, size - (p - buf) + 1);
+    return buf;
+
+fail:
+    free(buf);
+    close(fd);
+    return NULL;
+}
@@ -52,14 +52,13 @@ static struct pid {
 
 extern char **environ;
 
-FILE *
-__popen(const char *program, const char *type)
+static FILE *
+open_pipe(const char *path, char *const argv[], int search, const char *type)
 {
 	struct pid * volatile cur;
 	FILE *iop;
 	int pdes[2];
 	pid_t pid;
-	char *argp[] = {"sh", "-c", NULL, NULL};
 
 	if ((*type != 'r' && *type != 'w') || type[1] != '\0') {
 		errno = EINVAL;
@@ -74,6 +73,8 @@ __popen(const char *program, const char *type)
 		return (NULL);
 	}
 
+	/* stdout is buffered; don't let the child's output overtake it */
+	fflush(stdout);
 	switch (pid = fork()) {
 	case -1:			/* Error. */
 		(void)close(pdes[0]);
@@ -104,8 +105,10 @@ __popen(const char *program, const char *type)
 				(void)close(pdes[0]);
 			}
 		}
-		argp[2] = (char *)program;
-		execve(_PATH_BSHELL, argp, environ);
+		if (search)
+			execvp(path, argv);
+		else
+			execve(path, argv, environ);
 		_exit(127);
 		/* NOTREACHED */
 	    }
@@ -129,6 +132,29 @@ __popen(const char *program, const char *type)
 	return (iop);
 }
 
+FILE *
+__popen(const char *program, const char *type)
+{
+	char *argp[] = {"sh", "-c", NULL, NULL};
+
+	argp[2] = (char *)program;
+	return open_pipe(_PATH_BSHELL, argp, 0, type);
+}
+
+/*
+ * Like __popen(), but runs argv[0] (searched for in $PATH) directly
+ * instead of through the shell.  Close the stream with __pclose().
+ */
+FILE *
+__popenv(char *const argv[], const char *type)
+{
+	if (!argv || !argv[0]) {
+		errno = EINVAL;
+		return (NULL);
+	}
+	return open_pipe(argv[0], argv, 1, type);
+}
+
 /*
  * pclose --
  *	Pclose returns -1 if stream is not associated with a `popened' command,
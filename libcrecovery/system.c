@@ -30,6 +30,7 @@
 
 #include <sys/types.h>
 #include <signal.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <paths.h>
@@ -39,32 +40,31 @@
 
 extern char **environ;
 
-int
-__system(const char *command)
+static int
+run(const char *path, char *const argv[], int search)
 {
-  pid_t pid;
+	pid_t pid;
 	sig_t intsave, quitsave;
 	sigset_t mask, omask;
 	int pstat;
-	char *argp[] = {"sh", "-c", NULL, NULL};
-
-	if (!command)		/* just checking... */
-		return(1);
-
-	argp[2] = (char *)command;
 
 	sigemptyset(&mask);
 	sigaddset(&mask, SIGCHLD);
 	sigprocmask(SIG_BLOCK, &mask, &omask);
+	/* stdout is buffered; don't let the child's output overtake it */
+	fflush(stdout);
 	switch (pid = vfork()) {
 	case -1:			/* error */
 		sigprocmask(SIG_SETMASK, &omask, NULL);
 		return(-1);
 	case 0:				/* child */
 		sigprocmask(SIG_SETMASK, &omask, NULL);
-		execve(_PATH_BSHELL, argp, environ);
-    _exit(127);
-  }
+		if (search)
+			execvp(path, argv);
+		else
+			execve(path, argv, environ);
+		_exit(127);
+	}
 
 	intsave = (sig_t)  bsd_signal(SIGINT, SIG_IGN);
 	quitsave = (sig_t) bsd_signal(SIGQUIT, SIG_IGN);
@@ -74,3 +74,27 @@ __system(const char *command)
 	(void)bsd_signal(SIGQUIT, quitsave);
 	return (pid == -1 ? -1 : pstat);
 }
+
+int
+__system(const char *command)
+{
+	char *argp[] = {"sh", "-c", NULL, NULL};
+
+	if (!command)		/* just checking... */
+		return(1);
+
+	argp[2] = (char *)command;
+	return run(_PATH_BSHELL, argp, 0);
+}
+
+/*
+ * Like __system(), but runs argv[0] (searched for in $PATH) directly with
+ * the given arguments instead of handing a command line to the shell.
+ */
+int
+__systemv(char *const argv[])
+{
+	if (!argv || !argv[0])
+		return(1);
+	return run(argv[0], argv, 1);
+}
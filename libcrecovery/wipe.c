@@ -0,0 +1,317 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Parallel rm -rf, for volumes that have to be wiped file by file because
+// they can't be reformatted.  A worker empties a directory with
+// unlinkat() relative to its fd and recurses the same way into
+// subdirectories.  Directories near the top of the tree go back on the
+// queue instead, so the big ones (/data/data, /data/app) are spread over
+// all the workers; each of those is removed by whichever worker finishes
+// the last piece of it.
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+
+#define WIPE_MAX_THREADS 8
+// directories this many levels below the root are emptied in place
+#define WIPE_SPLIT_DEPTH 3
+#define WIPE_PROGRESS_MS 100
+
+struct wipe_node {
+    struct wipe_node *next;     // queue link
+    struct wipe_node *parent;   // NULL for the root, which is kept
+    int pending;                // our own pass plus queued subdirectories
+    int depth;
+    int keep;                   // a mount point: leave it in place
+    char path[];
+};
+
+struct wipe {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        // work queued, or all done
+    pthread_cond_t done_cond;
+    struct wipe_node *queue;
+    int done;
+    dev_t dev;
+    const char *const *exclude;
+    long removed;
+    int errors;
+    int first_errno;
+};
+
+static void wipe_error(struct wipe *w, int err) {
+    pthread_mutex_lock(&w->lock);
+    if (w->errors++ == 0)
+        w->first_errno = err;
+    pthread_mutex_unlock(&w->lock);
+}
+
+static void wipe_removed(struct wipe *w) {
+    __atomic_add_fetch(&w->removed, 1, __ATOMIC_RELAXED);
+}
+
+static int excluded(const struct wipe *w, const char *name) {
+    const char *const *e;
+    if (w->exclude == NULL)
+        return 0;
+    for (e = w->exclude; *e != NULL; e++) {
+        if (strcmp(*e, name) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+static struct wipe_node *new_node(struct wipe_node *parent, const char *path, const char *name) {
+    size_t len = strlen(path);
+    size_t name_len = name != NULL ? strlen(name) + 1 : 0;
+    if (len + name_len >= PATH_MAX)
+        return NULL;
+    struct wipe_node *node = calloc(1, sizeof(*node) + len + name_len + 1);
+    if (node == NULL)
+        return NULL;
+    memcpy(node->path, path, len);
+    if (name != NULL) {
+        node->path[len] = '/';
+        memcpy(node->path + len + 1, name, name_len);
+    }
+    node->parent = parent;
+    node->pending = 1;
+    node->depth = parent != NULL ? parent->depth + 1 : 0;
+    return node;
+}
+
+// Queues the subdirectory name of node for another worker.
+static int hand_off(struct wipe *w, struct wipe_node *node, const char *name) {
+    struct wipe_node *child = new_node(node, node->path, name);
+    if (child == NULL)
+        return -1;
+    pthread_mutex_lock(&w->lock);
+    node->pending++;
+    child->next = w->queue;
+    w->queue = child;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    return 0;
+}
+
+static void remove_subdir(struct wipe *w, int parent_fd, const char *name);
+
+// Removes everything in the directory open at fd, and closes it.  node is
+// set when fd is a directory taken from the queue, whose subdirectories
+// may be queued in turn.
+static void empty_dir(struct wipe *w, int fd, struct wipe_node *node) {
+    DIR *d = fdopendir(fd);
+    if (d == NULL) {
+        wipe_error(w, errno);
+        close(fd);
+        return;
+    }
+
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        const char *name = de->d_name;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+            continue;
+        if (node != NULL && node->parent == NULL && excluded(w, name))
+            continue;
+
+        if (de->d_type != DT_DIR) {
+            // without d_type, unlinking tells us whether it was a directory
+            if (unlinkat(dirfd(d), name, 0) == 0) {
+                wipe_removed(w);
+                continue;
+            }
+            if (errno != EISDIR || de->d_type != DT_UNKNOWN) {
+                wipe_error(w, errno);
+                continue;
+            }
+        }
+
+        if (node != NULL && node->depth < WIPE_SPLIT_DEPTH && hand_off(w, node, name) == 0)
+            continue;
+        remove_subdir(w, dirfd(d), name);
+    }
+    closedir(d);
+}
+
+static void remove_subdir(struct wipe *w, int parent_fd, const char *name) {
+    struct stat st;
+    int fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        wipe_error(w, errno);
+        return;
+    }
+    if (fstat(fd, &st) == 0 && st.st_dev != w->dev) {
+        // something mounted below the volume; rm -rf would have emptied
+        // it, but it isn't ours to wipe
+        close(fd);
+        return;
+    }
+    empty_dir(w, fd, NULL);
+    if (unlinkat(parent_fd, name, AT_REMOVEDIR) == 0)
+        wipe_removed(w);
+    else
+        wipe_error(w, errno);
+}
+
+// Drops one of node's pending references, removing it once it is empty
+// and passing that on to its parent.
+static void finish_node(struct wipe *w, struct wipe_node *node) {
+    pthread_mutex_lock(&w->lock);
+    while (--node->pending == 0) {
+        struct wipe_node *parent = node->parent;
+        if (parent == NULL) {
+            w->done = 1;
+            pthread_cond_broadcast(&w->cond);
+            pthread_cond_signal(&w->done_cond);
+            break;
+        }
+        pthread_mutex_unlock(&w->lock);
+
+        if (!node->keep) {
+            if (rmdir(node->path) == 0)
+                wipe_removed(w);
+            else
+                wipe_error(w, errno);
+        }
+        free(node);
+        node = parent;
+        pthread_mutex_lock(&w->lock);
+    }
+    pthread_mutex_unlock(&w->lock);
+}
+
+static void run_node(struct wipe *w, struct wipe_node *node) {
+    struct stat st;
+    int fd = open(node->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        wipe_error(w, errno);
+        node->keep = 1;
+    } else if (fstat(fd, &st) == 0 && st.st_dev != w->dev) {
+        node->keep = 1;
+        close(fd);
+    } else {
+        empty_dir(w, fd, node);
+    }
+    finish_node(w, node);
+}
+
+static void *wipe_thread(void *cookie) {
+    struct wipe *w = cookie;
+
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (w->queue == NULL && !w->done)
+            pthread_cond_wait(&w->cond, &w->lock);
+        if (w->queue == NULL)
+            break;
+        struct wipe_node *node = w->queue;
+        w->queue = node->next;
+        pthread_mutex_unlock(&w->lock);
+
+        run_node(w, node);
+
+        pthread_mutex_lock(&w->lock);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+int wipe_dir(const char *path, const char *const exclude[],
+             void (*progress)(long removed, void *cookie), void *cookie) {
+    pthread_t threads[WIPE_MAX_THREADS];
+    struct wipe w;
+    struct stat st;
+    int i, nthreads = 0;
+
+    if (lstat(path, &st) < 0)
+        return -1;
+    if (!S_ISDIR(st.st_mode)) {
+        errno = ENOTDIR;
+        return -1;
+    }
+
+    struct wipe_node *root = new_node(NULL, path, NULL);
+    if (root == NULL) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    memset(&w, 0, sizeof(w));
+    pthread_mutex_init(&w.lock, NULL);
+    pthread_cond_init(&w.cond, NULL);
+    pthread_cond_init(&w.done_cond, NULL);
+    w.dev = st.st_dev;
+    w.exclude = exclude;
+    w.queue = root;
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int want = cpus < 2 ? 2 : cpus > WIPE_MAX_THREADS ? WIPE_MAX_THREADS : cpus;
+    for (i = 0; i < want; i++) {
+        if (pthread_create(&threads[nthreads], NULL, wipe_thread, &w) == 0)
+            nthreads++;
+    }
+
+    if (nthreads == 0) {
+        wipe_thread(&w);
+    } else {
+        // the workers never call back, so progress is reported from here
+        pthread_mutex_lock(&w.lock);
+        while (!w.done) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += WIPE_PROGRESS_MS * 1000000L;
+            if (ts.tv_nsec >= 1000000000L) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&w.done_cond, &w.lock, &ts);
+            if (progress != NULL && !w.done) {
+                pthread_mutex_unlock(&w.lock);
+                progress(__atomic_load_n(&w.removed, __ATOMIC_RELAXED), cookie);
+                pthread_mutex_lock(&w.lock);
+            }
+        }
+        pthread_mutex_unlock(&w.lock);
+    }
+    for (i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+    free(root);
+
+    pthread_cond_destroy(&w.done_cond);
+    pthread_cond_destroy(&w.cond);
+    pthread_mutex_destroy(&w.lock);
+
+    if (progress != NULL)
+        progress(w.removed, cookie);
+    if (w.errors != 0) {
+        errno = w.first_errno;
+        return -1;
+    }
+    return 0;
+}
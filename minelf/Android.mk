@@ -16,7 +16,8 @@ LOCAL_PATH := $(call my-dir)
 include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES := \
-	Retouch.c
+	Retouch.c \
+	Strings.c
 
 LOCAL_C_INCLUDES += $(LOCAL_PATH)/..
 
@@ -0,0 +1,194 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <elf.h>
+#include <string.h>
+#include "Strings.h"
+
+#define MAX_PATTERNS 32
+
+struct search {
+    const char *const *patterns;
+    size_t lengths[MAX_PATTERNS];
+    int count;
+    uint32_t by_first[256];     // patterns starting with each byte
+    int single_first;           // the first byte they all share, or -1
+    bool *found;
+    int remaining;
+};
+
+// One pass over the region for all the patterns still missing: only
+// offsets holding some pattern's first byte are compared, and when the
+// patterns share their first byte memchr() finds those.
+static void search_region(struct search *s, const uint8_t *p, size_t len) {
+    const uint8_t *end = p + len;
+    while (s->remaining > 0 && p < end) {
+        if (s->single_first >= 0) {
+            p = memchr(p, s->single_first, end - p);
+            if (p == NULL)
+                return;
+        } else {
+            while (p < end && s->by_first[*p] == 0)
+                p++;
+            if (p == end)
+                return;
+        }
+
+        uint32_t candidates = s->by_first[*p];
+        int i;
+        for (i = 0; candidates != 0; i++, candidates >>= 1) {
+            if ((candidates & 1) && !s->found[i] &&
+                    s->lengths[i] <= (size_t)(end - p) &&
+                    memcmp(p, s->patterns[i], s->lengths[i]) == 0) {
+                s->found[i] = true;
+                s->by_first[*p] &= ~(1u << i);
+                s->remaining--;
+            }
+        }
+        p++;
+    }
+}
+
+struct section {
+    uint32_t name;
+    uint32_t type;
+    uint64_t flags;
+    uint64_t offset;
+    uint64_t size;
+};
+
+static bool read_section(const uint8_t *data, size_t size, bool is64,
+                         uint64_t shoff, uint32_t shentsize, uint32_t index,
+                         struct section *sec) {
+    uint64_t off = shoff + (uint64_t)index * shentsize;
+    if (is64) {
+        Elf64_Shdr sh;
+        if (shentsize < sizeof(sh) || off + sizeof(sh) > size)
+            return false;
+        memcpy(&sh, data + off, sizeof(sh));
+        sec->name = sh.sh_name;
+        sec->type = sh.sh_type;
+        sec->flags = sh.sh_flags;
+        sec->offset = sh.sh_offset;
+        sec->size = sh.sh_size;
+    } else {
+        Elf32_Shdr sh;
+        if (shentsize < sizeof(sh) || off + sizeof(sh) > size)
+            return false;
+        memcpy(&sh, data + off, sizeof(sh));
+        sec->name = sh.sh_name;
+        sec->type = sh.sh_type;
+        sec->flags = sh.sh_flags;
+        sec->offset = sh.sh_offset;
+        sec->size = sh.sh_size;
+    }
+    return sec->offset <= size && sec->size <= size - sec->offset;
+}
+
+// Searches the string sections; false if the headers can't be used.
+static bool search_elf(struct search *s, const uint8_t *data, size_t size) {
+    if (size < EI_NIDENT || memcmp(data, ELFMAG, SELFMAG) != 0)
+        return false;
+    bool is64 = data[EI_CLASS] == ELFCLASS64;
+    uint64_t shoff;
+    uint32_t shentsize, shnum, shstrndx;
+    if (is64) {
+        Elf64_Ehdr eh;
+        if (size < sizeof(eh))
+            return false;
+        memcpy(&eh, data, sizeof(eh));
+        shoff = eh.e_shoff;
+        shentsize = eh.e_shentsize;
+        shnum = eh.e_shnum;
+        shstrndx = eh.e_shstrndx;
+    } else if (data[EI_CLASS] == ELFCLASS32) {
+        Elf32_Ehdr eh;
+        if (size < sizeof(eh))
+            return false;
+        memcpy(&eh, data, sizeof(eh));
+        shoff = eh.e_shoff;
+        shentsize = eh.e_shentsize;
+        shnum = eh.e_shnum;
+        shstrndx = eh.e_shstrndx;
+    } else {
+        return false;
+    }
+
+    struct section names;
+    if (shoff == 0 || shnum == 0 || shstrndx >= shnum ||
+            !read_section(data, size, is64, shoff, shentsize, shstrndx, &names))
+        return false;
+
+    uint32_t i;
+    int searched = 0;
+    for (i = 0; i < shnum && s->remaining > 0; i++) {
+        struct section sec;
+        if (!read_section(data, size, is64, shoff, shentsize, i, &sec))
+            return false;
+        if (sec.type == SHT_STRTAB) {
+            // .dynstr, .strtab; the section names themselves are no use
+            if (i == shstrndx)
+                continue;
+        } else if (sec.type == SHT_PROGBITS && !(sec.flags & (SHF_WRITE | SHF_EXECINSTR))) {
+            // .rodata, .rodata.str1.1 and so on
+            if (sec.name >= names.size || names.size - sec.name < 7 ||
+                    memcmp(data + names.offset + sec.name, ".rodata", 7) != 0)
+                continue;
+        } else {
+            continue;
+        }
+        search_region(s, data + sec.offset, sec.size);
+        searched++;
+    }
+    return searched > 0;
+}
+
+int elf_find_strings(const uint8_t *data, size_t size,
+                     const char *const patterns[], int count,
+                     bool found[]) {
+    struct search s;
+    int i;
+
+    if (count > MAX_PATTERNS)
+        count = MAX_PATTERNS;
+    memset(&s, 0, sizeof(s));
+    s.patterns = patterns;
+    s.count = count;
+    s.found = found;
+    s.single_first = -1;
+    for (i = 0; i < count; i++) {
+        uint8_t first = patterns[i][0];
+        found[i] = false;
+        s.lengths[i] = strlen(patterns[i]);
+        if (s.lengths[i] == 0) {
+            found[i] = true;
+            continue;
+        }
+        s.by_first[first] |= 1u << i;
+        s.remaining++;
+        s.single_first = (s.remaining == 1 || s.single_first == first) ? first : -2;
+    }
+    if (s.single_first < 0)
+        s.single_first = -1;
+
+    if (!search_elf(&s, data, size))
+        search_region(&s, data, size);
+
+    int n = 0;
+    for (i = 0; i < count; i++)
+        n += found[i];
+    return n;
+}
@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MINELF_STRINGS
+#define _MINELF_STRINGS
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Look for each of count patterns in the constant data of the ELF
+// image at data: its .rodata sections and string tables.  Anything
+// without usable section headers is searched whole.  Sets found[i] for
+// each pattern that occurs and returns how many do; the search stops
+// once all of them have been seen.
+int elf_find_strings(const uint8_t *data, size_t size,
+                     const char *const patterns[], int count,
+                     bool found[]);
+
+#endif
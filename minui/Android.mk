@@ -5,7 +5,7 @@ LOCAL_SRC_FILES := events.c resources.c
 ifneq ($(BOARD_CUSTOM_GRAPHICS),)
   LOCAL_SRC_FILES += $(BOARD_CUSTOM_GRAPHICS)
 else
-  LOCAL_SRC_FILES += graphics.c graphics_overlay.c
+  LOCAL_SRC_FILES += graphics.c graphics_overlay.c graphics_drm.c blit.c
 endif
 
 LOCAL_C_INCLUDES +=\
@@ -21,6 +21,13 @@ ifeq ($(TARGET_USES_QCOM_BSP), true)
     LOCAL_CFLAGS += -DMSM_BSP
 endif
 
+# DRM/KMS backend, off unless the board asks for it.  Once built in it
+# is picked at runtime with ro.minui.backend=drm or when there is no
+# fbdev device
+ifeq ($(BOARD_RECOVERY_DRM_GRAPHICS), true)
+    LOCAL_CFLAGS += -DRECOVERY_DRM_GRAPHICS
+endif
+
 LOCAL_MODULE := libminui
 
 # This used to compare against values in double-quotes (which are just
@@ -44,6 +51,10 @@ ifneq ($(BOARD_USE_CUSTOM_RECOVERY_FONT),)
   LOCAL_CFLAGS += -DBOARD_USE_CUSTOM_RECOVERY_FONT=$(BOARD_USE_CUSTOM_RECOVERY_FONT)
 endif
 
+ifeq ($(TARGET_ARCH)-$(ARCH_ARM_HAVE_NEON),arm-true)
+  LOCAL_CFLAGS += -mfpu=neon
+endif
+
 ifeq ($(BOARD_HAS_FLIPPED_SCREEN), true)
     LOCAL_CFLAGS += -DBOARD_HAS_FLIPPED_SCREEN
 endif
@@ -53,3 +64,12 @@ ifneq ($(TARGET_RECOVERY_LCD_BACKLIGHT_PATH),)
 endif
 
 include $(BUILD_STATIC_LIBRARY)
+
+# Host tool that packs res/images into the atlas mapped by resources.c
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := mkatlas.c
+LOCAL_C_INCLUDES += external/libpng external/zlib
+LOCAL_STATIC_LIBRARIES := libpng libz
+LOCAL_MODULE := minui_mkatlas
+LOCAL_MODULE_TAGS := optional
+include $(BUILD_HOST_EXECUTABLE)
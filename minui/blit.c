@@ -0,0 +1,254 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "blit.h"
+
+int blit_bytes_per_pixel(BlitFormat format)
+{
+    return format == BLIT_RGB_565 ? 2 : 4;
+}
+
+/* dst[i] = src[n-1-i] for 16-bit pixels */
+static void reverse_16(uint16_t *dst, const uint16_t *src, int n)
+{
+    src += n;
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+    for (; n >= 8; n -= 8, dst += 8) {
+        src -= 8;
+        uint16x8_t v = vrev64q_u16(vld1q_u16(src));
+        vst1q_u16(dst, vcombine_u16(vget_high_u16(v), vget_low_u16(v)));
+    }
+#elif defined(__SSE2__)
+    for (; n >= 8; n -= 8, dst += 8) {
+        src -= 8;
+        __m128i v = _mm_loadu_si128((const __m128i*) src);
+        v = _mm_shufflelo_epi16(v, 0x1b);
+        v = _mm_shufflehi_epi16(v, 0x1b);
+        _mm_storeu_si128((__m128i*) dst, _mm_shuffle_epi32(v, 0x4e));
+    }
+#endif
+    for (; n > 0; n--)
+        *dst++ = *--src;
+}
+
+/* dst[i] = src[n-1-i] for 32-bit pixels */
+static void reverse_32(uint32_t *dst, const uint32_t *src, int n)
+{
+    src += n;
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+    for (; n >= 4; n -= 4, dst += 4) {
+        src -= 4;
+        uint32x4_t v = vrev64q_u32(vld1q_u32(src));
+        vst1q_u32(dst, vcombine_u32(vget_high_u32(v), vget_low_u32(v)));
+    }
+#elif defined(__SSE2__)
+    for (; n >= 4; n -= 4, dst += 4) {
+        src -= 4;
+        __m128i v = _mm_loadu_si128((const __m128i*) src);
+        _mm_storeu_si128((__m128i*) dst, _mm_shuffle_epi32(v, 0x1b));
+    }
+#endif
+    for (; n > 0; n--)
+        *dst++ = *--src;
+}
+
+/* RGB565 to RGBX (bgr == 0) or BGRA (bgr == 1), widening each channel
+ * by replicating its top bits. */
+static void expand_565(GGLubyte *dst, const uint16_t *src, int n, int bgr)
+{
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+    for (; n >= 8; n -= 8, src += 8, dst += 32) {
+        uint16x8_t p = vld1q_u16(src);
+        uint16x8_t r = vshrq_n_u16(p, 11);
+        uint16x8_t g = vandq_u16(vshrq_n_u16(p, 5), vdupq_n_u16(0x3f));
+        uint16x8_t b = vandq_u16(p, vdupq_n_u16(0x1f));
+        uint8x8x4_t v;
+        v.val[bgr ? 2 : 0] = vmovn_u16(vorrq_u16(vshlq_n_u16(r, 3), vshrq_n_u16(r, 2)));
+        v.val[1] = vmovn_u16(vorrq_u16(vshlq_n_u16(g, 2), vshrq_n_u16(g, 4)));
+        v.val[bgr ? 0 : 2] = vmovn_u16(vorrq_u16(vshlq_n_u16(b, 3), vshrq_n_u16(b, 2)));
+        v.val[3] = vdup_n_u8(0xff);
+        vst4_u8(dst, v);
+    }
+#elif defined(__SSE2__)
+    const __m128i alpha = _mm_set1_epi16((short) 0xff00);
+    for (; n >= 8; n -= 8, src += 8, dst += 32) {
+        __m128i p = _mm_loadu_si128((const __m128i*) src);
+        __m128i r = _mm_srli_epi16(p, 11);
+        __m128i g = _mm_and_si128(_mm_srli_epi16(p, 5), _mm_set1_epi16(0x3f));
+        __m128i b = _mm_and_si128(p, _mm_set1_epi16(0x1f));
+        r = _mm_or_si128(_mm_slli_epi16(r, 3), _mm_srli_epi16(r, 2));
+        g = _mm_or_si128(_mm_slli_epi16(g, 2), _mm_srli_epi16(g, 4));
+        b = _mm_or_si128(_mm_slli_epi16(b, 3), _mm_srli_epi16(b, 2));
+        /* low half of each pixel holds bytes 0-1, high half bytes 2-3 */
+        __m128i lo = _mm_or_si128(bgr ? b : r, _mm_slli_epi16(g, 8));
+        __m128i hi = _mm_or_si128(bgr ? r : b, alpha);
+        _mm_storeu_si128((__m128i*) dst, _mm_unpacklo_epi16(lo, hi));
+        _mm_storeu_si128((__m128i*) (dst + 16), _mm_unpackhi_epi16(lo, hi));
+    }
+#endif
+    for (; n > 0; n--, src++, dst += 4) {
+        unsigned r = *src >> 11, g = (*src >> 5) & 0x3f, b = *src & 0x1f;
+        dst[bgr ? 2 : 0] = (r << 3) | (r >> 2);
+        dst[1] = (g << 2) | (g >> 4);
+        dst[bgr ? 0 : 2] = (b << 3) | (b >> 2);
+        dst[3] = 0xff;
+    }
+}
+
+/* RGBX (bgr == 0) or BGRA (bgr == 1) to RGB565, truncating each channel. */
+static void pack_565(uint16_t *dst, const GGLubyte *src, int n, int bgr)
+{
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+    for (; n >= 8; n -= 8, src += 32, dst += 8) {
+        uint8x8x4_t v = vld4_u8(src);
+        uint16x8_t p = vshll_n_u8(v.val[bgr ? 2 : 0], 8);
+        p = vsriq_n_u16(p, vshll_n_u8(v.val[1], 8), 5);
+        p = vsriq_n_u16(p, vshll_n_u8(v.val[bgr ? 0 : 2], 8), 11);
+        vst1q_u16(dst, p);
+    }
+#elif defined(__SSE2__)
+    const __m128i byte = _mm_set1_epi32(0xff);
+    const __m128i bias = _mm_set1_epi32(0x8000);
+    for (; n >= 8; n -= 8, src += 32, dst += 8) {
+        __m128i out[2];
+        int k;
+        for (k = 0; k < 2; k++) {
+            __m128i v = _mm_loadu_si128((const __m128i*) (src + 16 * k));
+            __m128i c0 = _mm_and_si128(v, byte);
+            __m128i g = _mm_and_si128(_mm_srli_epi32(v, 8), byte);
+            __m128i c2 = _mm_and_si128(_mm_srli_epi32(v, 16), byte);
+            __m128i r = bgr ? c2 : c0, b = bgr ? c0 : c2;
+            __m128i p = _mm_or_si128(_mm_slli_epi32(_mm_srli_epi32(r, 3), 11),
+                        _mm_or_si128(_mm_slli_epi32(_mm_srli_epi32(g, 2), 5),
+                                     _mm_srli_epi32(b, 3)));
+            /* bias into signed range so the saturating pack keeps all 16 bits */
+            out[k] = _mm_sub_epi32(p, bias);
+        }
+        __m128i p = _mm_packs_epi32(out[0], out[1]);
+        _mm_storeu_si128((__m128i*) dst, _mm_xor_si128(p, _mm_set1_epi16((short) 0x8000)));
+    }
+#endif
+    for (; n > 0; n--, src += 4) {
+        unsigned r = src[bgr ? 2 : 0], g = src[1], b = src[bgr ? 0 : 2];
+        *dst++ = ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+    }
+}
+
+/* RGBX <-> BGRA: swap bytes 0 and 2 of every pixel. */
+static void swap_rb(GGLubyte *dst, const GGLubyte *src, int n)
+{
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+    for (; n >= 8; n -= 8, src += 32, dst += 32) {
+        uint8x8x4_t v = vld4_u8(src);
+        uint8x8_t t = v.val[0];
+        v.val[0] = v.val[2];
+        v.val[2] = t;
+        vst4_u8(dst, v);
+    }
+#elif defined(__SSE2__)
+    const __m128i keep = _mm_set1_epi32(0xff00ff00);
+    const __m128i byte = _mm_set1_epi32(0xff);
+    for (; n >= 4; n -= 4, src += 16, dst += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*) src);
+        __m128i p = _mm_or_si128(_mm_and_si128(v, keep),
+                    _mm_or_si128(_mm_and_si128(_mm_srli_epi32(v, 16), byte),
+                                 _mm_slli_epi32(_mm_and_si128(v, byte), 16)));
+        _mm_storeu_si128((__m128i*) dst, p);
+    }
+#endif
+    for (; n > 0; n--, src += 4, dst += 4) {
+        GGLubyte t = src[0];
+        dst[0] = src[2];
+        dst[1] = src[1];
+        dst[2] = t;
+        dst[3] = src[3];
+    }
+}
+
+static void convert_row(GGLubyte *dst, BlitFormat dst_format,
+                        const GGLubyte *src, BlitFormat src_format, int n)
+{
+    if (dst_format == src_format)
+        memcpy(dst, src, n * blit_bytes_per_pixel(src_format));
+    else if (src_format == BLIT_RGB_565)
+        expand_565(dst, (const uint16_t*) src, n, dst_format == BLIT_BGRA_8888);
+    else if (dst_format == BLIT_RGB_565)
+        pack_565((uint16_t*) dst, src, n, src_format == BLIT_BGRA_8888);
+    else
+        swap_rb(dst, src, n);
+}
+
+static void reverse_row(GGLubyte *dst, const GGLubyte *src, BlitFormat format, int n)
+{
+    if (format == BLIT_RGB_565)
+        reverse_16((uint16_t*) dst, (const uint16_t*) src, n);
+    else
+        reverse_32((uint32_t*) dst, (const uint32_t*) src, n);
+}
+
+void blit_rows(const BlitBuffer *dst, const BlitBuffer *src,
+               int top, int bottom, int rotate)
+{
+    /* a rotated conversion goes through one row of scratch space */
+    static GGLubyte *row_buf = NULL;
+    static int row_buf_size = 0;
+    const int width = src->width;
+    const int convert = dst->format != src->format;
+    int y;
+
+    if (top < 0) top = 0;
+    if (bottom > src->height) bottom = src->height;
+
+    if (rotate && convert) {
+        int size = width * blit_bytes_per_pixel(dst->format);
+        if (size > row_buf_size) {
+            GGLubyte *buf = realloc(row_buf, size);
+            if (buf == NULL) {
+                fprintf(stderr, "blit: can't allocate %d byte row buffer\n", size);
+                return;
+            }
+            row_buf = buf;
+            row_buf_size = size;
+        }
+    }
+
+    for (y = top; y < bottom; y++) {
+        const GGLubyte *in = src->data + y * src->stride;
+
+        if (!rotate) {
+            convert_row(dst->data + y * dst->stride, dst->format, in, src->format, width);
+            continue;
+        }
+
+        GGLubyte *out = dst->data + (src->height - 1 - y) * dst->stride;
+        if (convert) {
+            convert_row(row_buf, dst->format, in, src->format, width);
+            in = row_buf;
+        }
+        reverse_row(out, in, dst->format, width);
+    }
+}
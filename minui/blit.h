@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MINUI_BLIT_H_
+#define _MINUI_BLIT_H_
+
+#include <pixelflinger/pixelflinger.h>
+
+// Pixel layouts named by their byte order in memory.
+typedef enum {
+    BLIT_RGB_565,
+    BLIT_RGBX_8888,
+    BLIT_BGRA_8888,
+} BlitFormat;
+
+typedef struct {
+    GGLubyte *data;
+    int width;
+    int height;
+    int stride;         // bytes per row
+    BlitFormat format;
+} BlitBuffer;
+
+int blit_bytes_per_pixel(BlitFormat format);
+
+// Copies rows [top, bottom) of src into dst, converting the pixel format
+// when the two differ.  Both buffers must have the same width and height.
+// With rotate set the image is turned 180 degrees on the way, so source
+// row y lands on destination row height-1-y.
+void blit_rows(const BlitBuffer *dst, const BlitBuffer *src,
+               int top, int bottom, int rotate);
+
+#endif
@@ -24,13 +24,21 @@
 
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 
 #include <linux/fb.h>
 #include <linux/kd.h>
 
+#include <cutils/properties.h>
 #include <pixelflinger/pixelflinger.h>
 
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #ifdef BOARD_USE_CUSTOM_RECOVERY_FONT
 #include BOARD_USE_CUSTOM_RECOVERY_FONT
 #else
@@ -38,22 +46,32 @@
 #endif
 
 #include "minui.h"
+#include "blit.h"
 
 #if defined(RECOVERY_BGRA)
 #define PIXEL_FORMAT GGL_PIXEL_FORMAT_BGRA_8888
 #define PIXEL_SIZE   4
+#define BLIT_FORMAT  BLIT_BGRA_8888
 #elif defined(RECOVERY_RGBX)
 #define PIXEL_FORMAT GGL_PIXEL_FORMAT_RGBX_8888
 #define PIXEL_SIZE   4
+#define BLIT_FORMAT  BLIT_RGBX_8888
 #else
 #define PIXEL_FORMAT GGL_PIXEL_FORMAT_RGB_565
 #define PIXEL_SIZE   2
+#define BLIT_FORMAT  BLIT_RGB_565
 #endif
 
 #define NUM_BUFFERS 2
 #define ALIGN(x, align) (((x) + ((align)-1)) & ~((align)-1))
 #define MAX_DISPLAY_DIM  2048
 
+/* A horizontal run of set pixels within one row of a glyph. */
+typedef struct {
+    unsigned char x;
+    unsigned char len;
+} GRSpan;
+
 typedef struct {
     GGLSurface texture;
     unsigned cwidth;
@@ -62,6 +80,11 @@ typedef struct {
     int ts_x;
     int ts_y;
     int ts_touchY;    
+    /* glyph atlas: the spans of row r of glyph g are
+     * spans[span_index[g*cheight+r]] up to spans[span_index[g*cheight+r+1]] */
+    unsigned glyphs;
+    GRSpan *spans;
+    unsigned *span_index;
 } GRFont;
 
 static GRFont *gr_font = 0;
@@ -82,6 +105,17 @@ static struct fb_var_screeninfo vi;
 static struct fb_fix_screeninfo fi;
 
 static bool has_overlay = false;
+static bool has_drm = false;
+/* devices with physically inverted screens get every frame turned 180
+ * degrees on its way to the display */
+#ifdef BOARD_HAS_FLIPPED_SCREEN
+static const int flipped_screen = 1;
+#else
+static const int flipped_screen = 0;
+#endif
+/* what the framebuffer actually holds; converted to on flip if the
+ * driver did not take PIXEL_FORMAT */
+static BlitFormat gr_fb_format = BLIT_FORMAT;
 static int leftSplit = 0;
 static int rightSplit = 0;
 
@@ -91,7 +125,12 @@ int free_ion_mem(void);
 int alloc_ion_mem(unsigned int size);
 int allocate_overlay(int fd, GGLSurface gr_fb[]);
 int free_overlay(int fd);
-int overlay_display_frame(int fd, GGLubyte* data, size_t size);
+int overlay_display_frame(int fd, const BlitBuffer *src, int top, int bottom);
+
+int drm_init(GGLSurface *fb);
+int drm_flip(unsigned n);
+void drm_blank(bool blank);
+void drm_exit(void);
 
 static int get_framebuffer(GGLSurface *fb)
 {
@@ -162,6 +201,14 @@ static int get_framebuffer(GGLSurface *fb)
            return -1;
        }
 
+       if (vi.bits_per_pixel == 16 && PIXEL_SIZE != 2) {
+           gr_fb_format = BLIT_RGB_565;
+       } else if (vi.bits_per_pixel == 32 && PIXEL_SIZE != 4) {
+           gr_fb_format = vi.red.offset == 16 ? BLIT_BGRA_8888 : BLIT_RGBX_8888;
+       }
+       if (gr_fb_format != BLIT_FORMAT)
+           printf("framebuffer is %d bpp, converting on flip\n", vi.bits_per_pixel);
+
        bits = mmap(0, fi.smem_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
        if (bits == MAP_FAILED) {
            perror("failed to mmap framebuffer");
@@ -211,7 +258,10 @@ static void get_memory_surface(GGLSurface* ms) {
   ms->width = vi.xres;
   ms->height = vi.yres;
   ms->stride = fi.line_length/PIXEL_SIZE;
-  ms->data = malloc(fi.line_length * vi.yres);
+  // a framebuffer in a narrower format has shorter lines than we need
+  if (ms->stride < vi.xres)
+      ms->stride = vi.xres;
+  ms->data = malloc(ms->stride * PIXEL_SIZE * vi.yres);
   ms->format = PIXEL_FORMAT;
 }
 
@@ -273,53 +323,185 @@ static void set_active_framebuffer(unsigned n)
     if (n > 1 || !double_buffering) return;
     vi.yres_virtual = vi.yres * NUM_BUFFERS;
     vi.yoffset = n * vi.yres;
-    vi.bits_per_pixel = PIXEL_SIZE * 8;
+    vi.bits_per_pixel = blit_bytes_per_pixel(gr_fb_format) * 8;
     if (ioctl(gr_fb_fd, FBIOPUT_VSCREENINFO, &vi) < 0) {
         perror("active fb swap failed");
     }
 }
 
+/* Rows of the memory surface drawn since the last flip, and for each
+ * framebuffer the rows it is missing since it was last made active.
+ * With double buffering the back buffer is two frames stale, so a
+ * frame's damage has to be applied to both buffers. */
+static int gr_dirty_top = 0;
+static int gr_dirty_bottom = 0;
+static int gr_fb_dirty_top[NUM_BUFFERS];
+static int gr_fb_dirty_bottom[NUM_BUFFERS];
+
+/* Current clip band in surface rows; damage outside of it is ignored
+ * since pixelflinger's scissor keeps those rows untouched. */
+static int gr_clip_left = 0;
+static int gr_clip_right = MAX_DISPLAY_DIM;
+static int gr_clip_top = 0;
+static int gr_clip_bottom = MAX_DISPLAY_DIM;
+
+/* Current color as stored in the surface, used by the text renderer. */
+static unsigned char gr_text_rgba[4];
+static unsigned char gr_text_alpha = 255;
+
+static void gr_damage(int top, int bottom)
+{
+    if (top < gr_clip_top) top = gr_clip_top;
+    if (bottom > gr_clip_bottom) bottom = gr_clip_bottom;
+    if (top < 0) top = 0;
+    if (bottom > (int) vi.yres) bottom = vi.yres;
+    if (top >= bottom)
+        return;
+
+    if (gr_dirty_top >= gr_dirty_bottom) {
+        gr_dirty_top = top;
+        gr_dirty_bottom = bottom;
+        return;
+    }
+    if (top < gr_dirty_top) gr_dirty_top = top;
+    if (bottom > gr_dirty_bottom) gr_dirty_bottom = bottom;
+}
+
+static void gr_damage_all(void)
+{
+    int i;
+    for (i = 0; i < NUM_BUFFERS; i++) {
+        gr_fb_dirty_top[i] = 0;
+        gr_fb_dirty_bottom[i] = vi.yres;
+    }
+}
+
 void gr_flip(void)
 {
+    BlitBuffer src = {
+        gr_mem_surface.data, vi.xres, vi.yres,
+        gr_mem_surface.stride * PIXEL_SIZE, BLIT_FORMAT
+    };
+    int i;
+
+    /* fold this frame's damage into what each buffer is missing */
+    if (gr_dirty_top < gr_dirty_bottom) {
+        for (i = 0; i < NUM_BUFFERS; i++) {
+            if (gr_fb_dirty_top[i] >= gr_fb_dirty_bottom[i]) {
+                gr_fb_dirty_top[i] = gr_dirty_top;
+                gr_fb_dirty_bottom[i] = gr_dirty_bottom;
+                continue;
+            }
+            if (gr_dirty_top < gr_fb_dirty_top[i])
+                gr_fb_dirty_top[i] = gr_dirty_top;
+            if (gr_dirty_bottom > gr_fb_dirty_bottom[i])
+                gr_fb_dirty_bottom[i] = gr_dirty_bottom;
+        }
+    }
+    gr_dirty_top = gr_dirty_bottom = 0;
+
     if (has_overlay) {
         // Allocate overly. It'll exit early if overlay already
         // allocated and allocate it if not already allocated.
         allocate_overlay(gr_fb_fd, gr_framebuffer);
-        if (overlay_display_frame(gr_fb_fd,gr_mem_surface.data,
-                                     (fi.line_length * vi.yres)) < 0) {
+        if (overlay_display_frame(gr_fb_fd, &src, gr_fb_dirty_top[gr_active_fb],
+                                  gr_fb_dirty_bottom[gr_active_fb]) < 0) {
             // Free overlay in failure case
             free_overlay(gr_fb_fd);
+            // and send the whole frame once it is back
+            gr_damage_all();
+            return;
+        }
+        gr_fb_dirty_top[gr_active_fb] = gr_fb_dirty_bottom[gr_active_fb] = 0;
+    } else if (has_drm && flipped_screen) {
+        /* we drew into memory; turn the rows the back buffer is missing
+         * around into it, then show it at vblank */
+        unsigned back = (gr_active_fb + 1) & 1;
+        if (gr_fb_dirty_top[back] < gr_fb_dirty_bottom[back]) {
+            BlitBuffer dst = {
+                gr_framebuffer[back].data, vi.xres, vi.yres,
+                fi.line_length, BLIT_FORMAT
+            };
+            blit_rows(&dst, &src, gr_fb_dirty_top[back], gr_fb_dirty_bottom[back], 1);
+            gr_fb_dirty_top[back] = gr_fb_dirty_bottom[back] = 0;
+        }
+        /* if it can't be shown, it is tried again with the next frame */
+        if (drm_flip(back) == 0)
+            gr_active_fb = back;
+    } else if (has_drm) {
+        /* we drew straight into the back buffer; show it at vblank */
+        unsigned shown = (gr_active_fb + 1) & 1;
+        if (drm_flip(shown) < 0) {
+            /* still showing the old buffer; the rows stay dirty and go
+             * out with the next frame */
+            return;
         }
+        gr_active_fb = shown;
+        gr_fb_dirty_top[shown] = gr_fb_dirty_bottom[shown] = 0;
+
+        /* bring the new back buffer up to date with the rows drawn
+         * since it was last shown, then keep drawing into it */
+        unsigned back = (shown + 1) & 1;
+        if (gr_fb_dirty_top[back] < gr_fb_dirty_bottom[back]) {
+            BlitBuffer front = {
+                gr_framebuffer[shown].data, vi.xres, vi.yres,
+                fi.line_length, BLIT_FORMAT
+            };
+            BlitBuffer dst = front;
+            dst.data = gr_framebuffer[back].data;
+            blit_rows(&dst, &front, gr_fb_dirty_top[back], gr_fb_dirty_bottom[back], 0);
+            gr_fb_dirty_top[back] = gr_fb_dirty_bottom[back] = 0;
+        }
+        gr_mem_surface = gr_framebuffer[back];
+        gr_context->colorBuffer(gr_context, &gr_mem_surface);
     } else {
-        GGLContext *gl = gr_context;
-
         /* swap front and back buffers */
         if (double_buffering)
             gr_active_fb = (gr_active_fb + 1) & 1;
 
-#ifdef BOARD_HAS_FLIPPED_SCREEN
-    /* flip buffer 180 degrees for devices with physicaly inverted screens */
-    unsigned int i;
-    unsigned int j;
-    uint8_t tmp;
-    for (i = 0; i < ((vi.xres_virtual * vi.yres)/2); i++) {
-	for (j = 0; j < PIXEL_SIZE; j++) {
-		tmp = gr_mem_surface.data[i * PIXEL_SIZE + j];
-		gr_mem_surface.data[i * PIXEL_SIZE + j] = gr_mem_surface.data[(vi.xres_virtual * vi.yres * PIXEL_SIZE) - ((i+1) * PIXEL_SIZE) + j];
-		gr_mem_surface.data[(vi.xres_virtual * vi.yres * PIXEL_SIZE) - ((i+1) * PIXEL_SIZE) + j] = tmp;
-	}
+        /* copy the stale scanlines from the in-memory surface to the
+         * buffer we're about to make active, rotating them 180 degrees
+         * for devices with physicaly inverted screens. */
+        if (gr_fb_dirty_top[gr_active_fb] < gr_fb_dirty_bottom[gr_active_fb]) {
+            BlitBuffer dst = {
+                gr_framebuffer[gr_active_fb].data, vi.xres, vi.yres,
+                fi.line_length, gr_fb_format
+            };
+            blit_rows(&dst, &src, gr_fb_dirty_top[gr_active_fb],
+                      gr_fb_dirty_bottom[gr_active_fb], flipped_screen);
+            gr_fb_dirty_top[gr_active_fb] = gr_fb_dirty_bottom[gr_active_fb] = 0;
+        }
+
+        /* inform the display driver */
+        set_active_framebuffer(gr_active_fb);
     }
-#endif
+}
+
+void gr_clip(int x, int y, int w, int h)
+{
+    GGLContext *gl = gr_context;
 
+    x += overscan_offset_x;
+    y += overscan_offset_y;
 
-    /* copy data from the in-memory surface to the buffer we're about
-     * to make active. */
-    memcpy(gr_framebuffer[gr_active_fb].data, gr_mem_surface.data,
-           vi.xres_virtual * vi.yres * PIXEL_SIZE);
+    gr_clip_left = x;
+    gr_clip_right = x + w;
+    gr_clip_top = y;
+    gr_clip_bottom = y + h;
+    gl->scissor(gl, x, y, w, h);
+    gl->enable(gl, GGL_SCISSOR_TEST);
+}
 
-    /* inform the display driver */
-    set_active_framebuffer(gr_active_fb);
-    }
+void gr_noclip(void)
+{
+    GGLContext *gl = gr_context;
+
+    gr_clip_left = 0;
+    gr_clip_right = MAX_DISPLAY_DIM;
+    gr_clip_top = 0;
+    gr_clip_bottom = MAX_DISPLAY_DIM;
+    gl->scissor(gl, 0, 0, gr_mem_surface.width, gr_mem_surface.height);
+    gl->disable(gl, GGL_SCISSOR_TEST);
 }
 
 void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a)
@@ -331,6 +513,23 @@ void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a
     color[2] = ((b << 8) | b) + 1;
     color[3] = ((a << 8) | a) + 1;
     gl->color4xv(gl, color);
+
+#if defined(RECOVERY_BGRA)
+    gr_text_rgba[0] = b;
+    gr_text_rgba[1] = g;
+    gr_text_rgba[2] = r;
+    gr_text_rgba[3] = a;
+#elif defined(RECOVERY_RGBX)
+    gr_text_rgba[0] = r;
+    gr_text_rgba[1] = g;
+    gr_text_rgba[2] = b;
+    gr_text_rgba[3] = a;
+#else
+    gr_text_rgba[0] = r >> 3;
+    gr_text_rgba[1] = g >> 2;
+    gr_text_rgba[2] = b >> 3;
+#endif
+    gr_text_alpha = a;
 }
 
 int gr_measure(const char *s)
@@ -344,33 +543,182 @@ void gr_font_size(int *x, int *y)
     *y = gr_font->cheight;
 }
 
+/* Blending helpers for the text renderer.  Each channel becomes
+ * (s*a + d*(255-a)) / 255, with the division done as (x + 1 + (x>>8)) >> 8
+ * so it fits in 16-bit lanes. */
+#if PIXEL_SIZE == 4
+static void blend_span(GGLubyte *dst, int n)
+{
+    const unsigned a = gr_text_alpha;
+    const unsigned ia = 255 - a;
+    unsigned sa[4];
+    int i;
+
+    if (a == 255) {
+        uint32_t pixel;
+        memcpy(&pixel, gr_text_rgba, sizeof(pixel));
+        for (i = 0; i < n; i++, dst += 4)
+            memcpy(dst, &pixel, sizeof(pixel));
+        return;
+    }
+
+    for (i = 0; i < 4; i++)
+        sa[i] = gr_text_rgba[i] * a;
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+    {
+        const uint16_t lanes[8] = { sa[0], sa[1], sa[2], sa[3], sa[0], sa[1], sa[2], sa[3] };
+        const uint16x8_t vsa = vld1q_u16(lanes);
+        const uint16x8_t one = vdupq_n_u16(1);
+        const uint8x8_t via = vdup_n_u8(ia);
+        for (; n >= 4; n -= 4, dst += 16) {
+            uint8x16_t d = vld1q_u8(dst);
+            uint16x8_t lo = vmlal_u8(vsa, vget_low_u8(d), via);
+            uint16x8_t hi = vmlal_u8(vsa, vget_high_u8(d), via);
+            lo = vaddq_u16(vaddq_u16(lo, one), vshrq_n_u16(lo, 8));
+            hi = vaddq_u16(vaddq_u16(hi, one), vshrq_n_u16(hi, 8));
+            vst1q_u8(dst, vcombine_u8(vshrn_n_u16(lo, 8), vshrn_n_u16(hi, 8)));
+        }
+    }
+#elif defined(__SSE2__)
+    {
+        const __m128i vsa = _mm_setr_epi16(sa[0], sa[1], sa[2], sa[3], sa[0], sa[1], sa[2], sa[3]);
+        const __m128i via = _mm_set1_epi16(ia);
+        const __m128i one = _mm_set1_epi16(1);
+        const __m128i zero = _mm_setzero_si128();
+        for (; n >= 4; n -= 4, dst += 16) {
+            __m128i d = _mm_loadu_si128((const __m128i*) dst);
+            __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), via), vsa);
+            __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), via), vsa);
+            lo = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(lo, one), _mm_srli_epi16(lo, 8)), 8);
+            hi = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(hi, one), _mm_srli_epi16(hi, 8)), 8);
+            _mm_storeu_si128((__m128i*) dst, _mm_packus_epi16(lo, hi));
+        }
+    }
+#endif
+
+    for (; n > 0; n--) {
+        for (i = 0; i < 4; i++, dst++) {
+            unsigned x = sa[i] + *dst * ia;
+            *dst = (x + 1 + (x >> 8)) >> 8;
+        }
+    }
+}
+#else
+static void blend_span(GGLubyte *dst, int n)
+{
+    const unsigned a = gr_text_alpha;
+    const unsigned ia = 255 - a;
+    uint16_t *p = (uint16_t*) dst;
+
+    if (a == 255) {
+        uint16_t pixel = (gr_text_rgba[0] << 11) | (gr_text_rgba[1] << 5) | gr_text_rgba[2];
+        for (; n > 0; n--)
+            *p++ = pixel;
+        return;
+    }
+
+    const unsigned sr = gr_text_rgba[0] * a;
+    const unsigned sg = gr_text_rgba[1] * a;
+    const unsigned sb = gr_text_rgba[2] * a;
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+    {
+        const uint16x8_t vsr = vdupq_n_u16(sr), vsg = vdupq_n_u16(sg), vsb = vdupq_n_u16(sb);
+        const uint16x8_t via = vdupq_n_u16(ia);
+        const uint16x8_t one = vdupq_n_u16(1);
+        for (; n >= 8; n -= 8, p += 8) {
+            uint16x8_t d = vld1q_u16(p);
+            uint16x8_t r = vmlaq_u16(vsr, vshrq_n_u16(d, 11), via);
+            uint16x8_t g = vmlaq_u16(vsg, vandq_u16(vshrq_n_u16(d, 5), vdupq_n_u16(0x3f)), via);
+            uint16x8_t b = vmlaq_u16(vsb, vandq_u16(d, vdupq_n_u16(0x1f)), via);
+            r = vshrq_n_u16(vaddq_u16(vaddq_u16(r, one), vshrq_n_u16(r, 8)), 8);
+            g = vshrq_n_u16(vaddq_u16(vaddq_u16(g, one), vshrq_n_u16(g, 8)), 8);
+            b = vshrq_n_u16(vaddq_u16(vaddq_u16(b, one), vshrq_n_u16(b, 8)), 8);
+            vst1q_u16(p, vorrq_u16(vorrq_u16(vshlq_n_u16(r, 11), vshlq_n_u16(g, 5)), b));
+        }
+    }
+#elif defined(__SSE2__)
+    {
+        const __m128i vsr = _mm_set1_epi16(sr), vsg = _mm_set1_epi16(sg), vsb = _mm_set1_epi16(sb);
+        const __m128i via = _mm_set1_epi16(ia);
+        const __m128i one = _mm_set1_epi16(1);
+        for (; n >= 8; n -= 8, p += 8) {
+            __m128i d = _mm_loadu_si128((const __m128i*) p);
+            __m128i r = _mm_add_epi16(_mm_mullo_epi16(_mm_srli_epi16(d, 11), via), vsr);
+            __m128i g = _mm_add_epi16(_mm_mullo_epi16(_mm_and_si128(_mm_srli_epi16(d, 5), _mm_set1_epi16(0x3f)), via), vsg);
+            __m128i b = _mm_add_epi16(_mm_mullo_epi16(_mm_and_si128(d, _mm_set1_epi16(0x1f)), via), vsb);
+            r = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(r, one), _mm_srli_epi16(r, 8)), 8);
+            g = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(g, one), _mm_srli_epi16(g, 8)), 8);
+            b = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(b, one), _mm_srli_epi16(b, 8)), 8);
+            _mm_storeu_si128((__m128i*) p,
+                    _mm_or_si128(_mm_or_si128(_mm_slli_epi16(r, 11), _mm_slli_epi16(g, 5)), b));
+        }
+    }
+#endif
+
+    for (; n > 0; n--, p++) {
+        unsigned r = sr + (*p >> 11) * ia;
+        unsigned g = sg + ((*p >> 5) & 0x3f) * ia;
+        unsigned b = sb + (*p & 0x1f) * ia;
+        r = (r + 1 + (r >> 8)) >> 8;
+        g = (g + 1 + (g >> 8)) >> 8;
+        b = (b + 1 + (b >> 8)) >> 8;
+        *p = (r << 11) | (g << 5) | b;
+    }
+}
+#endif
+
+/* Text is drawn straight into the memory surface from the glyph atlas,
+ * one scanline of the whole string at a time, instead of going through
+ * a pixelflinger texture draw per character. */
 int gr_text(int x, int y, const char *s, int bold)
 {
-    GGLContext *gl = gr_context;
     GRFont *font = gr_font;
-    unsigned off;
+    const unsigned char *str = (const unsigned char*) s;
+    int len = strlen(s);
+    int end, left, right, top, bottom, row;
 
     x += overscan_offset_x;
     y += overscan_offset_y;
 
     y -= font->ascent;
-
-    gl->bindTexture(gl, &font->texture);
-    gl->texEnvi(gl, GGL_TEXTURE_ENV, GGL_TEXTURE_ENV_MODE, GGL_REPLACE);
-    gl->texGeni(gl, GGL_S, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
-    gl->texGeni(gl, GGL_T, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
-    gl->enable(gl, GGL_TEXTURE_2D);
-
-    while((off = *s++)) {
-        off -= 32;
-        if (off < 96) {
-            gl->texCoord2i(gl, (off * font->cwidth) - x, 0 - y);
-            gl->recti(gl, x, y, x + font->cwidth, y + font->cheight);
+    end = x + len * font->cwidth;
+    gr_damage(y, y + font->cheight);
+
+    left = gr_clip_left > 0 ? gr_clip_left : 0;
+    right = gr_clip_right < (int) gr_mem_surface.width ? gr_clip_right : (int) gr_mem_surface.width;
+    top = gr_clip_top > y ? gr_clip_top : y;
+    if (top < 0) top = 0;
+    bottom = y + (int) font->cheight;
+    if (bottom > gr_clip_bottom) bottom = gr_clip_bottom;
+    if (bottom > (int) gr_mem_surface.height) bottom = gr_mem_surface.height;
+
+    for (row = top; row < bottom; row++) {
+        GGLubyte *line = gr_mem_surface.data + row * gr_mem_surface.stride * PIXEL_SIZE;
+        const unsigned *index = font->span_index + (row - y);
+        const unsigned char *c;
+        int gx = x;
+
+        for (c = str; *c && gx < right; c++, gx += font->cwidth) {
+            unsigned off = *c - 32;
+            if (*c < 32 || off >= font->glyphs || gx + (int) font->cwidth <= left)
+                continue;
+
+            const GRSpan *span = font->spans + index[off * font->cheight];
+            const GRSpan *last = font->spans + index[off * font->cheight + 1];
+            for (; span < last; span++) {
+                int x0 = gx + span->x;
+                int x1 = x0 + span->len;
+                if (x0 < left) x0 = left;
+                if (x1 > right) x1 = right;
+                if (x0 < x1)
+                    blend_span(line + x0 * PIXEL_SIZE, x1 - x0);
+            }
         }
-        x += font->cwidth;
     }
 
-    return x;
+    return end;
 }
 
 void gr_texticon(int x, int y, gr_surface icon) {
@@ -390,6 +738,7 @@ void gr_texticon(int x, int y, gr_surface icon) {
 
     int w = gr_get_width(icon);
     int h = gr_get_height(icon);
+    gr_damage(y, y + h);
 
     gl->texCoord2i(gl, -x, -y);
     gl->recti(gl, x, y, x+gr_get_width(icon), y+gr_get_height(icon));
@@ -403,6 +752,8 @@ void gr_fill(int x1, int y1, int x2, int y2)
     x2 += overscan_offset_x;
     y2 += overscan_offset_y;
 
+    gr_damage(y1, y2);
+
     GGLContext *gl = gr_context;
     gl->disable(gl, GGL_TEXTURE_2D);
     gl->recti(gl, x1, y1, x2, y2);
@@ -416,6 +767,7 @@ void gr_blit(gr_surface source, int sx, int sy, int w, int h, int dx, int dy) {
 
     dx += overscan_offset_x;
     dy += overscan_offset_y;
+    gr_damage(dy, dy + h);
 
     gl->bindTexture(gl, (GGLSurface*) source);
     gl->texEnvi(gl, GGL_TEXTURE_ENV, GGL_TEXTURE_ENV_MODE, GGL_REPLACE);
@@ -440,6 +792,59 @@ unsigned int gr_get_height(gr_surface surface) {
     return ((GGLSurface*) surface)->height;
 }
 
+/* Turn the font texture into runs of set pixels per glyph row, so
+ * gr_text() never has to look at the empty parts of a glyph. */
+static void gr_build_glyph_atlas(GRFont *f)
+{
+    const unsigned char *bits = f->texture.data;
+    unsigned total = 0, n = 0;
+    unsigned g, r, x;
+
+    f->glyphs = f->texture.width / f->cwidth;
+    if (f->glyphs > 96)
+        f->glyphs = 96;
+
+    /* count the runs first so both tables are allocated once */
+    for (g = 0; g < f->glyphs; g++) {
+        for (r = 0; r < f->cheight; r++) {
+            const unsigned char *p = bits + r * f->texture.stride + g * f->cwidth;
+            for (x = 0; x < f->cwidth; x++) {
+                if (p[x] && (x == 0 || !p[x-1]))
+                    total++;
+            }
+        }
+    }
+
+    f->spans = malloc(total * sizeof(GRSpan));
+    f->span_index = malloc((f->glyphs * f->cheight + 1) * sizeof(unsigned));
+    if ((total && f->spans == NULL) || f->span_index == NULL) {
+        free(f->spans);
+        free(f->span_index);
+        f->spans = NULL;
+        f->span_index = NULL;
+        f->glyphs = 0;
+        return;
+    }
+
+    for (g = 0; g < f->glyphs; g++) {
+        for (r = 0; r < f->cheight; r++) {
+            const unsigned char *p = bits + r * f->texture.stride + g * f->cwidth;
+            f->span_index[g * f->cheight + r] = n;
+            for (x = 0; x < f->cwidth; x++) {
+                if (!p[x])
+                    continue;
+                if (x == 0 || !p[x-1]) {
+                    f->spans[n].x = x;
+                    f->spans[n].len = 0;
+                    n++;
+                }
+                f->spans[n-1].len++;
+            }
+        }
+    }
+    f->span_index[f->glyphs * f->cheight] = n;
+}
+
 static void gr_init_font(void)
 {
     GGLSurface *ftex;
@@ -467,6 +872,23 @@ static void gr_init_font(void)
     gr_font->cwidth = font.cwidth;
     gr_font->cheight = font.cheight;
     gr_font->ascent = font.cheight - 2;
+
+    gr_build_glyph_atlas(gr_font);
+}
+
+/* ro.minui.backend picks "fbdev" or "drm"; by default DRM is only used
+ * when there is no fbdev device, e.g. on a host running vkms. */
+static bool use_drm(void)
+{
+    char backend[PROPERTY_VALUE_MAX];
+    struct stat st;
+
+    property_get("ro.minui.backend", backend, "");
+    if (!strcmp(backend, "drm"))
+        return true;
+    if (!strcmp(backend, "fbdev"))
+        return false;
+    return stat("/dev/graphics/fb0", &st) != 0 && stat("/dev/fb0", &st) != 0;
 }
 
 int gr_init(void)
@@ -486,20 +908,40 @@ int gr_init(void)
         return -1;
     }
 
-    gr_fb_fd = get_framebuffer(gr_framebuffer);
-    if (gr_fb_fd < 0) {
-        gr_exit();
-        return -1;
+    if (use_drm()) {
+        gr_fb_fd = drm_init(gr_framebuffer);
+        has_drm = gr_fb_fd >= 0;
     }
-
-    get_memory_surface(&gr_mem_surface);
+    if (has_drm) {
+        vi.xres = gr_framebuffer[0].width;
+        vi.yres = gr_framebuffer[0].height;
+        fi.line_length = gr_framebuffer[0].stride * PIXEL_SIZE;
+        overscan_offset_x = vi.xres * overscan_percent / 100;
+        overscan_offset_y = vi.yres * overscan_percent / 100;
+        double_buffering = 1;
+        if (flipped_screen) {
+            /* frames have to be turned around on the way out */
+            get_memory_surface(&gr_mem_surface);
+        } else {
+            /* draw straight into the buffer that isn't on screen */
+            gr_mem_surface = gr_framebuffer[1];
+        }
+    } else {
+        gr_fb_fd = get_framebuffer(gr_framebuffer);
+        if (gr_fb_fd < 0) {
+            gr_exit();
+            return -1;
+        }
+        get_memory_surface(&gr_mem_surface);
+    }
+    gr_damage_all();
 
     fprintf(stderr, "framebuffer: fd %d (%d x %d)\n",
             gr_fb_fd, gr_framebuffer[0].width, gr_framebuffer[0].height);
 
     /* start with 0 as front (displayed) and 1 as back (drawing) */
     gr_active_fb = 0;
-    if (!has_overlay)
+    if (!has_overlay && !has_drm)
         set_active_framebuffer(0);
     gl->colorBuffer(gl, &gr_mem_surface);
 
@@ -527,10 +969,19 @@ void gr_exit(void)
         free_ion_mem();
     }
 
-    close(gr_fb_fd);
+    if (has_drm) {
+        /* unless the screen is flipped, the memory surface is one of
+         * the dumb buffers */
+        if (flipped_screen)
+            free(gr_mem_surface.data);
+        drm_exit();
+        has_drm = false;
+    } else {
+        close(gr_fb_fd);
+        free(gr_mem_surface.data);
+    }
     gr_fb_fd = -1;
-
-    free(gr_mem_surface.data);
+    gr_mem_surface.data = NULL;
 
     ioctl(gr_vt_fd, KDSETMODE, (void*) KD_TEXT);
     close(gr_vt_fd);
@@ -566,6 +1017,11 @@ void gr_fb_blank(bool blank)
     close(fd);
 #else
     int ret;
+    if (has_drm) {
+        drm_blank(blank);
+        return;
+    }
+
     if (has_overlay && blank) {
         free_overlay(gr_fb_fd);
     }
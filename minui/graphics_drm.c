@@ -0,0 +1,409 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include <pixelflinger/pixelflinger.h>
+
+#include "minui.h"
+
+#ifdef RECOVERY_DRM_GRAPHICS
+#include <drm/drm.h>
+#include <drm/drm_mode.h>
+
+#define DRM_CARD "/dev/dri/card0"
+#define DRM_NUM_BUFFERS 2
+#define DRM_FLIP_TIMEOUT_MS 100
+
+/* not in the kernel headers, only in libdrm */
+#define DRM_CONNECTOR_CONNECTED 1
+
+#ifndef fourcc_code
+#define fourcc_code(a, b, c, d) ((uint32_t)(a) | ((uint32_t)(b) << 8) | \
+                                 ((uint32_t)(c) << 16) | ((uint32_t)(d) << 24))
+#endif
+
+/* DRM formats are named by the packed pixel value, so our byte-ordered
+ * BGRA is XRGB8888 on a little-endian CPU. */
+#if defined(RECOVERY_BGRA)
+#define PIXEL_FORMAT GGL_PIXEL_FORMAT_BGRA_8888
+#define PIXEL_SIZE   4
+#define DRM_FORMAT   fourcc_code('X', 'R', '2', '4')
+#elif defined(RECOVERY_RGBX)
+#define PIXEL_FORMAT GGL_PIXEL_FORMAT_RGBX_8888
+#define PIXEL_SIZE   4
+#define DRM_FORMAT   fourcc_code('X', 'B', '2', '4')
+#else
+#define PIXEL_FORMAT GGL_PIXEL_FORMAT_RGB_565
+#define PIXEL_SIZE   2
+#define DRM_FORMAT   fourcc_code('R', 'G', '1', '6')
+#endif
+
+typedef struct {
+    uint32_t handle;
+    uint32_t fb_id;
+    uint64_t size;
+    void *map;
+} DrmBuffer;
+
+static int drm_fd = -1;
+static uint32_t drm_crtc_id;
+static uint32_t drm_connector_id;
+static struct drm_mode_modeinfo drm_mode;
+static DrmBuffer drm_buffers[DRM_NUM_BUFFERS];
+static unsigned drm_front = 0;
+static bool drm_flip_pending = false;
+static bool drm_can_flip = true;
+
+void drm_exit(void);
+
+/* Pick the first connected connector, its preferred mode and a CRTC
+ * that its encoder can drive. */
+static int drm_find_output(void)
+{
+    struct drm_mode_card_res res;
+    struct drm_mode_get_connector conn;
+    struct drm_mode_get_encoder enc;
+    uint32_t *crtcs = NULL, *connectors = NULL;
+    uint32_t *encoders = NULL;
+    struct drm_mode_modeinfo *modes = NULL;
+    int ret = -1;
+    unsigned i, j;
+
+    memset(&res, 0, sizeof(res));
+    if (ioctl(drm_fd, DRM_IOCTL_MODE_GETRESOURCES, &res) < 0) {
+        perror("drm: failed to get resources");
+        return -1;
+    }
+    crtcs = calloc(res.count_crtcs, sizeof(uint32_t));
+    connectors = calloc(res.count_connectors, sizeof(uint32_t));
+    if (crtcs == NULL || connectors == NULL)
+        goto done;
+    res.count_fbs = 0;
+    res.count_encoders = 0;
+    res.crtc_id_ptr = (uintptr_t) crtcs;
+    res.connector_id_ptr = (uintptr_t) connectors;
+    if (ioctl(drm_fd, DRM_IOCTL_MODE_GETRESOURCES, &res) < 0) {
+        perror("drm: failed to get resources");
+        goto done;
+    }
+
+    for (i = 0; i < res.count_connectors; i++) {
+        memset(&conn, 0, sizeof(conn));
+        conn.connector_id = connectors[i];
+        if (ioctl(drm_fd, DRM_IOCTL_MODE_GETCONNECTOR, &conn) < 0)
+            continue;
+        if (conn.connection != DRM_CONNECTOR_CONNECTED ||
+            conn.count_modes == 0 || conn.count_encoders == 0)
+            continue;
+
+        free(modes);
+        free(encoders);
+        modes = calloc(conn.count_modes, sizeof(*modes));
+        encoders = calloc(conn.count_encoders, sizeof(uint32_t));
+        if (modes == NULL || encoders == NULL)
+            goto done;
+        conn.count_props = 0;
+        conn.modes_ptr = (uintptr_t) modes;
+        conn.encoders_ptr = (uintptr_t) encoders;
+        if (ioctl(drm_fd, DRM_IOCTL_MODE_GETCONNECTOR, &conn) < 0)
+            continue;
+
+        memset(&enc, 0, sizeof(enc));
+        enc.encoder_id = conn.encoder_id ? conn.encoder_id : encoders[0];
+        if (ioctl(drm_fd, DRM_IOCTL_MODE_GETENCODER, &enc) < 0)
+            continue;
+
+        drm_crtc_id = enc.crtc_id;
+        for (j = 0; drm_crtc_id == 0 && j < res.count_crtcs; j++) {
+            if (enc.possible_crtcs & (1 << j))
+                drm_crtc_id = crtcs[j];
+        }
+        if (drm_crtc_id == 0)
+            continue;
+
+        drm_mode = modes[0];
+        for (j = 0; j < conn.count_modes; j++) {
+            if (modes[j].type & DRM_MODE_TYPE_PREFERRED) {
+                drm_mode = modes[j];
+                break;
+            }
+        }
+        drm_connector_id = conn.connector_id;
+        ret = 0;
+        break;
+    }
+    if (ret < 0)
+        fprintf(stderr, "drm: no connected display\n");
+
+done:
+    free(modes);
+    free(encoders);
+    free(connectors);
+    free(crtcs);
+    return ret;
+}
+
+static int drm_create_buffer(DrmBuffer *buf, GGLSurface *fb)
+{
+    struct drm_mode_create_dumb create;
+    struct drm_mode_map_dumb map;
+    struct drm_mode_fb_cmd2 cmd;
+
+    memset(&create, 0, sizeof(create));
+    create.width = drm_mode.hdisplay;
+    create.height = drm_mode.vdisplay;
+    create.bpp = PIXEL_SIZE * 8;
+    if (ioctl(drm_fd, DRM_IOCTL_MODE_CREATE_DUMB, &create) < 0) {
+        perror("drm: failed to create dumb buffer");
+        return -1;
+    }
+    buf->handle = create.handle;
+    buf->size = create.size;
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.width = create.width;
+    cmd.height = create.height;
+    cmd.pixel_format = DRM_FORMAT;
+    cmd.handles[0] = create.handle;
+    cmd.pitches[0] = create.pitch;
+    if (ioctl(drm_fd, DRM_IOCTL_MODE_ADDFB2, &cmd) < 0) {
+        perror("drm: failed to add framebuffer");
+        return -1;
+    }
+    buf->fb_id = cmd.fb_id;
+
+    memset(&map, 0, sizeof(map));
+    map.handle = create.handle;
+    if (ioctl(drm_fd, DRM_IOCTL_MODE_MAP_DUMB, &map) < 0) {
+        perror("drm: failed to map dumb buffer");
+        return -1;
+    }
+    buf->map = mmap(0, create.size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    drm_fd, map.offset);
+    if (buf->map == MAP_FAILED) {
+        perror("drm: failed to mmap dumb buffer");
+        buf->map = NULL;
+        return -1;
+    }
+    memset(buf->map, 0, create.size);
+
+    fb->version = sizeof(*fb);
+    fb->width = create.width;
+    fb->height = create.height;
+    fb->stride = create.pitch / PIXEL_SIZE;
+    fb->data = buf->map;
+    fb->format = PIXEL_FORMAT;
+    return 0;
+}
+
+static void drm_destroy_buffer(DrmBuffer *buf)
+{
+    struct drm_mode_destroy_dumb destroy;
+
+    if (buf->map)
+        munmap(buf->map, buf->size);
+    if (buf->fb_id)
+        ioctl(drm_fd, DRM_IOCTL_MODE_RMFB, &buf->fb_id);
+    if (buf->handle) {
+        memset(&destroy, 0, sizeof(destroy));
+        destroy.handle = buf->handle;
+        ioctl(drm_fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+    }
+    memset(buf, 0, sizeof(*buf));
+}
+
+static int drm_set_crtc(uint32_t fb_id)
+{
+    struct drm_mode_crtc crtc;
+
+    memset(&crtc, 0, sizeof(crtc));
+    crtc.crtc_id = drm_crtc_id;
+    crtc.fb_id = fb_id;
+    if (fb_id) {
+        crtc.set_connectors_ptr = (uintptr_t) &drm_connector_id;
+        crtc.count_connectors = 1;
+        crtc.mode = drm_mode;
+        crtc.mode_valid = 1;
+    }
+    return ioctl(drm_fd, DRM_IOCTL_MODE_SETCRTC, &crtc);
+}
+
+/* Block until the pending page flip has happened at vblank, so the
+ * buffer it replaced can be drawn into again. */
+static int drm_wait_flip(void)
+{
+    char events[256];
+
+    while (drm_flip_pending) {
+        struct pollfd pfd = { drm_fd, POLLIN, 0 };
+        int ret = poll(&pfd, 1, DRM_FLIP_TIMEOUT_MS);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0) {
+            fprintf(stderr, "drm: page flip timed out\n");
+            drm_flip_pending = false;
+            return -1;
+        }
+
+        ssize_t len = read(drm_fd, events, sizeof(events));
+        if (len < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            perror("drm: failed to read events");
+            drm_flip_pending = false;
+            return -1;
+        }
+
+        ssize_t off = 0;
+        while (off + (ssize_t) sizeof(struct drm_event) <= len) {
+            struct drm_event *e = (struct drm_event*) (events + off);
+            if (e->type == DRM_EVENT_FLIP_COMPLETE)
+                drm_flip_pending = false;
+            if (e->length == 0)
+                break;
+            off += e->length;
+        }
+    }
+    return 0;
+}
+
+// Returns the DRM fd and fills in one surface per dumb buffer, with
+// fb[0] on screen, or -1 if there is no usable DRM device.
+int drm_init(GGLSurface *fb)
+{
+    unsigned i;
+
+    drm_fd = open(DRM_CARD, O_RDWR | O_CLOEXEC);
+    if (drm_fd < 0) {
+        perror("cannot open " DRM_CARD);
+        return -1;
+    }
+    // we are normally master already as the first opener
+    ioctl(drm_fd, DRM_IOCTL_SET_MASTER, 0);
+
+    if (drm_find_output() < 0)
+        goto error;
+
+    for (i = 0; i < DRM_NUM_BUFFERS; i++) {
+        if (drm_create_buffer(&drm_buffers[i], &fb[i]) < 0)
+            goto error;
+    }
+
+    drm_front = 0;
+    if (drm_set_crtc(drm_buffers[0].fb_id) < 0) {
+        perror("drm: failed to set mode");
+        goto error;
+    }
+
+    printf("drm: %s %dx%d@%d on crtc %u\n", drm_mode.name, drm_mode.hdisplay,
+           drm_mode.vdisplay, drm_mode.vrefresh, drm_crtc_id);
+    return drm_fd;
+
+error:
+    drm_exit();
+    return -1;
+}
+
+// Shows buffer n at the next vblank and waits for it to happen.  Falls
+// back to plain mode sets for good if the driver can't flip or the flip
+// never completes.  Returns -1 if buffer n couldn't be shown.
+int drm_flip(unsigned n)
+{
+    struct drm_mode_crtc_page_flip flip;
+
+    if (drm_can_flip) {
+        memset(&flip, 0, sizeof(flip));
+        flip.crtc_id = drm_crtc_id;
+        flip.fb_id = drm_buffers[n].fb_id;
+        flip.flags = DRM_MODE_PAGE_FLIP_EVENT;
+        if (ioctl(drm_fd, DRM_IOCTL_MODE_PAGE_FLIP, &flip) == 0) {
+            drm_flip_pending = true;
+            if (drm_wait_flip() == 0) {
+                drm_front = n;
+                return 0;
+            }
+            fprintf(stderr, "drm: falling back to mode sets\n");
+            drm_can_flip = false;
+        } else if (errno != EBUSY) {
+            perror("drm: page flip failed, falling back to mode sets");
+            drm_can_flip = false;
+        }
+    }
+
+    if (drm_set_crtc(drm_buffers[n].fb_id) < 0) {
+        perror("drm: failed to show buffer");
+        return -1;
+    }
+    drm_front = n;
+    return 0;
+}
+
+void drm_blank(bool blank)
+{
+    drm_wait_flip();
+    if (drm_set_crtc(blank ? 0 : drm_buffers[drm_front].fb_id) < 0)
+        perror("drm: blank");
+}
+
+void drm_exit(void)
+{
+    unsigned i;
+
+    if (drm_fd < 0)
+        return;
+
+    drm_wait_flip();
+    for (i = 0; i < DRM_NUM_BUFFERS; i++)
+        drm_destroy_buffer(&drm_buffers[i]);
+    close(drm_fd);
+    drm_fd = -1;
+}
+
+#else
+
+int drm_init(GGLSurface *fb)
+{
+    return -1;
+}
+
+int drm_flip(unsigned n)
+{
+    return -1;
+}
+
+void drm_blank(bool blank)
+{
+}
+
+void drm_exit(void)
+{
+}
+
+#endif // #ifdef RECOVERY_DRM_GRAPHICS
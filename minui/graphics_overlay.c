@@ -50,6 +50,7 @@
 #include <pixelflinger/pixelflinger.h>
 
 #include "minui.h"
+#include "blit.h"
 
 #define MDP_V4_0 400
 
@@ -348,7 +349,9 @@ int free_overlay(int fd)
     return 0;
 }
 
-int overlay_display_frame(int fd, GGLubyte* data, size_t size)
+// Only rows [top, bottom) of src changed since the last frame; the ION
+// buffer keeps the rest from earlier frames.
+int overlay_display_frame(int fd, const BlitBuffer *src, int top, int bottom)
 {
     if (!overlay_supported)
         return -EINVAL;
@@ -356,6 +359,9 @@ int overlay_display_frame(int fd, GGLubyte* data, size_t size)
     int ret = 0;
     struct msmfb_overlay_data ovdataL, ovdataR;
     struct mdp_display_commit ext_commit;
+    // the overlay is set up with our own pixel format and line length
+    BlitBuffer dst = *src;
+    dst.data = mem_info.mem_buf;
 
     if (!isDisplaySplit()) {
         if (overlayL_id == MSMFB_NEW_REQUEST) {
@@ -363,7 +369,7 @@ int overlay_display_frame(int fd, GGLubyte* data, size_t size)
             return -EINVAL;
         }
 
-        memcpy(mem_info.mem_buf, data, size);
+        blit_rows(&dst, src, top, bottom, 0);
 
         memset(&ovdataL, 0, sizeof(struct msmfb_overlay_data));
 
@@ -383,7 +389,7 @@ int overlay_display_frame(int fd, GGLubyte* data, size_t size)
             return -EINVAL;
         }
 
-        memcpy(mem_info.mem_buf, data, size);
+        blit_rows(&dst, src, top, bottom, 0);
 
         memset(&ovdataL, 0, sizeof(struct msmfb_overlay_data));
 
@@ -445,7 +451,7 @@ int free_overlay(int fd)
     return -EINVAL;
 }
 
-int overlay_display_frame(int fd, GGLubyte* data, size_t size)
+int overlay_display_frame(int fd, const BlitBuffer *src, int top, int bottom)
 {
     return -EINVAL;
 }
@@ -31,6 +31,10 @@ gr_pixel *gr_fb_data(void);
 void gr_flip(void);
 void gr_fb_blank(bool blank);
 
+// Restrict drawing (and the rows gr_flip() copies) to a rectangle.
+void gr_clip(int x, int y, int w, int h);
+void gr_noclip(void);
+
 void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a);
 void gr_fill(int x1, int y1, int x2, int y2);
 int gr_text(int x, int y, const char *s, int bold);
@@ -0,0 +1,232 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Host tool: decodes every PNG in a directory once and packs the pixels
+// into a single atlas file for res_create_surface() to map at startup.
+//
+//   minui_mkatlas [--format RGB_565|RGBX_8888|BGRA_8888] <dir> <out>
+//
+// Images with transparency stay RGBA_8888 so they can still be blended.
+// Opaque images are stored in the framebuffer's depth, which saves the
+// conversion on every blit of a 565 framebuffer.
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <png.h>
+
+#include "res_atlas.h"
+
+typedef struct {
+    ResAtlasEntry entry;
+    unsigned char *pixels;
+    size_t size;
+} Image;
+
+static int compare_images(const void *a, const void *b) {
+    return strcmp(((const Image*) a)->entry.name, ((const Image*) b)->entry.name);
+}
+
+// Decodes like res_create_surface() used to: RGB and palette images
+// without tRNS become opaque, everything else RGBA.
+static int load_png(const char *path, Image *img, int opaque_format) {
+    png_structp png_ptr = NULL;
+    png_infop info_ptr = NULL;
+    unsigned char header[8];
+    unsigned char * volatile rgba = NULL;   // survives png's longjmp
+    int result = -1;
+
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "can't open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (fread(header, 1, sizeof(header), fp) != sizeof(header) ||
+        png_sig_cmp(header, 0, sizeof(header))) {
+        fprintf(stderr, "%s is not a PNG\n", path);
+        goto exit;
+    }
+
+    png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (png_ptr == NULL)
+        goto exit;
+    info_ptr = png_create_info_struct(png_ptr);
+    if (info_ptr == NULL)
+        goto exit;
+    if (setjmp(png_jmpbuf(png_ptr))) {
+        fprintf(stderr, "error decoding %s\n", path);
+        goto exit;
+    }
+
+    png_init_io(png_ptr, fp);
+    png_set_sig_bytes(png_ptr, sizeof(header));
+    png_read_info(png_ptr, info_ptr);
+
+    png_uint_32 width = png_get_image_width(png_ptr, info_ptr);
+    png_uint_32 height = png_get_image_height(png_ptr, info_ptr);
+    int color_type = png_get_color_type(png_ptr, info_ptr);
+    int bit_depth = png_get_bit_depth(png_ptr, info_ptr);
+    int channels = png_get_channels(png_ptr, info_ptr);
+    if (!(bit_depth == 8 &&
+          ((channels == 3 && color_type == PNG_COLOR_TYPE_RGB) ||
+           (channels == 4 && color_type == PNG_COLOR_TYPE_RGBA) ||
+           (channels == 1 && color_type == PNG_COLOR_TYPE_PALETTE)))) {
+        fprintf(stderr, "%s: unsupported PNG type\n", path);
+        goto exit;
+    }
+
+    int alpha = (channels == 4);
+    if (color_type == PNG_COLOR_TYPE_PALETTE)
+        png_set_palette_to_rgb(png_ptr);
+    if (png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS)) {
+        png_set_tRNS_to_alpha(png_ptr);
+        alpha = 1;
+    }
+    if (!alpha)
+        png_set_filler(png_ptr, 0xff, PNG_FILLER_AFTER);
+    png_read_update_info(png_ptr, info_ptr);
+
+    rgba = malloc(width * height * 4);
+    if (rgba == NULL)
+        goto exit;
+    png_uint_32 y;
+    for (y = 0; y < height; ++y)
+        png_read_row(png_ptr, rgba + y * width * 4, NULL);
+
+    img->entry.width = width;
+    img->entry.height = height;
+    img->entry.stride = width;
+    if (alpha || opaque_format != RES_ATLAS_RGB_565) {
+        img->entry.format = alpha ? RES_ATLAS_RGBA_8888 : RES_ATLAS_RGBX_8888;
+        img->pixels = rgba;
+        img->size = width * height * 4;
+        rgba = NULL;
+    } else {
+        size_t i, n = width * height;
+        img->entry.format = RES_ATLAS_RGB_565;
+        img->size = n * 2;
+        img->pixels = malloc(img->size);
+        if (img->pixels == NULL)
+            goto exit;
+        for (i = 0; i < n; i++) {
+            const unsigned char *p = rgba + i * 4;
+            unsigned v = ((p[0] >> 3) << 11) | ((p[1] >> 2) << 5) | (p[2] >> 3);
+            img->pixels[i * 2] = v & 0xff;
+            img->pixels[i * 2 + 1] = v >> 8;
+        }
+    }
+    result = 0;
+
+exit:
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    free(rgba);
+    fclose(fp);
+    return result;
+}
+
+static int write_all(FILE *f, const void *data, size_t len) {
+    return len == 0 || fwrite(data, len, 1, f) == 1 ? 0 : -1;
+}
+
+int main(int argc, char **argv) {
+    int opaque_format = RES_ATLAS_RGB_565;
+    Image *images = NULL;
+    int count = 0, i;
+
+    if (argc == 5 && !strcmp(argv[1], "--format")) {
+        if (!strcmp(argv[2], "RGBX_8888") || !strcmp(argv[2], "BGRA_8888")) {
+            opaque_format = RES_ATLAS_RGBX_8888;
+        } else if (strcmp(argv[2], "RGB_565") && argv[2][0] != '\0') {
+            fprintf(stderr, "unknown pixel format %s\n", argv[2]);
+            return 1;
+        }
+        argv += 2;
+        argc -= 2;
+    }
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s [--format RGB_565|RGBX_8888|BGRA_8888] <dir> <out>\n", argv[0]);
+        return 1;
+    }
+
+    DIR *dir = opendir(argv[1]);
+    if (dir == NULL) {
+        fprintf(stderr, "can't open %s: %s\n", argv[1], strerror(errno));
+        return 1;
+    }
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        size_t len = strlen(de->d_name);
+        if (len <= 4 || strcmp(de->d_name + len - 4, ".png"))
+            continue;
+        if (len - 4 >= RES_ATLAS_NAME_LEN) {
+            fprintf(stderr, "skipping %s: name too long\n", de->d_name);
+            continue;
+        }
+
+        Image *grown = realloc(images, (count + 1) * sizeof(Image));
+        if (grown == NULL)
+            return 1;
+        images = grown;
+        memset(&images[count], 0, sizeof(Image));
+
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s", argv[1], de->d_name);
+        if (load_png(path, &images[count], opaque_format))
+            return 1;
+        memcpy(images[count].entry.name, de->d_name, len - 4);
+        count++;
+    }
+    closedir(dir);
+
+    qsort(images, count, sizeof(Image), compare_images);
+
+    ResAtlasHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, RES_ATLAS_MAGIC, sizeof(header.magic));
+    header.count = count;
+
+    size_t offset = sizeof(header) + count * sizeof(ResAtlasEntry);
+    for (i = 0; i < count; i++) {
+        offset = (offset + RES_ATLAS_ALIGN - 1) & ~(size_t)(RES_ATLAS_ALIGN - 1);
+        images[i].entry.offset = offset;
+        offset += images[i].size;
+    }
+
+    FILE *out = fopen(argv[2], "wb");
+    if (out == NULL) {
+        fprintf(stderr, "can't create %s: %s\n", argv[2], strerror(errno));
+        return 1;
+    }
+    int failed = write_all(out, &header, sizeof(header));
+    for (i = 0; i < count; i++)
+        failed |= write_all(out, &images[i].entry, sizeof(ResAtlasEntry));
+    for (i = 0; i < count; i++) {
+        static const char zeros[RES_ATLAS_ALIGN];
+        long pad = images[i].entry.offset - ftell(out);
+        failed |= write_all(out, zeros, pad);
+        failed |= write_all(out, images[i].pixels, images[i].size);
+    }
+    if (fclose(out) || failed) {
+        fprintf(stderr, "error writing %s\n", argv[2]);
+        return 1;
+    }
+
+    printf("packed %d images into %s (%ld bytes)\n", count, argv[2], (long) offset);
+    return 0;
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MINUI_RES_ATLAS_H_
+#define _MINUI_RES_ATLAS_H_
+
+#include <stdint.h>
+
+// Layout of /res/images.atlas, written at build time by minui_mkatlas
+// and mapped by res_create_surface().  All the images are decoded ahead
+// of time; each one is found by name in a table sorted with strcmp().
+
+#define RES_ATLAS_PATH "/res/images.atlas"
+#define RES_ATLAS_MAGIC "MUIATLS1"
+#define RES_ATLAS_NAME_LEN 56
+#define RES_ATLAS_ALIGN 16
+
+// Same values as the pixelflinger formats they stand for.
+#define RES_ATLAS_RGBA_8888 1
+#define RES_ATLAS_RGBX_8888 2
+#define RES_ATLAS_RGB_565   4
+
+typedef struct {
+    char magic[8];
+    uint32_t count;
+    uint32_t reserved;
+} ResAtlasHeader;
+
+typedef struct {
+    char name[RES_ATLAS_NAME_LEN];  // file name without ".png"
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;                // pixels
+    uint32_t format;
+    uint32_t offset;                // of the pixels, from the start of the file
+    uint32_t reserved;
+} ResAtlasEntry;
+
+#endif
@@ -19,9 +19,11 @@
 
 #include <fcntl.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 
 #include <linux/fb.h>
@@ -32,6 +34,7 @@
 #include <png.h>
 
 #include "minui.h"
+#include "res_atlas.h"
 
 // libpng gives "undefined reference to 'pow'" errors, and I have no
 // idea how to convince the build system to link with -lm.  We don't
@@ -41,6 +44,86 @@ double pow(double x, double y) {
     return x;
 }
 
+// The atlas is mapped on first use and stays mapped; surfaces handed out
+// from it only own their GGLSurface header, so res_free_surface() is the
+// same for both kinds.
+static const ResAtlasHeader* atlas = NULL;
+static const ResAtlasEntry* atlas_entries = NULL;
+static int atlas_tried = 0;
+
+static void atlas_open(void) {
+    struct stat st;
+    void* map = MAP_FAILED;
+    uint32_t i;
+
+    atlas_tried = 1;
+    int fd = open(RES_ATLAS_PATH, O_RDONLY);
+    if (fd < 0)
+        return;
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(ResAtlasHeader))
+        goto bad;
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+        goto bad;
+
+    const ResAtlasHeader* header = map;
+    const ResAtlasEntry* entries = (const ResAtlasEntry*) (header + 1);
+    size_t size = st.st_size;
+    if (memcmp(header->magic, RES_ATLAS_MAGIC, sizeof(header->magic)) ||
+        header->count > (size - sizeof(*header)) / sizeof(*entries))
+        goto bad;
+    for (i = 0; i < header->count; i++) {
+        const ResAtlasEntry* e = &entries[i];
+        size_t bpp = e->format == RES_ATLAS_RGB_565 ? 2 : 4;
+        if (e->name[RES_ATLAS_NAME_LEN-1] != '\0' ||
+            e->stride < e->width || e->offset % 4 != 0 || e->offset > size ||
+            (e->height && (size - e->offset) / e->height / bpp < e->stride))
+            goto bad;
+    }
+
+    close(fd);
+    atlas = header;
+    atlas_entries = entries;
+    return;
+
+bad:
+    fprintf(stderr, "ignoring corrupt %s\n", RES_ATLAS_PATH);
+    if (map != MAP_FAILED)
+        munmap(map, st.st_size);
+    close(fd);
+}
+
+static int compare_entry(const void* key, const void* entry) {
+    return strcmp((const char*) key, ((const ResAtlasEntry*) entry)->name);
+}
+
+static GGLSurface* atlas_surface(const char* name) {
+    if (!atlas_tried)
+        atlas_open();
+    if (atlas == NULL)
+        return NULL;
+
+    const ResAtlasEntry* e = bsearch(name, atlas_entries, atlas->count,
+                                     sizeof(ResAtlasEntry), compare_entry);
+    if (e == NULL)
+        return NULL;
+
+    GGLSurface* surface = malloc(sizeof(GGLSurface));
+    if (surface == NULL)
+        return NULL;
+    surface->version = sizeof(GGLSurface);
+    surface->width = e->width;
+    surface->height = e->height;
+    surface->stride = e->stride;
+    surface->data = (GGLubyte*) atlas + e->offset;
+    switch (e->format) {
+        case RES_ATLAS_RGB_565:   surface->format = GGL_PIXEL_FORMAT_RGB_565; break;
+        case RES_ATLAS_RGBX_8888: surface->format = GGL_PIXEL_FORMAT_RGBX_8888; break;
+        default:                  surface->format = GGL_PIXEL_FORMAT_RGBA_8888; break;
+    }
+    return surface;
+}
+
 int res_create_surface(const char* name, gr_surface* pSurface) {
     char resPath[256];
     GGLSurface* surface = NULL;
@@ -49,7 +132,9 @@ int res_create_surface(const char* name, gr_surface* pSurface) {
     png_structp png_ptr = NULL;
     png_infop info_ptr = NULL;
 
-    *pSurface = NULL;
+    *pSurface = (gr_surface) atlas_surface(name);
+    if (*pSurface != NULL)
+        return 0;
 
     snprintf(resPath, sizeof(resPath)-1, "/res/images/%s.png", name);
     resPath[sizeof(resPath)-1] = '\0';
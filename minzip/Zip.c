@@ -414,35 +414,15 @@ bail:
 }
 
 /*
- * Open a Zip archive and scan out the contents.
- *
- * The easiest way to do this is to mmap() the whole thing and do the
- * traditional backward scan for central directory.  Since the EOCD is
- * a relatively small bit at the end, we should end up only touching a
- * small set of pages.
- *
- * This will be called on non-Zip files, especially during startup, so
- * we don't want to be too noisy about failures.  (Do we want a "quiet"
- * flag?)
- *
- * On success, we fill out the contents of "pArchive".
+ * Takes ownership of fd, which is closed again on failure.
  */
-int mzOpenZipArchive(const char* fileName, ZipArchive* pArchive)
+static int openZipArchiveFd(int fd, const char* fileName, ZipArchive* pArchive)
 {
     MemMapping map;
     int err;
 
-    LOGV("Opening archive '%s' %p\n", fileName, pArchive);
-
     map.addr = NULL;
-    memset(pArchive, 0, sizeof(*pArchive));
-
-    pArchive->fd = open(fileName, O_RDONLY, 0);
-    if (pArchive->fd < 0) {
-        err = errno ? errno : -1;
-        LOGV("Unable to open '%s': %s\n", fileName, strerror(err));
-        goto bail;
-    }
+    pArchive->fd = fd;
 
     if (sysMapFileInShmem(pArchive->fd, &map) != 0) {
         err = -1;
@@ -474,6 +454,59 @@ bail:
     return err;
 }
 
+/*
+ * Open a Zip archive and scan out the contents.
+ *
+ * The easiest way to do this is to mmap() the whole thing and do the
+ * traditional backward scan for central directory.  Since the EOCD is
+ * a relatively small bit at the end, we should end up only touching a
+ * small set of pages.
+ *
+ * This will be called on non-Zip files, especially during startup, so
+ * we don't want to be too noisy about failures.  (Do we want a "quiet"
+ * flag?)
+ *
+ * On success, we fill out the contents of "pArchive".
+ */
+int mzOpenZipArchive(const char* fileName, ZipArchive* pArchive)
+{
+    LOGV("Opening archive '%s' %p\n", fileName, pArchive);
+
+    memset(pArchive, 0, sizeof(*pArchive));
+    int fd = open(fileName, O_RDONLY, 0);
+    if (fd < 0) {
+        int err = errno ? errno : -1;
+        LOGV("Unable to open '%s': %s\n", fileName, strerror(err));
+        pArchive->fd = -1;
+        return err;
+    }
+    return openZipArchiveFd(fd, fileName, pArchive);
+}
+
+/*
+ * Same as mzOpenZipArchive() on a file the caller already has open.  The
+ * archive works on its own dup of fd, so the caller keeps its descriptor.
+ * The dup shares fd's file offset, which whoever read the file before us
+ * (the signature check, say) left anywhere, and the map is taken from
+ * the current offset; rewind first so the whole file is mapped.
+ */
+int mzOpenZipArchiveFd(int fd, ZipArchive* pArchive)
+{
+    memset(pArchive, 0, sizeof(*pArchive));
+    int dupFd = dup(fd);
+    if (dupFd < 0) {
+        pArchive->fd = -1;
+        return errno ? errno : -1;
+    }
+    if (lseek(dupFd, 0L, SEEK_SET) != 0) {
+        int err = errno ? errno : -1;
+        close(dupFd);
+        pArchive->fd = -1;
+        return err;
+    }
+    return openZipArchiveFd(dupFd, "(fd)", pArchive);
+}
+
 /*
  * Close a ZipArchive, closing the file and freeing the contents.
  *
@@ -810,6 +843,82 @@ bool mzExtractZipEntryToFile(const ZipArchive *pArchive,
     return true;
 }
 
+typedef struct {
+    int fd;
+    unsigned long crc;
+} CacheWriteArgs;
+
+static bool cacheWriteProcessFunction(const unsigned char *data, int dataLen,
+                                      void *cookie)
+{
+    CacheWriteArgs *args = (CacheWriteArgs *)cookie;
+    args->crc = crc32(args->crc, data, dataLen);
+    return writeProcessFunction(data, dataLen, (void*)(intptr_t)args->fd);
+}
+
+/*
+ * Find "pEntry" in the cache directory "cacheDir", where an entry is
+ * named for its CRC and size, or inflate it there.  The copy is only
+ * put in place once its CRC has been checked, so anything found under
+ * a name has that content, whichever package it came from.
+ */
+bool mzExtractZipEntryToCache(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, const char *cacheDir, mode_t mode,
+    char *path, size_t pathLen)
+{
+    struct stat st;
+    char tmp[PATH_MAX];
+    int n;
+
+    n = snprintf(path, pathLen, "%s/%08lx-%ld", cacheDir,
+            (unsigned long)pEntry->crc32 & 0xffffffffUL, pEntry->uncompLen);
+    if (n < 0 || (size_t)n >= pathLen) {
+        return false;
+    }
+    if (stat(path, &st) == 0 && S_ISREG(st.st_mode) &&
+            st.st_size == pEntry->uncompLen) {
+        /* mark it used, for whoever trims the cache */
+        utime(path, NULL);
+        return true;
+    }
+
+    if (mkdir(cacheDir, 0700) != 0 && errno != EEXIST) {
+        LOGE("Can't create %s: %s\n", cacheDir, strerror(errno));
+        return false;
+    }
+    /* recovery and the updater may both be filling the cache */
+    n = snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+    if (n < 0 || (size_t)n >= sizeof(tmp)) {
+        return false;
+    }
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, mode);
+    if (fd < 0) {
+        LOGE("Can't create %s: %s\n", tmp, strerror(errno));
+        return false;
+    }
+    fchmod(fd, mode);
+
+    CacheWriteArgs args;
+    args.fd = fd;
+    args.crc = crc32(0L, Z_NULL, 0);
+    bool ret = mzProcessZipEntryContents(pArchive, pEntry,
+            cacheWriteProcessFunction, (void *)&args);
+    if (close(fd) != 0) {
+        ret = false;
+    }
+    if (ret && args.crc != ((unsigned long)pEntry->crc32 & 0xffffffffUL)) {
+        LOGW("CRC for entry %.*s (0x%08lx) != expected (0x%08lx)\n",
+                pEntry->fileNameLen, pEntry->fileName, args.crc, pEntry->crc32);
+        ret = false;
+    }
+    if (!ret || rename(tmp, path) != 0) {
+        LOGE("Can't extract entry to cache.\n");
+        unlink(tmp);
+        return false;
+    }
+    return true;
+}
+
 typedef struct {
     unsigned char* buffer;
     long len;
@@ -907,6 +1016,74 @@ static const char *targetEntryPath(MzPathHelper *helper, ZipEntry *pEntry)
     return helper->buf;
 }
 
+/*
+ * Tracks the directories mzExtractRecursiveWithMetadata() has passed to
+ * the metadata function.  Entries are sorted, so everything under one
+ * directory comes in a single run and only the chain of directories
+ * leading to the last entry has to be remembered.
+ */
+typedef struct {
+    MzMetadataFunction meta;
+    void *cookie;
+    size_t baseLen;     // targetDir, without trailing slashes
+    char *last;         // deepest directory announced so far
+    size_t lastLen;
+    char *buf;
+} MzDirTracker;
+
+static bool announceDir(MzDirTracker *t, const char *dir, size_t len)
+{
+    memcpy(t->buf, dir, len);
+    t->buf[len] = '\0';
+    int fd = open(t->buf, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    if (fd < 0) {
+        LOGE("Can't open directory \"%s\": %s\n", t->buf, strerror(errno));
+        return false;
+    }
+    bool ok = t->meta(t->buf, fd, S_IFDIR, t->cookie);
+    close(fd);
+    return ok;
+}
+
+/*
+ * Passes dir (len bytes of it) and every directory between targetDir and
+ * it to the metadata function, skipping those already passed.
+ */
+static bool announceDirs(MzDirTracker *t, const char *dir, size_t len)
+{
+    while (len > t->baseLen && dir[len-1] == '/') {
+        len--;
+    }
+    if (len < t->baseLen) {
+        len = t->baseLen;
+    }
+
+    size_t size = (len > t->lastLen ? len : t->lastLen) + 1;
+    char *last = (char *)realloc(t->last, size);
+    char *buf = (char *)realloc(t->buf, size);
+    if (last != NULL) t->last = last;
+    if (buf != NULL) t->buf = buf;
+    if (last == NULL || buf == NULL) {
+        return false;
+    }
+
+    size_t p;
+    for (p = t->baseLen; p <= len; p++) {
+        if (p != t->baseLen && p != len && dir[p] != '/') {
+            continue;
+        }
+        bool seen = p <= t->lastLen && memcmp(dir, t->last, p) == 0 &&
+                (p == t->lastLen || t->last[p] == '/');
+        if (!seen && !announceDir(t, dir, p)) {
+            return false;
+        }
+    }
+    memcpy(t->last, dir, len);
+    t->last[len] = '\0';
+    t->lastLen = len;
+    return true;
+}
+
 /*
  * Inflate all entries under zipDir to the directory specified by
  * targetDir, which must exist and be a writable directory.
@@ -927,11 +1104,12 @@ static const char *targetEntryPath(MzPathHelper *helper, ZipEntry *pEntry)
  *
  * Returns true on success, false on failure.
  */
-bool mzExtractRecursive(const ZipArchive *pArchive,
+static bool extractRecursive(const ZipArchive *pArchive,
                         const char *zipDir, const char *targetDir,
                         int flags, const struct utimbuf *timestamp,
                         void (*callback)(const char *fn, void *), void *cookie,
-                        struct selabel_handle *sehnd)
+                        struct selabel_handle *sehnd,
+                        MzMetadataFunction meta, void *metaCookie)
 {
     if (zipDir[0] == '/') {
         LOGE("mzExtractRecursive(): zipDir must be a relative path.\n");
@@ -977,6 +1155,15 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
     helper.buf = NULL;
     helper.bufLen = 0;
 
+    MzDirTracker tracker;
+    memset(&tracker, 0, sizeof(tracker));
+    tracker.meta = meta;
+    tracker.cookie = metaCookie;
+    tracker.baseLen = strlen(targetDir);
+    while (tracker.baseLen > 1 && targetDir[tracker.baseLen-1] == '/') {
+        tracker.baseLen--;
+    }
+
     /* Walk through the entries and extract anything whose path begins
      * with zpath.
 //TODO: since the entries are sorted, binary search for the first match
@@ -1053,6 +1240,11 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
                     ok = false;
                     break;
                 }
+                if (meta != NULL &&
+                        !announceDirs(&tracker, targetFile, strlen(targetFile))) {
+                    ok = false;
+                    break;
+                }
                 LOGD("Extracted dir \"%s\"\n", targetFile);
             }
         } else {
@@ -1067,6 +1259,11 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
                 ok = false;
                 break;
             }
+            if (meta != NULL && !announceDirs(&tracker, targetFile,
+                    strrchr(targetFile, '/') - targetFile)) {
+                ok = false;
+                break;
+            }
 
             /* With FILES_ONLY set, we need to ignore metadata entirely,
              * so treat symlinks as regular files.
@@ -1110,6 +1307,10 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
                 LOGD("Extracted symlink \"%s\" -> \"%s\"\n",
                         targetFile, linkTarget);
                 free(linkTarget);
+                if (meta != NULL && !meta(targetFile, -1, S_IFLNK, metaCookie)) {
+                    ok = false;
+                    break;
+                }
             } else {
                 /* The entry is a regular file.
                  * Open the target for writing.
@@ -1137,12 +1338,21 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
                 }
 
                 bool ok = mzExtractZipEntryToFile(pArchive, pEntry, fd);
-                close(fd);
                 if (!ok) {
+                    close(fd);
                     LOGE("Error extracting \"%s\"\n", targetFile);
                     ok = false;
                     break;
                 }
+                /* Set the metadata while the file is still open, so
+                 * nothing has to look it up again.
+                 */
+                if (meta != NULL && !meta(targetFile, fd, S_IFREG, metaCookie)) {
+                    close(fd);
+                    ok = false;
+                    break;
+                }
+                close(fd);
 
                 if (timestamp != NULL && utime(targetFile, timestamp)) {
                     LOGE("Error touching \"%s\"\n", targetFile);
@@ -1158,7 +1368,29 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
     }
 
     free(helper.buf);
+    free(tracker.last);
+    free(tracker.buf);
     free(zpath);
 
     return ok;
 }
+
+bool mzExtractRecursive(const ZipArchive *pArchive,
+                        const char *zipDir, const char *targetDir,
+                        int flags, const struct utimbuf *timestamp,
+                        void (*callback)(const char *fn, void *), void *cookie,
+                        struct selabel_handle *sehnd)
+{
+    return extractRecursive(pArchive, zipDir, targetDir, flags, timestamp,
+            callback, cookie, sehnd, NULL, NULL);
+}
+
+bool mzExtractRecursiveWithMetadata(const ZipArchive *pArchive,
+                        const char *zipDir, const char *targetDir,
+                        int flags, const struct utimbuf *timestamp,
+                        MzMetadataFunction meta, void *metaCookie,
+                        struct selabel_handle *sehnd)
+{
+    return extractRecursive(pArchive, zipDir, targetDir, flags, timestamp,
+            NULL, NULL, sehnd, meta, metaCookie);
+}
@@ -69,6 +69,7 @@ typedef struct {
  * value on failure.
  */
 int mzOpenZipArchive(const char* fileName, ZipArchive* pArchive);
+int mzOpenZipArchiveFd(int fd, ZipArchive* pArchive);
 
 /*
  * Close archive, releasing resources associated with it.
@@ -175,6 +176,15 @@ bool mzIsZipEntryIntact(const ZipArchive *pArchive, const ZipEntry *pEntry);
 bool mzExtractZipEntryToFile(const ZipArchive *pArchive,
     const ZipEntry *pEntry, int fd);
 
+/*
+ * Get a copy of an entry in cacheDir, named for its CRC and size, and
+ * put its path in "path".  An existing copy is reused; otherwise the
+ * entry is inflated there with the given mode and its CRC checked.
+ */
+bool mzExtractZipEntryToCache(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, const char *cacheDir, mode_t mode,
+    char *path, size_t pathLen);
+
 /*
  * Inflate and write an entry to a memory buffer, which must be long
  * enough to hold mzGetZipEntryUncomplen(pEntry) bytes.
@@ -218,6 +228,27 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
         void (*callback)(const char *fn, void*), void *cookie,
         struct selabel_handle *sehnd);
 
+/*
+ * Called by mzExtractRecursiveWithMetadata() for each file it creates,
+ * while the file is still open at fd, and for targetDir and each
+ * directory under it, also open at fd.  Symlinks are passed with fd -1.
+ * type is S_IFREG, S_IFDIR or S_IFLNK.  Returns false to stop the
+ * extraction.
+ */
+typedef bool (*MzMetadataFunction)(const char *path, int fd, mode_t type,
+        void *cookie);
+
+/*
+ * Same as mzExtractRecursive(), but lets meta set up owner, mode, label
+ * and the like on everything as it is extracted instead of in a second
+ * pass over the tree.
+ */
+bool mzExtractRecursiveWithMetadata(const ZipArchive *pArchive,
+        const char *zipDir, const char *targetDir,
+        int flags, const struct utimbuf *timestamp,
+        MzMetadataFunction meta, void *metaCookie,
+        struct selabel_handle *sehnd);
+
 #ifdef __cplusplus
 }
 #endif
@@ -33,6 +33,10 @@
 #include <dirent.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <malloc.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/reboot.h>
 #include <sys/stat.h>
@@ -328,6 +332,7 @@ int
 run_exec_process ( char **argv) {
     pid_t pid;
     int status;
+    fflush(stdout);
     pid = fork();
     if (pid == 0) {
         execv(argv[0], argv);
@@ -422,115 +427,236 @@ mmc_mount_partition(const MmcPartition *partition, const char *mount_point,
     return rv;
 }
 
-int
-mmc_raw_copy (const MmcPartition *partition, char *in_file) {
-    int ch;
-    FILE *in;
-    FILE *out;
-    int val = 0;
-    char buf[512];
-    unsigned sz = 0;
-    unsigned i;
-    int ret = -1;
-    char *out_file = partition->device_index;
-
-    in  = fopen ( in_file,  "r" );
-    if (in == NULL)
-        goto ERROR3;
+/* Raw copy engine.  Data moves in large aligned chunks, read on a helper
+ * thread while the previous chunk is being written.  The block device
+ * side is opened with O_DIRECT when the kernel allows it, so dumping or
+ * restoring a partition doesn't push everything else out of the page
+ * cache.
+ */
+#define MMC_RAW_COPY_CHUNK        (4 * 1024 * 1024)
+#define MMC_RAW_COPY_ALIGN        4096
 
-    out = fopen ( out_file,  "w" );
-    if (out == NULL)
-        goto ERROR2;
+typedef struct {
+    int in_fd;
+    int in_direct;
+    unsigned long long remaining;   /* bytes left to read, or 0 for EOF */
+    int limited;
+    char *buf[2];
+    size_t len[2];
+    int full[2];
+    int error;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} MmcCopyState;
+
+/* Open 'path' and, when it turns out to be a block device, reopen it with
+ * O_DIRECT.  '*direct' is set when that succeeded.
+ */
+static int
+mmc_open_raw (const char *path, int flags, int *direct) {
+    struct stat st;
+    int fd = open(path, flags, 0666);
+    *direct = 0;
+    if (fd < 0)
+        return fd;
+    if (fstat(fd, &st) == 0 && S_ISBLK(st.st_mode)) {
+        int dfd = open(path, flags | O_DIRECT);
+        if (dfd >= 0) {
+            close(fd);
+            fd = dfd;
+            *direct = 1;
+        }
+    }
+    return fd;
+}
 
-    fseek(in, 0L, SEEK_END);
-    sz = ftell(in);
-    fseek(in, 0L, SEEK_SET);
+/* Fill up to 'want' bytes of 'buf', stopping early only at end of file. */
+static ssize_t
+mmc_read_full (int fd, char *buf, size_t want, int *direct) {
+    size_t so_far = 0;
+    while (so_far < want) {
+        size_t to_read = want - so_far;
+        /* O_DIRECT needs whole blocks; read an unaligned tail buffered
+         * rather than past what was asked for. */
+        if (*direct && ((so_far | to_read) % MMC_RAW_COPY_ALIGN) != 0) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+            *direct = 0;
+        }
+        ssize_t r = read(fd, buf + so_far, to_read);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (r == 0)
+            break;
+        so_far += r;
+    }
+    return so_far;
+}
 
-    if (sz % 512)
-    {
-        while ( ( ch = fgetc ( in ) ) != EOF )
-            fputc ( ch, out );
+static int
+mmc_write_full (int fd, const char *buf, size_t len, int *direct) {
+    /* O_DIRECT needs whole blocks; write an unaligned tail buffered. */
+    if (*direct && (len % MMC_RAW_COPY_ALIGN) != 0) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+        *direct = 0;
     }
-    else
-    {
-        for (i=0; i< (sz/512); i++)
-        {
-            if ((fread(buf, 512, 1, in)) != 1)
-                goto ERROR1;
-            if ((fwrite(buf, 512, 1, out)) != 1)
-                goto ERROR1;
+    size_t so_far = 0;
+    while (so_far < len) {
+        ssize_t w = write(fd, buf + so_far, len - so_far);
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
         }
+        so_far += w;
     }
+    return 0;
+}
 
-    fsync(out);
-    ret = 0;
-ERROR1:
-    fclose ( out );
-ERROR2:
-    fclose ( in );
-ERROR3:
-    return ret;
+static void*
+mmc_copy_reader (void *cookie) {
+    MmcCopyState *s = (MmcCopyState*)cookie;
+    int slot = 0;
+    for (;;) {
+        pthread_mutex_lock(&s->lock);
+        while (s->full[slot] && !s->error)
+            pthread_cond_wait(&s->cond, &s->lock);
+        int stop = s->error;
+        pthread_mutex_unlock(&s->lock);
+        if (stop)
+            break;
 
-}
+        size_t want = MMC_RAW_COPY_CHUNK;
+        if (s->limited && s->remaining < want)
+            want = s->remaining;
+        ssize_t got = want ? mmc_read_full(s->in_fd, s->buf[slot], want, &s->in_direct) : 0;
+
+        pthread_mutex_lock(&s->lock);
+        if (got < 0) {
+            printf("Raw copy read failed: %s\n", strerror(errno));
+            s->error = 1;
+        } else {
+            s->len[slot] = got;
+            s->full[slot] = 1;
+            if (s->limited)
+                s->remaining -= got;
+        }
+        pthread_cond_broadcast(&s->cond);
+        pthread_mutex_unlock(&s->lock);
 
+        /* a zero length chunk tells the writer we're done */
+        if (got <= 0)
+            break;
+        slot ^= 1;
+    }
+    return NULL;
+}
 
 int
-mmc_raw_dump_internal (const char* in_file, const char *out_file, unsigned sz) {
-    int ch;
-    FILE *in;
-    FILE *out;
-    int val = 0;
-    char buf[512];
-    unsigned i;
+mmc_raw_copy_file (const char *in_file, const char *out_file, unsigned long long size,
+                   MmcCopyObserver observer, void *cookie) {
+    MmcCopyState s;
+    pthread_t reader;
+    int out_fd, out_direct;
+    int slot = 0;
     int ret = -1;
 
-    in  = fopen ( in_file,  "r" );
-    if (in == NULL)
-        goto ERROR3;
-
-    out = fopen ( out_file,  "w" );
-    if (out == NULL)
-        goto ERROR2;
+    memset(&s, 0, sizeof(s));
+    s.in_fd = mmc_open_raw(in_file, O_RDONLY, &s.in_direct);
+    if (s.in_fd < 0) {
+        printf("Can't open %s: %s\n", in_file, strerror(errno));
+        return -1;
+    }
+    /* with no output file the observer is the only consumer */
+    out_fd = -1;
+    out_direct = 0;
+    if (out_file != NULL)
+        out_fd = mmc_open_raw(out_file, O_WRONLY | O_CREAT | O_TRUNC, &out_direct);
+    if (out_file != NULL && out_fd < 0) {
+        printf("Can't open %s: %s\n", out_file, strerror(errno));
+        close(s.in_fd);
+        return -1;
+    }
 
-    if (sz == 0)
-    {
-        fseek(in, 0L, SEEK_END);
-        sz = ftell(in);
-        fseek(in, 0L, SEEK_SET);
+    s.remaining = size;
+    s.limited = size != 0;
+    s.buf[0] = memalign(MMC_RAW_COPY_ALIGN, MMC_RAW_COPY_CHUNK);
+    s.buf[1] = memalign(MMC_RAW_COPY_ALIGN, MMC_RAW_COPY_CHUNK);
+    if (s.buf[0] == NULL || s.buf[1] == NULL) {
+        printf("Can't allocate raw copy buffers\n");
+        goto done;
+    }
+    pthread_mutex_init(&s.lock, NULL);
+    pthread_cond_init(&s.cond, NULL);
+    if (pthread_create(&reader, NULL, mmc_copy_reader, &s) != 0) {
+        printf("Can't start raw copy reader\n");
+        pthread_cond_destroy(&s.cond);
+        pthread_mutex_destroy(&s.lock);
+        goto done;
     }
 
-    if (sz % 512)
-    {
-        unsigned counter = 0;
-        while ( ( ch = fgetc ( in ) ) != EOF )
-        {
-            fputc ( ch, out );
-#ifdef BOARD_HAS_MTK
-            if (++counter == sz)
-                break;
-#endif
+    for (;;) {
+        pthread_mutex_lock(&s.lock);
+        while (!s.full[slot] && !s.error)
+            pthread_cond_wait(&s.cond, &s.lock);
+        int stop = s.error;
+        size_t len = s.len[slot];
+        pthread_mutex_unlock(&s.lock);
+        if (stop || len == 0)
+            break;
+
+        int failed = 0;
+        if (out_fd >= 0 && mmc_write_full(out_fd, s.buf[slot], len, &out_direct) != 0) {
+            printf("Raw copy write failed: %s\n", strerror(errno));
+            failed = 1;
         }
-    }
-    else
-    {
-        for (i=0; i< (sz/512); i++)
-        {
-            if ((fread(buf, 512, 1, in)) != 1)
-                goto ERROR1;
-            if ((fwrite(buf, 512, 1, out)) != 1)
-                goto ERROR1;
+        if (!failed && observer != NULL && observer(s.buf[slot], len, cookie) != 0)
+            failed = 1;
+        if (failed) {
+            pthread_mutex_lock(&s.lock);
+            s.error = 1;
+            pthread_cond_broadcast(&s.cond);
+            pthread_mutex_unlock(&s.lock);
+            break;
         }
+
+        pthread_mutex_lock(&s.lock);
+        s.full[slot] = 0;
+        pthread_cond_broadcast(&s.cond);
+        pthread_mutex_unlock(&s.lock);
+        slot ^= 1;
     }
 
-    fsync(out);
-    ret = 0;
-ERROR1:
-    fclose ( out );
-ERROR2:
-    fclose ( in );
-ERROR3:
+    pthread_join(reader, NULL);
+    if (!s.error && s.limited && s.remaining != 0)
+        printf("Raw copy of %s stopped %llu bytes short\n", in_file, s.remaining);
+    // pipes and stdout can't be synced (EINVAL); that isn't a failed copy
+    else if (!s.error && (out_fd < 0 || fsync(out_fd) == 0 ||
+                          errno == EINVAL || errno == EROFS))
+        ret = 0;
+    pthread_cond_destroy(&s.cond);
+    pthread_mutex_destroy(&s.lock);
+
+done:
+    free(s.buf[0]);
+    free(s.buf[1]);
+    if (out_fd >= 0)
+        close(out_fd);
+    close(s.in_fd);
     return ret;
+}
 
+int
+mmc_raw_copy (const MmcPartition *partition, char *in_file) {
+    return mmc_raw_copy_file(in_file, partition->device_index, 0, NULL, NULL);
+}
+
+
+int
+mmc_raw_dump_internal (const char* in_file, const char *out_file, unsigned sz) {
+    return mmc_raw_copy_file(in_file, out_file, sz, NULL, NULL);
 }
 
 // TODO: refactor this to not be a giant copy paste mess
@@ -611,7 +737,9 @@ int cmd_mmc_restore_raw_partition(const char *partition, const char *filename)
     }
 }
 
-int cmd_mmc_backup_raw_partition(const char *partition, const char *filename)
+/* Work out which device a raw backup of 'partition' reads and how many
+ * bytes of it; a size of 0 means up to the end of the device. */
+int cmd_mmc_get_raw_dump_source(const char *partition, char *device, unsigned *size)
 {
     if (partition[0] != '/') {
         mmc_scan_partitions();
@@ -619,7 +747,9 @@ int cmd_mmc_backup_raw_partition(const char *partition, const char *filename)
         p = mmc_find_partition_by_name(partition);
         if (p == NULL)
             return -1;
-        return mmc_raw_dump(p, filename);
+        strcpy(device, p->device_index);
+        *size = 0;
+        return 0;
     }
     else 
     {
@@ -662,10 +792,21 @@ int cmd_mmc_backup_raw_partition(const char *partition, const char *filename)
         }
 #endif
        
-        return mmc_raw_dump_internal(partition, filename, sz);
+        strcpy(device, partition);
+        *size = sz;
+        return 0;
     }
 }
 
+int cmd_mmc_backup_raw_partition(const char *partition, const char *filename)
+{
+    char device[PATH_MAX];
+    unsigned sz;
+    if (cmd_mmc_get_raw_dump_source(partition, device, &sz) != 0)
+        return -1;
+    return mmc_raw_dump_internal(device, filename, sz);
+}
+
 int cmd_mmc_erase_raw_partition(const char *partition)
 {
     return 0;
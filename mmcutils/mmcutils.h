@@ -30,6 +30,8 @@
 #ifndef MMCUTILS_H_
 #define MMCUTILS_H_
 
+#include <sys/types.h>
+
 /* Some useful define used to access the MBR/EBR table */
 #define BLOCK_SIZE                0x200
 #define TABLE_ENTRY_0             0x1BE
@@ -73,6 +75,10 @@
 #define MMC_VFAT_TYPE 0xC
 typedef struct MmcPartition MmcPartition;
 
+/* Called with every chunk a raw copy moves, e.g. to hash it inline.
+ * Returning non-zero aborts the copy. */
+typedef int (*MmcCopyObserver)(const char *data, size_t len, void *cookie);
+
 /* Functions */
 int mmc_scan_partitions();
 const MmcPartition *mmc_find_partition_by_name(const char *name);
@@ -80,6 +86,8 @@ int mmc_format_ext3 (MmcPartition *partition);
 int mmc_mount_partition(const MmcPartition *partition, const char *mount_point, \
                         int read_only);
 int mmc_raw_copy (const MmcPartition *partition, char *in_file);
+int mmc_raw_copy_file (const char *in_file, const char *out_file, unsigned long long size,
+                       MmcCopyObserver observer, void *cookie);
 int mmc_raw_read (const MmcPartition *partition, char *data, int data_size);
 int mmc_raw_write (const MmcPartition *partition, char *data, int data_size);
 
@@ -20,6 +20,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
 #include <sys/mount.h>  // for _IOW, _IOR, mount()
 #include <sys/stat.h>
 #include <mtd/mtd-user.h>
@@ -28,18 +29,43 @@
 
 #include "mtdutils.h"
 
+// Most erase blocks read with a single read() once a caller is streaming
+// through the partition.
+#define MTD_READ_BATCH 8
+
 struct MtdReadContext {
     const MtdPartition *partition;
-    char *buffer;
+    char *buffer;           // batch being handed out
     size_t consumed;
+    size_t avail;           // valid bytes in buffer
     int fd;
+    loff_t pos;             // next block to read
+    const unsigned char *bad_blocks;
+    int batches;            // batches read so far
+
+    // the batch after this one is read ahead on a helper thread
+    char *spare;
+    pthread_t prefetcher;
+    int prefetching;
+    int prefetch_blocks;
+    int prefetch_errno;
 };
 
+// Number of erase blocks collected before they are erased, written and
+// verified together.
+#define MTD_WRITE_BATCH 8
+
 struct MtdWriteContext {
     const MtdPartition *partition;
-    char *buffer;
-    size_t stored;
+    size_t stored;          // bytes of the block being filled at the batch end
     int fd;
+    off_t pos;              // where the next block goes, before bad block skipping
+
+    char *batch;            // MTD_WRITE_BATCH blocks waiting to be written
+    int batch_count;        // complete blocks in the batch
+    char *verify;           // read-back buffer, same size as the batch
+    off_t *targets;         // where each batch block is being written
+    const unsigned char *bad_blocks;
 
     off_t* bad_block_offsets;
     int bad_block_alloc;
@@ -50,12 +76,14 @@ typedef struct {
     MtdPartition *partitions;
     int partitions_allocd;
     int partition_count;
+    unsigned char **bad_block_maps;   // per partition, filled on first use
 } MtdState;
 
 static MtdState g_mtd_state = {
     NULL,   // partitions
     0,      // partitions_allocd
-    -1      // partition_count
+    -1,     // partition_count
+    NULL    // bad_block_maps
 };
 
 #define MTD_PROC_FILENAME   "/proc/mtd"
@@ -76,6 +104,12 @@ mtd_scan_partitions()
             errno = ENOMEM;
             return -1;
         }
+        g_mtd_state.bad_block_maps = calloc(nump, sizeof(unsigned char*));
+        if (g_mtd_state.bad_block_maps == NULL) {
+            free(partitions);
+            errno = ENOMEM;
+            return -1;
+        }
         g_mtd_state.partitions = partitions;
         g_mtd_state.partitions_allocd = nump;
         memset(partitions, 0, nump * sizeof(*partitions));
@@ -92,6 +126,8 @@ mtd_scan_partitions()
             free(p->name);
             p->name = NULL;
         }
+        free(g_mtd_state.bad_block_maps[i]);
+        g_mtd_state.bad_block_maps[i] = NULL;
         p->device_index = -1;
     }
 
@@ -247,12 +283,50 @@ mtd_partition_info(const MtdPartition *partition,
     return 0;
 }
 
+/* Return a map with one byte per erase block of the partition, non-zero
+ * for blocks the driver reports as bad.  The map is built with one
+ * MEMGETBADBLOCK sweep the first time it's needed and kept until the
+ * partitions are rescanned.
+ */
+static const unsigned char *mtd_bad_block_map(const MtdPartition *partition, int fd)
+{
+    int index = partition->device_index;
+    if (index < 0 || index >= g_mtd_state.partitions_allocd) return NULL;
+    if (g_mtd_state.bad_block_maps[index] != NULL)
+        return g_mtd_state.bad_block_maps[index];
+
+    size_t blocks = partition->size / partition->erase_size;
+    unsigned char *map = calloc(blocks ? blocks : 1, 1);
+    if (map == NULL) return NULL;
+
+    size_t i;
+    for (i = 0; i < blocks; ++i) {
+        loff_t bpos = (loff_t) i * partition->erase_size;
+        int ret = ioctl(fd, MEMGETBADBLOCK, &bpos);
+        if (ret == -1 && errno == EOPNOTSUPP) break;  // no bad blocks on NOR
+        map[i] = (ret != 0);
+    }
+
+    g_mtd_state.bad_block_maps[index] = map;
+    return map;
+}
+
+static int mtd_block_is_bad(const MtdPartition *partition,
+        const unsigned char *map, int fd, loff_t pos)
+{
+    if (map != NULL) return map[pos / partition->erase_size];
+
+    // no map to go by; ask the driver
+    int ret = ioctl(fd, MEMGETBADBLOCK, &pos);
+    return ret != 0 && !(ret == -1 && errno == EOPNOTSUPP);
+}
+
 MtdReadContext *mtd_read_partition(const MtdPartition *partition)
 {
     MtdReadContext *ctx = (MtdReadContext*) malloc(sizeof(MtdReadContext));
     if (ctx == NULL) return NULL;
 
-    ctx->buffer = malloc(partition->erase_size);
+    ctx->buffer = malloc(MTD_READ_BATCH * partition->erase_size);
     if (ctx->buffer == NULL) {
         free(ctx);
         return NULL;
@@ -268,85 +342,168 @@ MtdReadContext *mtd_read_partition(const MtdPartition *partition)
     }
 
     ctx->partition = partition;
-    ctx->consumed = partition->erase_size;
+    ctx->consumed = 0;
+    ctx->avail = 0;
+    ctx->pos = 0;
+    ctx->bad_blocks = mtd_bad_block_map(partition, ctx->fd);
+    ctx->batches = 0;
+    ctx->spare = NULL;
+    ctx->prefetching = 0;
     return ctx;
 }
 
+static void finish_prefetch(MtdReadContext *ctx)
+{
+    if (ctx->prefetching) {
+        pthread_join(ctx->prefetcher, NULL);
+        ctx->prefetching = 0;
+    }
+}
+
 // Seeks to a location in the partition.  Don't mix with reads of
 // anything other than whole blocks; unpredictable things will result.
-void mtd_read_skip_to(const MtdReadContext* ctx, size_t offset) {
-    lseek64(ctx->fd, offset, SEEK_SET);
+void mtd_read_skip_to(MtdReadContext* ctx, size_t offset) {
+    finish_prefetch(ctx);
+    ctx->pos = offset;
+    ctx->consumed = 0;
+    ctx->avail = 0;
 }
 
-static int read_block(const MtdPartition *partition, int fd, char *data)
+/* Read up to 'max_blocks' good erase blocks starting at *pos into 'data'
+ * and return how many were read, advancing *pos past them.  Blocks in
+ * the cached bad block map are skipped without touching them, and a run
+ * of contiguous good blocks is read with one read() between a single
+ * pair of ECCGETSTATS calls.  Only if that run hit an error is it read
+ * again a block at a time, dropping the blocks that fail.
+ */
+static int read_batch(const MtdPartition *partition, int fd,
+        const unsigned char *bad_blocks, loff_t *pos, char *data, int max_blocks)
 {
+    size_t size = partition->erase_size;
     struct mtd_ecc_stats before, after;
-    if (ioctl(fd, ECCGETSTATS, &before)) {
-        fprintf(stderr, "mtd: ECCGETSTATS error (%s)\n", strerror(errno));
-        return -1;
-    }
 
-    loff_t pos = lseek64(fd, 0, SEEK_CUR);
+    for (;;) {
+        while (*pos + size <= partition->size &&
+               mtd_block_is_bad(partition, bad_blocks, fd, *pos)) {
+            fprintf(stderr, "mtd: skipping bad block at 0x%08llx\n", *pos);
+            *pos += size;
+        }
+        if (*pos + size > partition->size) break;
 
-    ssize_t size = partition->erase_size;
-    int mgbb;
+        int n = 1;
+        while (n < max_blocks && *pos + (n + 1) * size <= partition->size &&
+               !mtd_block_is_bad(partition, bad_blocks, fd, *pos + n * size)) {
+            ++n;
+        }
 
-    while (pos + size <= (int) partition->size) {
-        if (lseek64(fd, pos, SEEK_SET) != pos || read(fd, data, size) != size) {
-            fprintf(stderr, "mtd: read error at 0x%08llx (%s)\n",
-                    pos, strerror(errno));
-        } else if (ioctl(fd, ECCGETSTATS, &after)) {
+        if (ioctl(fd, ECCGETSTATS, &before)) {
             fprintf(stderr, "mtd: ECCGETSTATS error (%s)\n", strerror(errno));
             return -1;
-        } else if (after.failed != before.failed) {
-            fprintf(stderr, "mtd: ECC errors (%d soft, %d hard) at 0x%08llx\n",
-                    after.corrected - before.corrected,
-                    after.failed - before.failed, pos);
-            // copy the comparison baseline for the next read.
-            memcpy(&before, &after, sizeof(struct mtd_ecc_stats));
-        } else if ((mgbb = ioctl(fd, MEMGETBADBLOCK, &pos))) {
-            fprintf(stderr,
-                    "mtd: MEMGETBADBLOCK returned %d at 0x%08llx (errno=%d)\n",
-                    mgbb, pos, errno);
-        } else {
-            return 0;  // Success!
+        }
+        if (lseek64(fd, *pos, SEEK_SET) == *pos &&
+            read(fd, data, n * size) == (ssize_t) (n * size)) {
+            if (ioctl(fd, ECCGETSTATS, &after)) {
+                fprintf(stderr, "mtd: ECCGETSTATS error (%s)\n", strerror(errno));
+                return -1;
+            }
+            if (after.failed == before.failed) {
+                *pos += n * size;
+                return n;  // Success!
+            }
         }
 
-        pos += partition->erase_size;
+        int good = 0;
+        int i;
+        for (i = 0; i < n; ++i) {
+            loff_t bpos = *pos + i * size;
+            if (ioctl(fd, ECCGETSTATS, &before)) {
+                fprintf(stderr, "mtd: ECCGETSTATS error (%s)\n", strerror(errno));
+                return -1;
+            }
+            if (lseek64(fd, bpos, SEEK_SET) != bpos ||
+                read(fd, data + good * size, size) != (ssize_t) size) {
+                fprintf(stderr, "mtd: read error at 0x%08llx (%s)\n",
+                        bpos, strerror(errno));
+            } else if (ioctl(fd, ECCGETSTATS, &after)) {
+                fprintf(stderr, "mtd: ECCGETSTATS error (%s)\n", strerror(errno));
+                return -1;
+            } else if (after.failed != before.failed) {
+                fprintf(stderr, "mtd: ECC errors (%d soft, %d hard) at 0x%08llx\n",
+                        after.corrected - before.corrected,
+                        after.failed - before.failed, bpos);
+            } else {
+                ++good;
+            }
+        }
+        *pos += n * size;
+        if (good > 0) return good;
     }
 
     errno = ENOSPC;
     return -1;
 }
 
-ssize_t mtd_read_data(MtdReadContext *ctx, char *data, size_t len)
+static void *prefetch_batch(void *cookie)
 {
-    ssize_t read = 0;
-    while (read < (int) len) {
-        if (ctx->consumed < ctx->partition->erase_size) {
-            size_t avail = ctx->partition->erase_size - ctx->consumed;
-            size_t copy = len - read < avail ? len - read : avail;
-            memcpy(data + read, ctx->buffer + ctx->consumed, copy);
-            ctx->consumed += copy;
-            read += copy;
-        }
+    MtdReadContext *ctx = (MtdReadContext*) cookie;
+    ctx->prefetch_blocks = read_batch(ctx->partition, ctx->fd, ctx->bad_blocks,
+            &ctx->pos, ctx->spare, MTD_READ_BATCH);
+    ctx->prefetch_errno = errno;
+    return NULL;
+}
 
-        // Read complete blocks directly into the user's buffer
-        while (ctx->consumed == ctx->partition->erase_size &&
-               len - read >= ctx->partition->erase_size) {
-            if (read_block(ctx->partition, ctx->fd, data + read)) return -1;
-            read += ctx->partition->erase_size;
+static int next_batch(MtdReadContext *ctx)
+{
+    const MtdPartition *partition = ctx->partition;
+    int blocks;
+
+    if (ctx->prefetching) {
+        finish_prefetch(ctx);
+        char *tmp = ctx->buffer;
+        ctx->buffer = ctx->spare;
+        ctx->spare = tmp;
+        blocks = ctx->prefetch_blocks;
+        errno = ctx->prefetch_errno;
+    } else {
+        // start with a single block; small reads like the bootloader
+        // message shouldn't pull in a whole batch
+        blocks = read_batch(partition, ctx->fd, ctx->bad_blocks, &ctx->pos,
+                ctx->buffer, ctx->batches == 0 ? 1 : MTD_READ_BATCH);
+    }
+    if (blocks < 0) return -1;
+
+    ctx->consumed = 0;
+    ctx->avail = blocks * partition->erase_size;
+
+    // Once the caller comes back for more, read the next batch while
+    // this one is being consumed.
+    if (++ctx->batches > 1 && ctx->pos + partition->erase_size <= partition->size) {
+        if (ctx->spare == NULL)
+            ctx->spare = malloc(MTD_READ_BATCH * partition->erase_size);
+        if (ctx->spare != NULL &&
+            pthread_create(&ctx->prefetcher, NULL, prefetch_batch, ctx) == 0) {
+            ctx->prefetching = 1;
         }
+    }
+    return 0;
+}
 
-        if (read >= (int)len) {
-            return read;
+ssize_t mtd_read_data(MtdReadContext *ctx, char *data, size_t len)
+{
+    size_t read = 0;
+    while (read < len) {
+        if (ctx->consumed == ctx->avail && next_batch(ctx)) {
+            // at the end of the partition, hand back what we have; the
+            // next call fails with ENOSPC
+            if (read > 0 && errno == ENOSPC) break;
+            return -1;
         }
 
-        // Read the next block into the buffer
-        if (ctx->consumed == ctx->partition->erase_size && read < (int) len) {
-            if (read_block(ctx->partition, ctx->fd, ctx->buffer)) return -1;
-            ctx->consumed = 0;
-        }
+        size_t avail = ctx->avail - ctx->consumed;
+        size_t copy = len - read < avail ? len - read : avail;
+        memcpy(data + read, ctx->buffer + ctx->consumed, copy);
+        ctx->consumed += copy;
+        read += copy;
     }
 
     return read;
@@ -354,8 +511,10 @@ ssize_t mtd_read_data(MtdReadContext *ctx, char *data, size_t len)
 
 void mtd_read_close(MtdReadContext *ctx)
 {
+    finish_prefetch(ctx);
     close(ctx->fd);
     free(ctx->buffer);
+    free(ctx->spare);
     free(ctx);
 }
 
@@ -368,8 +527,13 @@ MtdWriteContext *mtd_write_partition(const MtdPartition *partition)
     ctx->bad_block_alloc = 0;
     ctx->bad_block_count = 0;
 
-    ctx->buffer = malloc(partition->erase_size);
-    if (ctx->buffer == NULL) {
+    ctx->batch = malloc(MTD_WRITE_BATCH * partition->erase_size);
+    ctx->verify = malloc(MTD_WRITE_BATCH * partition->erase_size);
+    ctx->targets = malloc(MTD_WRITE_BATCH * sizeof(off_t));
+    if (ctx->batch == NULL || ctx->verify == NULL || ctx->targets == NULL) {
+        free(ctx->batch);
+        free(ctx->verify);
+        free(ctx->targets);
         free(ctx);
         return NULL;
     }
@@ -378,13 +542,18 @@ MtdWriteContext *mtd_write_partition(const MtdPartition *partition)
     sprintf(mtddevname, "/dev/mtd/mtd%d", partition->device_index);
     ctx->fd = open(mtddevname, O_RDWR);
     if (ctx->fd < 0) {
-        free(ctx->buffer);
+        free(ctx->batch);
+        free(ctx->verify);
+        free(ctx->targets);
         free(ctx);
         return NULL;
     }
 
     ctx->partition = partition;
     ctx->stored = 0;
+    ctx->pos = 0;
+    ctx->batch_count = 0;
+    ctx->bad_blocks = mtd_bad_block_map(partition, ctx->fd);
     return ctx;
 }
 
@@ -397,105 +566,185 @@ static void add_bad_block_offset(MtdWriteContext *ctx, off_t pos) {
     ctx->bad_block_offsets[ctx->bad_block_count++] = pos;
 }
 
-static int write_block(MtdWriteContext *ctx, const char *data)
-{
-    const MtdPartition *partition = ctx->partition;
-    int fd = ctx->fd;
-
-    off_t pos = lseek(fd, 0, SEEK_CUR);
-    if (pos == (off_t) -1) return 1;
+// Move ctx->pos up to 'target', recording the factory-bad blocks that
+// were skipped on the way.
+static void advance_write_pos(MtdWriteContext *ctx, off_t target) {
+    while (ctx->pos < target) {
+        add_bad_block_offset(ctx, ctx->pos);
+        fprintf(stderr, "mtd: not writing bad block at 0x%08lx\n", ctx->pos);
+        ctx->pos += ctx->partition->erase_size;
+    }
+}
 
-    ssize_t size = partition->erase_size;
+// Length of the run of physically contiguous targets starting at 'i'.
+static int target_run(const MtdWriteContext *ctx, int i, int count) {
+    int j = i + 1;
+    while (j < count &&
+           ctx->targets[j] == ctx->targets[j-1] + (off_t) ctx->partition->erase_size) {
+        ++j;
+    }
+    return j - i;
+}
 
-    char *verify = malloc(size);
-    if (verify == NULL)
-        return 1;
+static void erase_range(MtdWriteContext *ctx, off_t pos, size_t len) {
+    struct erase_info_user erase_info;
+    erase_info.start = pos;
+    erase_info.length = len;
+    if (ioctl(ctx->fd, MEMERASE, &erase_info) == 0) return;
 
-    while (pos + size <= (int) partition->size) {
-        loff_t bpos = pos;
-        int ret = ioctl(fd, MEMGETBADBLOCK, &bpos);
-        if (ret != 0 && !(ret == -1 && errno == EOPNOTSUPP)) {
-            add_bad_block_offset(ctx, pos);
-            fprintf(stderr,
-                    "mtd: not writing bad block at 0x%08lx (ret %d errno %d)\n",
-                    pos, ret, errno);
-            pos += partition->erase_size;
-            continue;  // Don't try to erase known factory-bad blocks.
+    // erase block by block so one failing block doesn't hold up the rest
+    size_t size = ctx->partition->erase_size;
+    for (erase_info.length = size; len > 0; len -= size, pos += size) {
+        erase_info.start = pos;
+        if (ioctl(ctx->fd, MEMERASE, &erase_info) < 0) {
+            fprintf(stderr, "mtd: erase failure at 0x%08lx (%s)\n",
+                    pos, strerror(errno));
         }
+    }
+}
 
-        struct erase_info_user erase_info;
-        erase_info.start = pos;
-        erase_info.length = size;
-        int retry;
-        for (retry = 0; retry < 2; ++retry) {
-            if (ioctl(fd, MEMERASE, &erase_info) < 0) {
-                fprintf(stderr, "mtd: erase failure at 0x%08lx (%s)\n",
-                        pos, strerror(errno));
-                continue;
-            }
-            if (lseek(fd, pos, SEEK_SET) != pos ||
-                write(fd, data, size) != size) {
-                fprintf(stderr, "mtd: write error at 0x%08lx (%s)\n",
-                        pos, strerror(errno));
-            }
+static int write_range(int fd, off_t pos, const char *data, size_t len) {
+    if (lseek(fd, pos, SEEK_SET) != pos ||
+        write(fd, data, len) != (ssize_t) len) {
+        fprintf(stderr, "mtd: write error at 0x%08lx (%s)\n",
+                pos, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int read_range(int fd, off_t pos, char *data, size_t len) {
+    if (lseek(fd, pos, SEEK_SET) != pos ||
+        read(fd, data, len) != (ssize_t) len) {
+        fprintf(stderr, "mtd: re-read error at 0x%08lx (%s)\n",
+                pos, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// One more erase/write/verify cycle for a block that failed verification.
+static int retry_block(MtdWriteContext *ctx, const char *data, off_t pos) {
+    size_t size = ctx->partition->erase_size;
+    struct erase_info_user erase_info;
+    erase_info.start = pos;
+    erase_info.length = size;
+    if (ioctl(ctx->fd, MEMERASE, &erase_info) < 0) {
+        fprintf(stderr, "mtd: erase failure at 0x%08lx (%s)\n",
+                pos, strerror(errno));
+        return -1;
+    }
+    write_range(ctx->fd, pos, data, size);
+    if (read_range(ctx->fd, pos, ctx->verify, size)) return -1;
+    if (memcmp(data, ctx->verify, size) != 0) {
+        fprintf(stderr, "mtd: verification error at 0x%08lx\n", pos);
+        return -1;
+    }
+    fprintf(stderr, "mtd: wrote block after 1 retries\n");
+    return 0;
+}
 
-            if (lseek(fd, pos, SEEK_SET) != pos ||
-                read(fd, verify, size) != size) {
-                fprintf(stderr, "mtd: re-read error at 0x%08lx (%s)\n",
-                        pos, strerror(errno));
-                continue;
+/* Write out the batched blocks.  Targets are picked from the cached bad
+ * block map, each run of contiguous targets is erased, written and read
+ * back with one syscall apiece, and the read-back is compared block by
+ * block.  A block that still fails after a retry is given up on like
+ * before: it is recorded as bad and it and everything after it move up
+ * one block.
+ */
+static int flush_batch(MtdWriteContext *ctx)
+{
+    const MtdPartition *partition = ctx->partition;
+    size_t size = partition->erase_size;
+    int start = 0;
+
+    while (start < ctx->batch_count) {
+        int count = ctx->batch_count - start;
+        const char *data = ctx->batch + start * size;
+        off_t pos = ctx->pos;
+        int i, n, k;
+
+        for (i = 0; i < count; ++i) {
+            while (pos + size <= partition->size &&
+                   mtd_block_is_bad(partition, ctx->bad_blocks, ctx->fd, pos)) {
+                pos += size;
             }
-            if (memcmp(data, verify, size) != 0) {
-                fprintf(stderr, "mtd: verification error at 0x%08lx (%s)\n",
-                        pos, strerror(errno));
-                continue;
+            if (pos + size > partition->size) {
+                // Ran out of space on the device
+                errno = ENOSPC;
+                return -1;
             }
+            ctx->targets[i] = pos;
+            pos += size;
+        }
 
-            if (retry > 0) {
-                fprintf(stderr, "mtd: wrote block after %d retries\n", retry);
+        for (i = 0; i < count; i += n) {
+            n = target_run(ctx, i, count);
+            erase_range(ctx, ctx->targets[i], n * size);
+            write_range(ctx->fd, ctx->targets[i], data + i * size, n * size);
+        }
+
+        int failed = -1;
+        for (i = 0; i < count && failed < 0; i += n) {
+            n = target_run(ctx, i, count);
+            int reread = read_range(ctx->fd, ctx->targets[i], ctx->verify, n * size);
+            for (k = i; k < i + n; ++k) {
+                const char *block = data + k * size;
+                if (reread == 0 &&
+                    memcmp(block, ctx->verify + (k - i) * size, size) == 0) {
+                    continue;
+                }
+                fprintf(stderr, "mtd: verification error at 0x%08lx\n",
+                        ctx->targets[k]);
+                if (retry_block(ctx, block, ctx->targets[k]) != 0) {
+                    failed = k;
+                    break;
+                }
+                // retry_block() reused the verify buffer; read the rest again
+                if (k + 1 < i + n) {
+                    reread = read_range(ctx->fd, ctx->targets[k+1],
+                            ctx->verify + (k + 1 - i) * size,
+                            (i + n - k - 1) * size);
+                }
             }
-            fprintf(stderr, "mtd: successfully wrote block at %llx\n", pos);
-            free(verify);
-            return 0;  // Success!
         }
 
+        int good = failed < 0 ? count : failed;
+        for (i = 0; i < good; ++i) {
+            advance_write_pos(ctx, ctx->targets[i]);
+            ctx->pos += size;
+        }
+        if (failed < 0) break;
+
         // Try to erase it once more as we give up on this block
-        add_bad_block_offset(ctx, pos);
-        fprintf(stderr, "mtd: skipping write block at 0x%08lx\n", pos);
-        ioctl(fd, MEMERASE, &erase_info);
-        pos += partition->erase_size;
+        advance_write_pos(ctx, ctx->targets[failed]);
+        add_bad_block_offset(ctx, ctx->pos);
+        fprintf(stderr, "mtd: skipping write block at 0x%08lx\n", ctx->pos);
+        erase_range(ctx, ctx->pos, size);
+        ctx->pos += size;
+        start += failed;
     }
 
-    free(verify);
-
-    // Ran out of space on the device
-    errno = ENOSPC;
-    return -1;
+    ctx->batch_count = 0;
+    return 0;
 }
 
 ssize_t mtd_write_data(MtdWriteContext *ctx, const char *data, size_t len)
 {
+    size_t size = ctx->partition->erase_size;
     size_t wrote = 0;
     while (wrote < len) {
-        // Coalesce partial writes into complete blocks
-        if (ctx->stored > 0 || len - wrote < ctx->partition->erase_size) {
-            size_t avail = ctx->partition->erase_size - ctx->stored;
-            size_t copy = len - wrote < avail ? len - wrote : avail;
-            memcpy(ctx->buffer + ctx->stored, data + wrote, copy);
-            ctx->stored += copy;
-            wrote += copy;
-        }
-
-        // If a complete block was accumulated, write it
-        if (ctx->stored == ctx->partition->erase_size) {
-            if (write_block(ctx, ctx->buffer)) return -1;
+        // Collect the data into the batch, a block at a time
+        char *block = ctx->batch + ctx->batch_count * size;
+        size_t avail = size - ctx->stored;
+        size_t copy = len - wrote < avail ? len - wrote : avail;
+        memcpy(block + ctx->stored, data + wrote, copy);
+        ctx->stored += copy;
+        wrote += copy;
+
+        if (ctx->stored == size) {
             ctx->stored = 0;
-        }
-
-        // Write complete blocks directly from the user's buffer
-        while (ctx->stored == 0 && len - wrote >= ctx->partition->erase_size) {
-            if (write_block(ctx, data + wrote)) return -1;
-            wrote += ctx->partition->erase_size;
+            if (++ctx->batch_count == MTD_WRITE_BATCH && flush_batch(ctx))
+                return -1;
         }
     }
 
@@ -504,41 +753,40 @@ ssize_t mtd_write_data(MtdWriteContext *ctx, const char *data, size_t len)
 
 off_t mtd_erase_blocks(MtdWriteContext *ctx, int blocks)
 {
+    const MtdPartition *partition = ctx->partition;
+    size_t size = partition->erase_size;
+
     // Zero-pad and write any pending data to get us to a block boundary
     if (ctx->stored > 0) {
-        size_t zero = ctx->partition->erase_size - ctx->stored;
-        memset(ctx->buffer + ctx->stored, 0, zero);
-        if (write_block(ctx, ctx->buffer)) return -1;
+        char *block = ctx->batch + ctx->batch_count * size;
+        memset(block + ctx->stored, 0, size - ctx->stored);
         ctx->stored = 0;
+        ctx->batch_count++;
     }
+    if (ctx->batch_count > 0 && flush_batch(ctx)) return -1;
 
-    off_t pos = lseek(ctx->fd, 0, SEEK_CUR);
-    if ((off_t) pos == (off_t) -1) return pos;
+    off_t pos = ctx->pos;
 
-    const int total = (ctx->partition->size - pos) / ctx->partition->erase_size;
+    const int total = (partition->size - pos) / size;
     if (blocks < 0) blocks = total;
     if (blocks > total) {
         errno = ENOSPC;
         return -1;
     }
 
-    // Erase the specified number of blocks
+    // Erase the specified number of blocks, a run of good ones at a time
+    off_t run = pos;
     while (blocks-- > 0) {
-        loff_t bpos = pos;
-        if (ioctl(ctx->fd, MEMGETBADBLOCK, &bpos) > 0) {
+        if (mtd_block_is_bad(partition, ctx->bad_blocks, ctx->fd, pos)) {
+            if (pos > run) erase_range(ctx, run, pos - run);
             fprintf(stderr, "mtd: not erasing bad block at 0x%08lx\n", pos);
-            pos += ctx->partition->erase_size;
+            pos += size;
+            run = pos;
             continue;  // Don't try to erase known factory-bad blocks.
         }
-
-        struct erase_info_user erase_info;
-        erase_info.start = pos;
-        erase_info.length = ctx->partition->erase_size;
-        if (ioctl(ctx->fd, MEMERASE, &erase_info) < 0) {
-            fprintf(stderr, "mtd: erase failure at 0x%08lx\n", pos);
-        }
-        pos += ctx->partition->erase_size;
+        pos += size;
     }
+    if (pos > run) erase_range(ctx, run, pos - run);
 
     return pos;
 }
@@ -550,7 +798,9 @@ int mtd_write_close(MtdWriteContext *ctx)
     if (mtd_erase_blocks(ctx, 0) == (off_t) -1) r = -1;
     if (close(ctx->fd)) r = -1;
     free(ctx->bad_block_offsets);
-    free(ctx->buffer);
+    free(ctx->batch);
+    free(ctx->verify);
+    free(ctx->targets);
     free(ctx);
     return r;
 }
@@ -61,6 +61,13 @@ typedef int (*nandroid_restore_handler)(const char* backup_file_image, const cha
 static int nandroid_backup_bitfield = 0;
 static unsigned int nandroid_files_total = 0;
 static unsigned int nandroid_files_count = 0;
+// tar -v prints names relative to the parent of the directory being
+// backed up; the scan that counted the files knows their sizes, so
+// progress follows bytes instead of names
+static struct dir_stats nandroid_stats;
+static long long nandroid_bytes_total = 0;
+static long long nandroid_bytes_done = 0;
+static char nandroid_base_dir[PATH_MAX];
 
 static void nandroid_generate_timestamp_path(char* backup_path) {
     time_t t = time(NULL);
@@ -105,36 +112,41 @@ static void nandroid_callback(const char* filename) {
         nandroid_files_count++;
         float progress_decimal = (float)((double)nandroid_files_count /
                                          (double)nandroid_files_total);
+        if (nandroid_bytes_total != 0) {
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/%s", nandroid_base_dir, tmp);
+            long long size = dir_stats_file_size(&nandroid_stats, path);
+            if (size > 0)
+                nandroid_bytes_done += size;
+            if (nandroid_bytes_done != 0)
+                progress_decimal = (float)((double)nandroid_bytes_done /
+                                           (double)nandroid_bytes_total);
+        }
         ui_set_progress(progress_decimal);
     }
 }
 
 static void compute_directory_stats(const char* directory) {
-    char tmp[PATH_MAX];
-    char count_text[100];
-
     // reset file count if we ever return before setting it
     nandroid_files_count = 0;
     nandroid_files_total = 0;
+    nandroid_bytes_done = 0;
+    nandroid_bytes_total = 0;
+    memset(&nandroid_stats, 0, sizeof(nandroid_stats));
 
-    sprintf(tmp, "find %s | %s wc -l > /tmp/dircount", directory, strcmp(directory, "/data") == 0 && is_data_media() ? "grep -v /data/media |" : "");
-    __system(tmp);
-
-    FILE* f = fopen("/tmp/dircount", "r");
-    if (f == NULL)
-        return;
-
-    if (fgets(count_text, sizeof(count_text), f) == NULL) {
-        fclose(f);
+    const char* exclude = strcmp(directory, "/data") == 0 && is_data_media() ? "/data/media" : NULL;
+    struct dir_stats stats;
+    if (dir_stats_cached(directory, exclude, &stats) != 0)
         return;
-    }
 
-    size_t len = strlen(count_text);
-    if (count_text[len - 1] == '\n')
-        count_text[len - 1] = '\0';
-
-    fclose(f);
-    nandroid_files_total = atoi(count_text);
+    char parent[PATH_MAX];
+    strcpy(parent, directory);
+    strcpy(nandroid_base_dir, dirname(parent));
+    if (strcmp(nandroid_base_dir, "/") == 0)
+        nandroid_base_dir[0] = '\0';
+    nandroid_stats = stats;
+    nandroid_files_total = stats.entries;
+    nandroid_bytes_total = stats.bytes;
     ui_reset_progress();
     ui_show_progress(1, 0);
 }
@@ -207,9 +219,22 @@ void nandroid_dedupe_gc(const char* blob_dir) {
     strcpy(backup_dir, d);
     strcat(backup_dir, "/backup");
     ui_print("Freeing space...\n");
-    char tmp[PATH_MAX];
-    sprintf(tmp, "dedupe gc %s $(find %s -name '*.dup')", blob_dir, backup_dir);
-    __system(tmp);
+    int count;
+    char** dups = find_files(backup_dir, ".dup", &count);
+    if (dups == NULL) {
+        ui_print("Unable to list backups.\n");
+        return;
+    }
+    char** args = malloc((count + 4) * sizeof(char*));
+    if (args != NULL) {
+        args[0] = "dedupe";
+        args[1] = "gc";
+        args[2] = (char*)blob_dir;
+        memcpy(args + 3, dups, (count + 1) * sizeof(char*));
+        __systemv(args);
+        free(args);
+    }
+    free_file_list(dups);
     ui_print("Done freeing space.\n");
 }
 
@@ -231,9 +256,13 @@ static int dedupe_compress_wrapper(const char* backup_path, const char* backup_f
         nandroid_dedupe_gc(blob_dir);
     }
 
-    sprintf(tmp, "dedupe c %s %s %s.dup %s", backup_path, blob_dir, backup_file_image, strcmp(backup_path, "/data") == 0 && is_data_media() ? "./media" : "");
+    char dup_file[PATH_MAX];
+    sprintf(dup_file, "%s.dup", backup_file_image);
+    char* args[] = { "dedupe", "c", (char*)backup_path, blob_dir, dup_file,
+                     strcmp(backup_path, "/data") == 0 && is_data_media() ? "./media" : NULL,
+                     NULL };
 
-    FILE *fp = __popen(tmp, "r");
+    FILE *fp = __popenv(args, "r");
     if (fp == NULL) {
         ui_print("Unable to execute dedupe.\n");
         return -1;
@@ -392,8 +421,22 @@ static int nandroid_backup_partition(const char* backup_path, const char* root)
         else
             sprintf(tmp, "%s/%s.img", backup_path, name);
 
+        // sparse images need a seekable output, so never when streaming
+        struct stat file_info;
+        int sparse = 0;
+        if (strcmp(backup_path, "-") != 0) {
+            char path[PATH_MAX];
+            build_configuration_path(path, NANDROID_SPARSE_RAW_FILE);
+            ensure_path_mounted(path);
+            sparse = stat(path, &file_info) == 0;
+        }
+
         ui_print("[*] Backing up %s image...\n", name);
-        if (0 != (ret = backup_raw_partition(vol->fs_type, vol->blk_device, tmp))) {
+        if (sparse)
+            ret = backup_raw_partition_sparse(vol->fs_type, vol->blk_device, tmp);
+        else
+            ret = backup_raw_partition(vol->fs_type, vol->blk_device, tmp);
+        if (0 != ret) {
             ui_print("Error while backing up %s image!", name);
             return ret;
         }
@@ -500,11 +543,15 @@ int nandroid_backup(const char* backup_path) {
     d = dirname(base_dir);
     strcpy(base_dir, d);
 
-    sprintf(tmp, "chmod -R 777 %s ; chmod -R u+r,u+w,g+r,g+w,o+r,o+w %s ; chmod u+x,g+x,o+x %s/backup", backup_path, base_dir, base_dir);
-    __system(tmp);
-
-    sprintf(tmp, "if [ -d %s/blobs ]; then chmod u+x,g+x,o+x %s/blobs; fi", base_dir, base_dir);
-    __system(tmp);
+    chmod_recursive(backup_path, 07777, 0777);
+    chmod_recursive(base_dir, 0, 0666);
+    struct stat st;
+    sprintf(tmp, "%s/backup", base_dir);
+    if (stat(tmp, &st) == 0)
+        chmod(tmp, (st.st_mode & 07777) | 0111);
+    sprintf(tmp, "%s/blobs", base_dir);
+    if (stat(tmp, &st) == 0 && S_ISDIR(st.st_mode))
+        chmod(tmp, (st.st_mode & 07777) | 0111);
 
     sync();
     ui_set_background(BACKGROUND_ICON_CLOCKWORK);
@@ -743,10 +790,11 @@ static int dedupe_extract_wrapper(const char* backup_file_image, const char* bac
     bd = dirname(blob_dir);
     strcpy(blob_dir, bd);
     bd = dirname(blob_dir);
-    sprintf(tmp, "dedupe x %s %s/blobs %s; exit $?", backup_file_image, bd, backup_path);
+    sprintf(tmp, "%s/blobs", bd);
+    char* args[] = { "dedupe", "x", (char*)backup_file_image, tmp, (char*)backup_path, NULL };
 
     char path[PATH_MAX];
-    FILE *fp = __popen(tmp, "r");
+    FILE *fp = __popenv(args, "r");
     if (fp == NULL) {
         ui_print("Unable to execute dedupe.\n");
         return -1;
@@ -957,6 +1005,8 @@ int nandroid_restore(const char* backup_path, unsigned char flags) {
     ui_set_background(BACKGROUND_ICON_INSTALLING);
     ui_show_indeterminate_progress();
     nandroid_files_total = 0;
+    memset(&nandroid_stats, 0, sizeof(nandroid_stats));
+    dir_stats_invalidate();
     int ret;
 
     int restore_boot = ((flags & NANDROID_BOOT) == NANDROID_BOOT);
@@ -35,6 +35,7 @@
 #include "common.h"
 #include "cutils/properties.h"
 #include "cutils/android_reboot.h"
+#include "dirlist.h"
 #include "install.h"
 #include "minui/minui.h"
 #include "minzip/DirUtil.h"
@@ -46,6 +47,7 @@
 #include "dedupe/dedupe.h"
 #include "firmware.h"
 #include "extendedcommands.h"
+#include "libcrecovery/common.h"
 #include "flashutils/flashutils.h"
 #include "recovery_cmds.h"
 #include "voldclient/voldclient.h"
@@ -87,7 +89,8 @@ extern UIParameters ui_parameters;    // from ui.c
  *
  * The arguments which may be supplied in the recovery.command file:
  *   --send_intent=anystring - write the text out to recovery.intent
- *   --update_package=path - verify install an OTA package file
+ *   --update_package=path - verify install an OTA package file; given
+ *       more than once, install them all in order, stopping at a failure
  *   --wipe_data - erase user data (and cache), then reboot
  *   --wipe_cache - wipe cache (but not user data), then reboot
  *   --set_encrypted_filesystem=on|off - enables / diasables encrypted fs
@@ -257,17 +260,20 @@ copy_log_file(const char* source, const char* destination, int append) {
     if (log == NULL) {
         LOGE("Can't open %s\n", destination);
     } else {
-        FILE *tmplog = fopen(source, "r");
-        if (tmplog != NULL) {
+        int tmplog = open(source, O_RDONLY);
+        if (tmplog >= 0) {
             if (append) {
-                fseek(tmplog, tmplog_offset, SEEK_SET);  // Since last write
+                lseek(tmplog, tmplog_offset, SEEK_SET);  // Since last write
+            }
+            char buf[65536];
+            ssize_t n;
+            while ((n = read(tmplog, buf, sizeof(buf))) > 0) {
+                if (fwrite(buf, 1, n, log) != (size_t) n) break;
             }
-            char buf[4096];
-            while (fgets(buf, sizeof(buf), tmplog)) fputs(buf, log);
             if (append) {
-                tmplog_offset = ftell(tmplog);
+                tmplog_offset = lseek(tmplog, 0, SEEK_CUR);
             }
-            check_and_fclose(tmplog, source);
+            close(tmplog);
         }
         check_and_fclose(log, destination);
     }
@@ -292,6 +298,7 @@ rotate_last_logs(int max) {
 static void
 copy_logs() {
     // Copy logs to cache so the system can find out what happened.
+    log_flush();
     copy_log_file(TEMPORARY_LOG_FILE, LOG_FILE, true);
     copy_log_file(TEMPORARY_LOG_FILE, LAST_LOG_FILE, false);
     copy_log_file(TEMPORARY_INSTALL_FILE, LAST_INSTALL_FILE, false);
@@ -425,6 +432,16 @@ copy_sideloaded_package(const char* original_path) {
   return strdup(copy_path);
 }
 
+// The script may unmount or format /data, so a package kept there can't
+// be installed in place.
+static int
+package_on_data(const char* path) {
+    if (is_data_media_volume_path(path))
+        return 1;
+    Volume* v = volume_for_path(path);
+    return v != NULL && strcmp(v->mount_point, "/data") == 0;
+}
+
 static const char**
 prepend_title(const char** headers) {
     const char* title[] = { EXPAND(RECOVERY_VERSION),
@@ -527,10 +544,6 @@ get_menu_selection(const char** headers, char** items, int menu_only,
     return chosen_item;
 }
 
-static int compare_string(const void* a, const void* b) {
-    return strcmp(*(const char**)a, *(const char**)b);
-}
-
 static int
 update_directory(const char* path, const char* unmount_when_done) {
     ensure_path_mounted(path);
@@ -539,10 +552,8 @@ update_directory(const char* path, const char* unmount_when_done) {
                                    path,
                                    "",
                                    NULL };
-    DIR* d;
-    struct dirent* de;
-    d = opendir(path);
-    if (d == NULL) {
+    const DirList* list = dirlist_open(path);
+    if (list == NULL) {
         LOGE("error opening %s: %s\n", path, strerror(errno));
         if (unmount_when_done != NULL) {
             ensure_path_unmounted(unmount_when_done);
@@ -552,55 +563,20 @@ update_directory(const char* path, const char* unmount_when_done) {
 
     const char** headers = prepend_title(MENU_HEADERS);
 
-    int d_size = 0;
-    int d_alloc = 10;
-    char** dirs = malloc(d_alloc * sizeof(char*));
-    int z_size = 1;
-    int z_alloc = 10;
-    char** zips = malloc(z_alloc * sizeof(char*));
-    zips[0] = strdup("../");
-
-    while ((de = readdir(d)) != NULL) {
-        int name_len = strlen(de->d_name);
-
-        if (de->d_type == DT_DIR) {
-            // skip "." and ".." entries
-            if (name_len == 1 && de->d_name[0] == '.') continue;
-            if (name_len == 2 && de->d_name[0] == '.' &&
-                de->d_name[1] == '.') continue;
-
-            if (d_size >= d_alloc) {
-                d_alloc *= 2;
-                dirs = realloc(dirs, d_alloc * sizeof(char*));
-            }
-            dirs[d_size] = malloc(name_len + 2);
-            strcpy(dirs[d_size], de->d_name);
-            dirs[d_size][name_len] = '/';
-            dirs[d_size][name_len+1] = '\0';
-            ++d_size;
-        } else if (de->d_type == DT_REG &&
-                   name_len >= 4 &&
-                   strncasecmp(de->d_name + (name_len-4), ".zip", 4) == 0) {
-            if (z_size >= z_alloc) {
-                z_alloc *= 2;
-                zips = realloc(zips, z_alloc * sizeof(char*));
-            }
-            zips[z_size++] = strdup(de->d_name);
-        }
-    }
-    closedir(d);
-
-    qsort(dirs, d_size, sizeof(char*), compare_string);
-    qsort(zips, z_size, sizeof(char*), compare_string);
-
-    // append dirs to the zips list
-    if (d_size + z_size + 1 > z_alloc) {
-        z_alloc = d_size + z_size + 1;
-        zips = realloc(zips, z_alloc * sizeof(char*));
+    // "../", then the zips, then the subdirectories.  The names belong
+    // to the listing, which stays around until we are done with the menu.
+    char** zips = malloc((list->num_files + list->num_dirs + 2) * sizeof(char*));
+    int z_size = 0;
+    int i;
+    zips[z_size++] = "../";
+    for (i = 0; i < list->num_files; ++i) {
+        char* name = list->files[i];
+        int name_len = strlen(name);
+        if (name_len >= 4 && strncasecmp(name + (name_len-4), ".zip", 4) == 0)
+            zips[z_size++] = name;
     }
-    memcpy(zips + z_size, dirs, d_size * sizeof(char*));
-    free(dirs);
-    z_size += d_size;
+    for (i = 0; i < list->num_dirs; ++i)
+        zips[z_size++] = list->dirs[i];
     zips[z_size] = NULL;
 
     int result;
@@ -633,23 +609,28 @@ update_directory(const char* path, const char* unmount_when_done) {
 
             ui_print("\n-- Install %s ...\n", path);
             set_sdcard_update_bootloader_message();
-            char* copy = copy_sideloaded_package(new_path);
-            if (unmount_when_done != NULL) {
-                ensure_path_unmounted(unmount_when_done);
-            }
-            if (copy) {
-                result = install_package(copy);
-                free(copy);
+            if (package_on_data(new_path)) {
+                char* copy = copy_sideloaded_package(new_path);
+                if (unmount_when_done != NULL) {
+                    ensure_path_unmounted(unmount_when_done);
+                }
+                if (copy) {
+                    result = install_package(copy);
+                    free(copy);
+                } else {
+                    result = INSTALL_ERROR;
+                }
             } else {
-                result = INSTALL_ERROR;
+                // install straight from the source volume, which stays
+                // mounted until the install is done
+                result = install_package(new_path);
             }
             break;
         }
     } while (true);
 
-    int i;
-    for (i = 0; i < z_size; ++i) free(zips[i]);
     free(zips);
+    dirlist_release(list);
     free(headers);
 
     if (unmount_when_done != NULL) {
@@ -804,6 +785,7 @@ void wipe_dalvik_cache(int confirm) {
 		__system("rm -r /data/dalvik-cache");
 		__system("rm -r /cache/dalvik-cache");
 		__system("rm -r /sd-ext/dalvik-cache");
+		dir_stats_invalidate();
 		ui_print("Dalvik Cache wiped.\n");
 	}
 	else 
@@ -1042,6 +1024,7 @@ main(int argc, char **argv) {
     // If these fail, there's not really anywhere to complain...
     freopen(TEMPORARY_LOG_FILE, "a", stdout); setbuf(stdout, NULL);
     freopen(TEMPORARY_LOG_FILE, "a", stderr); setbuf(stderr, NULL);
+    log_init();
     printf("Starting recovery on %s\n", ctime(&start));
 
     device_ui_init(&ui_parameters);
@@ -1059,6 +1042,9 @@ main(int argc, char **argv) {
 
     const char *send_intent = NULL;
     const char *update_package = NULL;
+    // more than one --update_package installs them all, in order
+    char *update_packages[MAX_ARGS];
+    int update_package_count = 0;
     int wipe_data = 0, wipe_cache = 0;
     int sideload = 0;
     int headless = 0;
@@ -1069,7 +1055,11 @@ main(int argc, char **argv) {
     while ((arg = getopt_long(argc, argv, "", OPTIONS, NULL)) != -1) {
         switch (arg) {
         case 's': send_intent = optarg; break;
-        case 'u': update_package = optarg; break;
+        case 'u':
+            update_package = optarg;
+            if (update_package_count < MAX_ARGS)
+                update_packages[update_package_count++] = optarg;
+            break;
         case 'w':
 #ifndef BOARD_RECOVERY_ALWAYS_WIPES
         wipe_data = wipe_cache = 1;
@@ -1110,20 +1100,23 @@ main(int argc, char **argv) {
     }
     printf("\n");
 
-    if (update_package) {
+    for (arg = 0; arg < update_package_count; arg++) {
         // For backwards compatibility on the cache partition only, if
         // we're given an old 'root' path "CACHE:foo", change it to
         // "/cache/foo".
-        if (strncmp(update_package, "CACHE:", 6) == 0) {
-            int len = strlen(update_package) + 10;
+        char *package = update_packages[arg];
+        if (strncmp(package, "CACHE:", 6) == 0) {
+            int len = strlen(package) + 10;
             char* modified_path = malloc(len);
             strlcpy(modified_path, "/cache/", len);
-            strlcat(modified_path, update_package+6, len);
+            strlcat(modified_path, package+6, len);
             printf("(replacing path \"%s\" with \"%s\")\n",
-                   update_package, modified_path);
-            update_package = modified_path;
+                   package, modified_path);
+            update_packages[arg] = modified_path;
         }
     }
+    if (update_package_count > 0)
+        update_package = update_packages[update_package_count - 1];
     printf("\n");
 
     property_list(print_property, NULL);
@@ -1131,7 +1124,13 @@ main(int argc, char **argv) {
 
     int status = INSTALL_SUCCESS;
 
-    if (update_package != NULL) {
+    if (update_package_count > 1) {
+        status = install_zips(update_packages, update_package_count, 1) == 0 ?
+                INSTALL_SUCCESS : INSTALL_ERROR;
+        if (status != INSTALL_SUCCESS) {
+            copy_logs();
+        }
+    } else if (update_package != NULL) {
         status = install_package(update_package);
         if (status != INSTALL_SUCCESS) {
             copy_logs();
@@ -0,0 +1,148 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cutils/properties.h"
+
+#include "recovery_log.h"
+
+// Log messages, ui_print() and every plain printf() share stdout's own
+// buffer, so they reach the file in the order they were made.  A queue
+// of our own would never see printf(), and bionic's stdout can't be
+// pointed at one.  Writers only take stdio's lock and copy; the flusher
+// thread writes out whatever has piled up every LOG_FLUSH_MS, and
+// anything that lets another process write to the file flushes first.
+
+#define LOG_BUFFER_SIZE (64 * 1024)
+#define LOG_FLUSH_MS 100
+#define LOG_LEVEL_POLL 10       // flusher ticks between property reads
+
+static char log_buffer[LOG_BUFFER_SIZE];
+static int log_enabled = 0;
+static int log_level = LOG_LEVEL_INFO;
+static pthread_t flusher;
+
+static const struct {
+    const char *name;
+    int level;
+} level_names[] = {
+    { "verbose", LOG_LEVEL_VERBOSE },
+    { "debug", LOG_LEVEL_DEBUG },
+    { "info", LOG_LEVEL_INFO },
+    { "warn", LOG_LEVEL_WARN },
+    { "error", LOG_LEVEL_ERROR },
+};
+
+static void read_level_property() {
+    char value[PROPERTY_VALUE_MAX];
+    unsigned i;
+
+    if (property_get("recovery.log.level", value, "") <= 0)
+        return;
+    for (i = 0; i < sizeof(level_names) / sizeof(level_names[0]); i++) {
+        if (!strcmp(value, level_names[i].name)) {
+            log_set_level(level_names[i].level);
+            return;
+        }
+    }
+}
+
+static void *flusher_thread(void *cookie) {
+    int ticks = 0;
+    for (;;) {
+        usleep(LOG_FLUSH_MS * 1000);
+        fflush(stdout);
+        if (++ticks == LOG_LEVEL_POLL) {
+            read_level_property();
+            ticks = 0;
+        }
+    }
+    return NULL;
+}
+
+static void crash_handler(int sig) {
+    // best effort: if the lock is held elsewhere the buffer may be half
+    // written, and waiting for it could hang the crash
+    if (ftrylockfile(stdout) == 0) {
+        fflush(stdout);
+        funlockfile(stdout);
+    }
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+void log_init() {
+    static const int crash_signals[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT };
+    unsigned i;
+
+    if (log_enabled)
+        return;
+    read_level_property();
+
+    fflush(stdout);
+    if (setvbuf(stdout, log_buffer, _IOFBF, sizeof(log_buffer)) != 0) {
+        fprintf(stderr, "can't buffer the log: %s\n", strerror(errno));
+        return;
+    }
+    if (pthread_create(&flusher, NULL, flusher_thread, NULL) != 0) {
+        fprintf(stderr, "can't start log flusher: %s\n", strerror(errno));
+        setvbuf(stdout, NULL, _IONBF, 0);
+        return;
+    }
+    pthread_detach(flusher);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = crash_handler;
+    for (i = 0; i < sizeof(crash_signals) / sizeof(crash_signals[0]); i++)
+        sigaction(crash_signals[i], &sa, NULL);
+
+    log_enabled = 1;
+}
+
+void log_flush() {
+    fflush(stdout);
+}
+
+void log_set_level(int level) {
+    __atomic_store_n(&log_level, level, __ATOMIC_RELAXED);
+}
+
+int log_get_level() {
+    return __atomic_load_n(&log_level, __ATOMIC_RELAXED);
+}
+
+void log_puts(const char *msg) {
+    fputs(msg, stdout);
+}
+
+void log_printf(int level, const char *fmt, ...) {
+    va_list ap;
+
+    if (level < log_get_level())
+        return;
+
+    va_start(ap, fmt);
+    vfprintf(stdout, fmt, ap);
+    va_end(ap);
+}
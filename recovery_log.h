@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RECOVERY_LOG_H
+#define RECOVERY_LOG_H
+
+enum {
+    LOG_LEVEL_VERBOSE,
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR,
+};
+
+// Start buffering stdout for the log.  Log messages and plain printf()
+// share stdout's buffer, so they stay in order, and a background thread
+// writes it out every so often instead of once per message.  Before this
+// is called (and in the multi-call tools that never call it) stdout is
+// written as it goes.  The level is taken from the recovery.log.level
+// property ("verbose", "debug", "info", "warn" or "error"), which is
+// re-read periodically so it can be changed with setprop while running.
+void log_init();
+
+// Write everything queued so far.  Call before anything that reads the
+// log file or hands stdout to a child process, and before rebooting.
+void log_flush();
+
+void log_set_level(int level);
+int log_get_level();
+
+// Log a message if level passes the current filter.
+void log_printf(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+// Log an already formatted message regardless of the level.
+void log_puts(const char *msg);
+
+#endif  // RECOVERY_LOG_H
@@ -35,6 +35,7 @@
 #include "common.h"
 #include "cutils/android_reboot.h"
 #include "cutils/properties.h"
+#include "libcrecovery/common.h"
 #include "minui/minui.h"
 #include "recovery_ui.h"
 #include "voldclient/voldclient.h"
@@ -170,6 +171,17 @@ static double gProgressScopeDuration;
 // Set to 1 when both graphics pages are the same (except for the progress bar)
 static int gPagesIdentical = 0;
 
+// Set to 1 when the screen holds exactly what draw_screen_locked() drew, so
+// a change to the log text can be redrawn within the rows of the log alone.
+static int gScreenValid = 0;
+static int gLogTop = 0;
+static int gLogBottom = 0;
+
+// Log text changed but its redraw was deferred to progress_thread, to keep
+// bursts of ui_print() down to one flip per frame interval.
+static int gTextPending = 0;
+static double gLastFlipTime = 0;
+
 #define MENU_HEIGHT gr_get_height(gMenuIcon[MENU_BUTTON_L])
 #define MENU_CENTER (gr_get_height(gMenuIcon[MENU_BUTTON_L])/2)
 #define MENU_INCREMENT (gr_get_height(gMenuIcon[MENU_BUTTON_L])/2)
@@ -395,6 +407,9 @@ void ui_setMenuTextColor(int r, int g, int b, int a) {
 static void draw_screen_locked(void) {
     if (!ui_has_initialized)
         return;
+
+    gTextPending = 0;
+    gLogTop = gLogBottom = 0;
 	
 //ToDo: Following structure should be global
 	struct { int x; int y; int xL; int xR; } MENU_ICON[] = {
@@ -522,13 +537,22 @@ static void draw_screen_locked(void) {
             start_row = total_rows - MAX_ROWS;
 
         int r;
-        for (r = 0; r < (available_rows < MAX_ROWS ? available_rows : MAX_ROWS); r++) {
+        int shown_rows = available_rows < MAX_ROWS ? available_rows : MAX_ROWS;
+        for (r = 0; r < shown_rows; r++) {
             draw_text_line(start_row + r, text[(cur_row + r) % MAX_ROWS], 0, !isMenu, 0);
         }
+
+        // leave a row of slack on each side for fonts taller than CHAR_HEIGHT
+        gLogTop = (start_row - 1) * CHAR_HEIGHT;
+        gLogBottom = (start_row + shown_rows + 1) * CHAR_HEIGHT;
+        if (gLogTop < 0) gLogTop = 0;
+        if (gLogBottom > gr_fb_height()) gLogBottom = gr_fb_height();
     }
     
     if (show_menu)
         draw_virtualkeys_locked();
+
+    gScreenValid = 1;
 }
 
 // Redraw everything on the screen and flip the screen (make it visible).
@@ -539,6 +563,32 @@ static void update_screen_locked(void) {
 
     draw_screen_locked();
     gr_flip();
+    gLastFlipTime = now();
+}
+
+// Redraw the rows holding the log text and flip; gr_flip() then only copies
+// those scanlines.  Falls back to a full redraw if the screen was last drawn
+// by something other than draw_screen_locked().
+// Should only be called with gUpdateMutex locked.
+static void update_text_locked(void) {
+    if (!ui_has_initialized)
+        return;
+
+    if (!gScreenValid || gLogTop >= gLogBottom) {
+        update_screen_locked();
+        return;
+    }
+
+    // a clipped redraw doesn't refresh the whole progress bar, so it must
+    // not hold back the next progress update
+    struct timeval progupd = lastprogupd;
+    gr_clip(0, gLogTop, gr_fb_width(), gLogBottom - gLogTop);
+    draw_screen_locked();
+    gr_noclip();
+    lastprogupd = progupd;
+
+    gr_flip();
+    gLastFlipTime = now();
 }
 
 // Updates only the progress bar, if possible, otherwise redraws the screen.
@@ -564,6 +614,7 @@ static void update_progress_locked(void) {
         draw_progress_locked();  // Draw only the progress bar and overlays
     }
     gr_flip();
+    gLastFlipTime = now();
 }
 
 // Keeps the progress bar updated, even when the process is otherwise busy.
@@ -598,6 +649,9 @@ static void *progress_thread(void *cookie) {
 
         if (redraw) update_progress_locked();
 
+        // flush log text printed since the last frame
+        if (gTextPending) update_text_locked();
+
         pthread_mutex_unlock(&gUpdateMutex);
         double end = now();
         // minimum of 20ms delay between frames
@@ -1160,6 +1214,7 @@ void ui_init(void) {
 char *ui_copy_image(int icon, int *width, int *height, int *bpp) {
     pthread_mutex_lock(&gUpdateMutex);
     draw_background_locked(icon);
+    gScreenValid = 0;
     *width = gr_fb_width();
     *height = gr_fb_height();
     *bpp = sizeof(gr_pixel) * 8;
@@ -1254,7 +1309,7 @@ void ui_print(const char *fmt, ...) {
     va_end(ap);
 
     if (ui_log_stdout)
-        fputs(buf, stdout);
+        log_puts(buf);
 
     // This can get called before ui_init(), so be careful.
     pthread_mutex_lock(&gUpdateMutex);
@@ -1270,29 +1325,38 @@ void ui_print(const char *fmt, ...) {
             if (*ptr != '\n') text[text_row][text_col++] = *ptr;
         }
         text[text_row][text_col] = '\0';
-        update_screen_locked();
+
+        // Nothing to redraw while the log is hidden.  Otherwise draw right
+        // away if the last frame is old enough and leave bursts of prints
+        // to progress_thread.
+        if (show_text) {
+            if (now() - gLastFlipTime >= 1.0 / ui_parameters.update_fps)
+                update_text_locked();
+            else
+                gTextPending = 1;
+        }
     }
     pthread_mutex_unlock(&gUpdateMutex);
 }
 
 void ui_printlogtail(int nb_lines) {
-    char * log_data;
-    char tmp[PATH_MAX];
-    FILE * f;
-    int line=0;
+    char *log_data;
     //don't log output to recovery.log
     ui_log_stdout=0;
-    sprintf(tmp, "tail -n %d /tmp/recovery.log > /tmp/tail.log", nb_lines);
-    __system(tmp);
-    f = fopen("/tmp/tail.log", "rb");
-    if (f != NULL) {
-        while (line < nb_lines) {
-            log_data = fgets(tmp, PATH_MAX, f);
-            if (log_data == NULL) break;
-            ui_print("%s", tmp);
-            line++;
+    log_flush();
+    log_data = tail_file("/tmp/recovery.log", nb_lines);
+    if (log_data != NULL) {
+        char *line = log_data;
+        while (*line != '\0') {
+            char *next = strchr(line, '\n');
+            if (next != NULL)
+                *next++ = '\0';
+            ui_print("%s\n", line);
+            if (next == NULL)
+                break;
+            line = next;
         }
-        fclose(f);
+        free(log_data);
     }
     ui_print("Return to menu with any key.\n");
     ui_log_stdout=1;
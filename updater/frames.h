@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _UPDATER_FRAMES_H_
+#define _UPDATER_FRAMES_H_
+
+#include <limits.h>
+#include <stdint.h>
+
+// Command API v4: instead of text lines, the updater writes framed
+// commands to the command pipe.  Recovery asks for them by setting
+// COMMAND_API_ENV to "4" in the updater's environment; the version on
+// the command line stays what older updaters accept.
+#define COMMAND_API_ENV    "UPDATE_COMMAND_API"
+#define COMMAND_API_FRAMED 4
+
+// A frame is a one-byte type, the payload length in two bytes (little
+// endian), and the payload.  Types have the high bit set, which no text
+// command does, so recovery can still read the text lines that scripts
+// run by the updater echo to the same fd.  Each frame is written with
+// a single write() of at most PIPE_BUF bytes so the two never
+// interleave.
+#define FRAME_PRINT        0x81  // text for the screen, newlines included
+#define FRAME_PROGRESS     0x82  // struct frame_progress
+#define FRAME_SET_PROGRESS 0x83  // a float
+#define FRAME_COMMAND      0x84  // any other command, as its text line
+                                 // without the newline
+
+#define FRAME_HEADER_SIZE  3
+#define FRAME_MAX_PAYLOAD  (PIPE_BUF - FRAME_HEADER_SIZE)
+
+// Both ends run on the same device, so numbers are in native order.
+struct frame_progress {
+    float fraction;
+    int32_t seconds;
+};
+
+#endif
@@ -28,7 +28,7 @@
 #include <fcntl.h>
 #include <time.h>
 #include <selinux/selinux.h>
-#include <ftw.h>
+#include <pthread.h>
 #include <sys/capability.h>
 #include <sys/xattr.h>
 #include <linux/xattr.h>
@@ -371,7 +371,7 @@ Value* ShowProgressFn(const char* name, State* state, int argc, Expr* argv[]) {
     int sec = strtol(sec_str, NULL, 10);
 
     UpdaterInfo* ui = (UpdaterInfo*)(state->cookie);
-    fprintf(ui->cmd_pipe, "progress %f %d\n", frac, sec);
+    UpdaterProgress(ui, frac, sec);
 
     free(sec_str);
     return StringValue(frac_str);
@@ -389,7 +389,7 @@ Value* SetProgressFn(const char* name, State* state, int argc, Expr* argv[]) {
     double frac = strtod(frac_str, NULL);
 
     UpdaterInfo* ui = (UpdaterInfo*)(state->cookie);
-    fprintf(ui->cmd_pipe, "set_progress %f\n", frac);
+    UpdaterSetProgress(ui, frac);
 
     return StringValue(frac_str);
 }
@@ -759,94 +759,132 @@ static struct perm_parsed_args ParsePermArgs(int argc, char** args) {
     return parsed;
 }
 
+// Path for the calls on name in dirfd that have no *at() version.
+// /proc/self/fd/N resolves straight to the directory without walking
+// the rest of the tree again.
+static const char* AtPath(int dirfd, const char* name, const char* filename,
+        char* buf, size_t size)
+{
+    if (dirfd == AT_FDCWD) {
+        return name;
+    }
+    if ((size_t) snprintf(buf, size, "/proc/self/fd/%d/%s", dirfd, name) >= size) {
+        return filename;
+    }
+    return buf;
+}
+
+// Applies parsed to name in dirfd, whose current state is st, or to the
+// file open at dirfd itself if name is NULL.  filename is the full path,
+// for messages.  Changes that are already in place are skipped, so only
+// what differs is written.
 static int ApplyParsedPerms(
+        int dirfd,
+        const char* name,
         const char* filename,
         const struct stat *statptr,
-        struct perm_parsed_args parsed)
+        const struct perm_parsed_args* parsed)
 {
     int bad = 0;
+    bool chowned = false;
+    char buf[PATH_MAX];
 
     /* ignore symlinks */
     if (S_ISLNK(statptr->st_mode)) {
         return 0;
     }
 
-    if (parsed.has_uid) {
-        if (chown(filename, parsed.uid, -1) < 0) {
-            printf("ApplyParsedPerms: chown of %s to %d failed: %s\n",
-                   filename, parsed.uid, strerror(errno));
-            bad++;
-        }
-    }
+    const char* path = name != NULL ? AtPath(dirfd, name, filename, buf, sizeof(buf)) : NULL;
 
-    if (parsed.has_gid) {
-        if (chown(filename, -1, parsed.gid) < 0) {
-            printf("ApplyParsedPerms: chgrp of %s to %d failed: %s\n",
-                   filename, parsed.gid, strerror(errno));
+    uid_t uid = parsed->has_uid && statptr->st_uid != parsed->uid ? parsed->uid : (uid_t) -1;
+    gid_t gid = parsed->has_gid && statptr->st_gid != parsed->gid ? parsed->gid : (gid_t) -1;
+    if (uid != (uid_t) -1 || gid != (gid_t) -1) {
+        if ((name != NULL ? fchownat(dirfd, name, uid, gid, AT_SYMLINK_NOFOLLOW)
+                          : fchown(dirfd, uid, gid)) < 0) {
+            printf("ApplyParsedPerms: chown of %s to %d:%d failed: %s\n",
+                   filename, (int) uid, (int) gid, strerror(errno));
             bad++;
+        } else {
+            chowned = true;
         }
     }
 
-    if (parsed.has_mode) {
-        if (chmod(filename, parsed.mode) < 0) {
-            printf("ApplyParsedPerms: chmod of %s to %d failed: %s\n",
-                   filename, parsed.mode, strerror(errno));
-            bad++;
-        }
+    // dmode and fmode override mode for directories and regular files
+    bool has_mode = parsed->has_mode;
+    mode_t mode = parsed->mode;
+    if (parsed->has_dmode && S_ISDIR(statptr->st_mode)) {
+        has_mode = true;
+        mode = parsed->dmode;
     }
-
-    if (parsed.has_dmode && S_ISDIR(statptr->st_mode)) {
-        if (chmod(filename, parsed.dmode) < 0) {
-            printf("ApplyParsedPerms: chmod of %s to %d failed: %s\n",
-                   filename, parsed.dmode, strerror(errno));
-            bad++;
-        }
+    if (parsed->has_fmode && S_ISREG(statptr->st_mode)) {
+        has_mode = true;
+        mode = parsed->fmode;
     }
-
-    if (parsed.has_fmode && S_ISREG(statptr->st_mode)) {
-        if (chmod(filename, parsed.fmode) < 0) {
+    // a chown clears the setuid and setgid bits, so the mode has to be
+    // set again after one even if it looked right before
+    if (has_mode && (chowned || (statptr->st_mode & 07777) != (mode & 07777))) {
+        if ((name != NULL ? fchmodat(dirfd, name, mode, 0) : fchmod(dirfd, mode)) < 0) {
             printf("ApplyParsedPerms: chmod of %s to %d failed: %s\n",
-                   filename, parsed.fmode, strerror(errno));
+                   filename, mode, strerror(errno));
             bad++;
         }
     }
 
-    if (parsed.has_selabel) {
-        // TODO: Don't silently ignore ENOTSUP
-        if (lsetfilecon(filename, parsed.selabel) && (errno != ENOTSUP)) {
-            printf("ApplyParsedPerms: lsetfilecon of %s to %s failed: %s\n",
-                   filename, parsed.selabel, strerror(errno));
-            bad++;
+    if (parsed->has_selabel) {
+        char* current = NULL;
+        int got = path != NULL ? lgetfilecon(path, &current) : fgetfilecon(dirfd, &current);
+        if (got < 0 || strcmp(current, parsed->selabel) != 0) {
+            int ret = path != NULL ? lsetfilecon(path, parsed->selabel)
+                                   : fsetfilecon(dirfd, parsed->selabel);
+            // TODO: Don't silently ignore ENOTSUP
+            if (ret && (errno != ENOTSUP)) {
+                printf("ApplyParsedPerms: lsetfilecon of %s to %s failed: %s\n",
+                       filename, parsed->selabel, strerror(errno));
+                bad++;
+            }
         }
+        freecon(current);
     }
 
-    if (parsed.has_capabilities && S_ISREG(statptr->st_mode)) {
-        if (parsed.capabilities == 0) {
-            if ((removexattr(filename, XATTR_NAME_CAPS) == -1) && ((errno != ENODATA)
+    if (parsed->has_capabilities && S_ISREG(statptr->st_mode)) {
+        if (parsed->capabilities == 0) {
+            int ret = path != NULL ? lremovexattr(path, XATTR_NAME_CAPS)
+                                   : fremovexattr(dirfd, XATTR_NAME_CAPS);
+            if ((ret == -1) && ((errno != ENODATA)
 #ifdef RECOVERY_CANT_USE_CONFIG_EXT4_FS_XATTR
                  && (errno != EOPNOTSUPP)
 #endif
                )) {
                 // Report failure unless it's ENODATA (attribute not set)
                 printf("ApplyParsedPerms: removexattr of %s to %" PRIx64 " failed: %s\n",
-                       filename, parsed.capabilities, strerror(errno));
+                       filename, parsed->capabilities, strerror(errno));
                 bad++;
             }
         } else {
             struct vfs_cap_data cap_data;
+            struct vfs_cap_data current;
             memset(&cap_data, 0, sizeof(cap_data));
             cap_data.magic_etc = VFS_CAP_REVISION | VFS_CAP_FLAGS_EFFECTIVE;
-            cap_data.data[0].permitted = (uint32_t) (parsed.capabilities & 0xffffffff);
+            cap_data.data[0].permitted = (uint32_t) (parsed->capabilities & 0xffffffff);
             cap_data.data[0].inheritable = 0;
-            cap_data.data[1].permitted = (uint32_t) (parsed.capabilities >> 32);
+            cap_data.data[1].permitted = (uint32_t) (parsed->capabilities >> 32);
             cap_data.data[1].inheritable = 0;
-            if (setxattr(filename, XATTR_NAME_CAPS, &cap_data, sizeof(cap_data), 0) < 0
+            ssize_t len = path != NULL
+                    ? lgetxattr(path, XATTR_NAME_CAPS, &current, sizeof(current))
+                    : fgetxattr(dirfd, XATTR_NAME_CAPS, &current, sizeof(current));
+            if (len == sizeof(current) && memcmp(&current, &cap_data, sizeof(current)) == 0) {
+                return bad;
+            }
+            int ret = path != NULL
+                    ? lsetxattr(path, XATTR_NAME_CAPS, &cap_data, sizeof(cap_data), 0)
+                    : fsetxattr(dirfd, XATTR_NAME_CAPS, &cap_data, sizeof(cap_data), 0);
+            if (ret < 0
 #ifdef RECOVERY_CANT_USE_CONFIG_EXT4_FS_XATTR
                  && (errno != EOPNOTSUPP)
 #endif
                ) {
                 printf("ApplyParsedPerms: setcap of %s to %" PRIx64 " failed: %s\n",
-                       filename, parsed.capabilities, strerror(errno));
+                       filename, parsed->capabilities, strerror(errno));
                 bad++;
             }
         }
@@ -855,13 +893,157 @@ static int ApplyParsedPerms(
     return bad;
 }
 
-// nftw doesn't allow us to pass along context, so we need to use
-// global variables.  *sigh*
-static struct perm_parsed_args recursive_parsed_args;
+// set_metadata_recursive walks the tree with a few threads.  Directories
+// go on a shared queue; whichever thread takes one applies the change to
+// everything in it relative to its fd, queueing the subdirectories, and
+// to the directory itself last.
+
+#define PERM_WALK_MAX_THREADS 8
+
+struct perm_dir {
+    struct perm_dir* next;
+    char path[];
+};
+
+struct perm_walk {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct perm_dir* queue;
+    int busy;                   // threads currently working on a directory
+    const struct perm_parsed_args* parsed;
+    int bad;
+};
+
+static int QueuePermDir(struct perm_walk* w, const char* path) {
+    size_t len = strlen(path);
+    struct perm_dir* d = malloc(sizeof(*d) + len + 1);
+    if (d == NULL) {
+        printf("set_metadata_recursive: out of memory queueing %s\n", path);
+        return 1;
+    }
+    memcpy(d->path, path, len + 1);
+    pthread_mutex_lock(&w->lock);
+    d->next = w->queue;
+    w->queue = d;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    return 0;
+}
+
+static int ApplyPermsToDir(struct perm_walk* w, const char* path) {
+    int bad = 0;
+    char child[PATH_MAX];
+    struct stat st;
+    size_t len = strlen(path);
+
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    DIR* d = fd < 0 ? NULL : fdopendir(fd);
+    if (d == NULL) {
+        printf("set_metadata_recursive: can't open %s: %s\n", path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return 1;
+    }
+
+    memcpy(child, path, len);
+    child[len++] = '/';
+
+    struct dirent* de;
+    while ((de = readdir(d)) != NULL) {
+        const char* name = de->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            continue;
+        }
+        size_t name_len = strlen(name);
+        if (len + name_len >= sizeof(child)) {
+            printf("set_metadata_recursive: name too long in %s\n", path);
+            bad++;
+            continue;
+        }
+        memcpy(child + len, name, name_len + 1);
+        if (fstatat(dirfd(d), name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+            printf("set_metadata_recursive: can't stat %s: %s\n", child, strerror(errno));
+            bad++;
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            bad += QueuePermDir(w, child);
+        } else {
+            bad += ApplyParsedPerms(dirfd(d), name, child, &st, w->parsed);
+        }
+    }
+
+    if (fstat(dirfd(d), &st) == 0) {
+        bad += ApplyParsedPerms(dirfd(d), ".", path, &st, w->parsed);
+    } else {
+        printf("set_metadata_recursive: can't stat %s: %s\n", path, strerror(errno));
+        bad++;
+    }
+    closedir(d);
+    return bad;
+}
+
+static void* PermWalkThread(void* cookie) {
+    struct perm_walk* w = (struct perm_walk*) cookie;
+    int bad = 0;
 
-static int do_SetMetadataRecursive(const char* filename, const struct stat *statptr,
-        int fileflags, struct FTW *pfwt) {
-    return ApplyParsedPerms(filename, statptr, recursive_parsed_args);
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (w->queue == NULL && w->busy > 0) {
+            pthread_cond_wait(&w->cond, &w->lock);
+        }
+        if (w->queue == NULL) {
+            break;  // nothing queued and nobody left to queue more
+        }
+        struct perm_dir* d = w->queue;
+        w->queue = d->next;
+        w->busy++;
+        pthread_mutex_unlock(&w->lock);
+
+        bad += ApplyPermsToDir(w, d->path);
+        free(d);
+
+        pthread_mutex_lock(&w->lock);
+        if (--w->busy == 0 && w->queue == NULL) {
+            pthread_cond_broadcast(&w->cond);
+        }
+    }
+    w->bad += bad;
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+static int ApplyParsedPermsRecursive(const char* path, const struct perm_parsed_args* parsed) {
+    pthread_t threads[PERM_WALK_MAX_THREADS];
+    struct perm_walk w;
+    int i, nthreads = 0;
+
+    memset(&w, 0, sizeof(w));
+    pthread_mutex_init(&w.lock, NULL);
+    pthread_cond_init(&w.cond, NULL);
+    w.parsed = parsed;
+    if (QueuePermDir(&w, path) != 0) {
+        return 1;
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int want = cpus < 2 ? 2 : cpus > PERM_WALK_MAX_THREADS ? PERM_WALK_MAX_THREADS : cpus;
+    for (i = 0; i < want; i++) {
+        if (pthread_create(&threads[nthreads], NULL, PermWalkThread, &w) == 0) {
+            nthreads++;
+        }
+    }
+    if (nthreads == 0) {
+        PermWalkThread(&w);
+    }
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&w.cond);
+    pthread_mutex_destroy(&w.lock);
+    return w.bad;
 }
 
 static Value* SetMetadataFn(const char* name, State* state, int argc, Expr* argv[]) {
@@ -888,12 +1070,10 @@ static Value* SetMetadataFn(const char* name, State* state, int argc, Expr* argv
 
     struct perm_parsed_args parsed = ParsePermArgs(argc, args);
 
-    if (recursive) {
-        recursive_parsed_args = parsed;
-        bad += nftw(args[0], do_SetMetadataRecursive, 30, FTW_CHDIR | FTW_DEPTH | FTW_PHYS);
-        memset(&recursive_parsed_args, 0, sizeof(recursive_parsed_args));
+    if (recursive && S_ISDIR(sb.st_mode)) {
+        bad += ApplyParsedPermsRecursive(args[0], &parsed);
     } else {
-        bad += ApplyParsedPerms(args[0], &sb, parsed);
+        bad += ApplyParsedPerms(AT_FDCWD, args[0], args[0], &sb, &parsed);
     }
 
 done:
@@ -913,6 +1093,210 @@ done:
     return StringValue(strdup(""));
 }
 
+// One line of an fs_config table, as in the filesystem_config.txt of a
+// build's target files:
+//
+//     system/bin/run-as 0 2000 0750 selabel=u:object_r:runas_exec:s0 capabilities=0xc0
+//
+// The selabel= and capabilities= fields are optional.
+typedef struct {
+    const char* path;
+    struct perm_parsed_args perms;
+} FsConfigEntry;
+
+typedef struct {
+    struct perm_parsed_args defaults;
+    FsConfigEntry* entries;
+    int count;
+    int bad;
+} ExtractMetadata;
+
+static int CompareFsConfigEntries(const void* a, const void* b) {
+    return strcmp(((const FsConfigEntry*) a)->path, ((const FsConfigEntry*) b)->path);
+}
+
+// Parses the table in data, which the entries point into.  Returns the
+// number of entries, or -1 on a malformed line.
+static int ParseFsConfig(char* data, FsConfigEntry** entries) {
+    int count = 0;
+    int alloc = 0;
+    char* line_save;
+    char* line;
+
+    *entries = NULL;
+    for (line = strtok_r(data, "\n", &line_save); line != NULL;
+         line = strtok_r(NULL, "\n", &line_save)) {
+        char* save;
+        char* path = strtok_r(line, " \t\r", &save);
+        if (path == NULL || path[0] == '#') {
+            continue;
+        }
+        char* uid = strtok_r(NULL, " \t\r", &save);
+        char* gid = strtok_r(NULL, " \t\r", &save);
+        char* mode = strtok_r(NULL, " \t\r", &save);
+        if (mode == NULL) {
+            printf("ParseFsConfig: malformed entry for \"%s\"\n", path);
+            return -1;
+        }
+
+        FsConfigEntry e;
+        memset(&e, 0, sizeof(e));
+        while (*path == '/') {
+            path++;
+        }
+        size_t len = strlen(path);
+        while (len > 0 && path[len-1] == '/') {
+            path[--len] = '\0';
+        }
+        e.path = path;
+        e.perms.has_uid = true;
+        e.perms.uid = strtoul(uid, NULL, 10);
+        e.perms.has_gid = true;
+        e.perms.gid = strtoul(gid, NULL, 10);
+        e.perms.has_mode = true;
+        e.perms.mode = strtoul(mode, NULL, 8);
+
+        char* field;
+        while ((field = strtok_r(NULL, " \t\r", &save)) != NULL) {
+            if (strncmp(field, "selabel=", 8) == 0 && field[8] != '\0') {
+                e.perms.has_selabel = true;
+                e.perms.selabel = field + 8;
+            } else if (strncmp(field, "capabilities=", 13) == 0) {
+                e.perms.has_capabilities = true;
+                e.perms.capabilities = strtoull(field + 13, NULL, 0);
+            }
+        }
+
+        if (count == alloc) {
+            alloc = alloc ? alloc * 2 : 256;
+            FsConfigEntry* grown = realloc(*entries, alloc * sizeof(FsConfigEntry));
+            if (grown == NULL) {
+                printf("ParseFsConfig: out of memory\n");
+                return -1;
+            }
+            *entries = grown;
+        }
+        (*entries)[count++] = e;
+    }
+
+    qsort(*entries, count, sizeof(FsConfigEntry), CompareFsConfigEntries);
+    return count;
+}
+
+static bool ExtractMetadataFn(const char* path, int fd, mode_t type, void* cookie) {
+    ExtractMetadata* m = (ExtractMetadata*) cookie;
+    struct stat st;
+
+    // set_metadata() leaves symlinks alone too
+    if (type == S_IFLNK) {
+        return true;
+    }
+    if (fstat(fd, &st) < 0) {
+        printf("package_extract_dir_metadata: can't stat %s: %s\n", path, strerror(errno));
+        m->bad++;
+        return true;
+    }
+
+    struct perm_parsed_args parsed = m->defaults;
+    if (m->count > 0) {
+        FsConfigEntry key;
+        key.path = path + 1;
+        FsConfigEntry* e = bsearch(&key, m->entries, m->count, sizeof(FsConfigEntry),
+                                   CompareFsConfigEntries);
+        if (e != NULL) {
+            parsed.has_uid = true;
+            parsed.uid = e->perms.uid;
+            parsed.has_gid = true;
+            parsed.gid = e->perms.gid;
+            // the table's mode is exact, whatever the type
+            parsed.has_mode = true;
+            parsed.mode = e->perms.mode;
+            parsed.has_dmode = false;
+            parsed.has_fmode = false;
+            if (e->perms.has_selabel) {
+                parsed.has_selabel = true;
+                parsed.selabel = e->perms.selabel;
+            }
+            if (e->perms.has_capabilities) {
+                parsed.has_capabilities = true;
+                parsed.capabilities = e->perms.capabilities;
+            }
+        }
+    }
+
+    // keep going on failures, the same way set_metadata_recursive does
+    m->bad += ApplyParsedPerms(fd, NULL, path, &st, &parsed);
+    return true;
+}
+
+// package_extract_dir_metadata(package_path, destination_path, fs_config_path
+//                              [, key, value, ...])
+//   package_extract_dir() that also sets owner, mode, label and
+//   capabilities on every file and directory as it is extracted, instead
+//   of a set_metadata_recursive() pass afterwards.  Everything gets the
+//   set_metadata() style key/value pairs; entries listed in the fs_config
+//   table at fs_config_path in the package (which may be "") override
+//   them.
+Value* PackageExtractDirMetadataFn(const char* name, State* state,
+                                   int argc, Expr* argv[]) {
+    Value* result = NULL;
+    char* table = NULL;
+    ExtractMetadata m;
+    int i;
+
+    if (argc < 3 || (argc % 2) != 1) {
+        return ErrorAbort(state, "%s() expects an odd number of arguments, at least 3, got %d",
+                          name, argc);
+    }
+    char** args = ReadVarArgs(state, argc, argv);
+    if (args == NULL) return NULL;
+
+    memset(&m, 0, sizeof(m));
+    m.defaults = ParsePermArgs(argc - 2, args + 2);
+
+    ZipArchive* za = ((UpdaterInfo*)(state->cookie))->package_zip;
+    if (args[2][0] != '\0') {
+        const ZipEntry* entry = mzFindZipEntry(za, args[2]);
+        if (entry == NULL) {
+            result = ErrorAbort(state, "%s: no %s in package", name, args[2]);
+            goto done;
+        }
+        long len = mzGetZipEntryUncompLen(entry);
+        table = malloc(len + 1);
+        if (table == NULL || !mzExtractZipEntryToBuffer(za, entry, (unsigned char*) table)) {
+            result = ErrorAbort(state, "%s: can't read %s", name, args[2]);
+            goto done;
+        }
+        table[len] = '\0';
+        m.count = ParseFsConfig(table, &m.entries);
+        if (m.count < 0) {
+            result = ErrorAbort(state, "%s: can't parse %s", name, args[2]);
+            goto done;
+        }
+    }
+
+    // To create a consistent system image, never use the clock for timestamps.
+    struct utimbuf timestamp = { 1217592000, 1217592000 };  // 8/1/2008 default
+
+    bool success = mzExtractRecursiveWithMetadata(za, args[0], args[1],
+                                                  MZ_EXTRACT_FILES_ONLY, &timestamp,
+                                                  ExtractMetadataFn, &m, sehandle);
+    if (m.bad > 0) {
+        result = ErrorAbort(state, "%s: some changes failed", name);
+    } else {
+        result = StringValue(strdup(success ? "t" : ""));
+    }
+
+done:
+    for (i = 0; i < argc; ++i) {
+        free(args[i]);
+    }
+    free(args);
+    free(m.entries);
+    free(table);
+    return result;
+}
+
 Value* GetPropFn(const char* name, State* state, int argc, Expr* argv[]) {
     if (argc != 1) {
         return ErrorAbort(state, "%s() expects 1 arg, got %d", name, argc);
@@ -1116,12 +1500,8 @@ Value* ApplyPatchFn(const char* name, State* state, int argc, Expr* argv[]) {
     /* Skip files listed in the backup table */
     for (i=0; i<totalbaks; i++) {
         if (!strncmp(source_filename, bakfiles[i],PATH_MAX)) {
-            fprintf(((UpdaterInfo*)(state->cookie))->cmd_pipe,
-                "ui_print Skipping update of modified file %s\n", source_filename);
-            /* the command pipe tokenizes on \n, so issue an empty ui_print
-               to do the real line break */
-            fprintf(((UpdaterInfo*)(state->cookie))->cmd_pipe,
-                "ui_print\n");
+            UpdaterPrint((UpdaterInfo*)(state->cookie),
+                "Skipping update of modified file %s\n", source_filename);
             return StringValue(strdup("t"));
         }
     }
@@ -1248,11 +1628,10 @@ Value* UIPrintFn(const char* name, State* state, int argc, Expr* argv[]) {
 
     char* line = strtok(buffer, "\n");
     while (line) {
-        fprintf(((UpdaterInfo*)(state->cookie))->cmd_pipe,
-                "ui_print %s\n", line);
+        UpdaterPrint((UpdaterInfo*)(state->cookie), "%s", line);
         line = strtok(NULL, "\n");
     }
-    fprintf(((UpdaterInfo*)(state->cookie))->cmd_pipe, "ui_print\n");
+    UpdaterPrint((UpdaterInfo*)(state->cookie), "\n");
 
     return StringValue(buffer);
 }
@@ -1261,7 +1640,7 @@ Value* WipeCacheFn(const char* name, State* state, int argc, Expr* argv[]) {
     if (argc != 0) {
         return ErrorAbort(state, "%s() expects no args, got %d", name, argc);
     }
-    fprintf(((UpdaterInfo*)(state->cookie))->cmd_pipe, "wipe_cache\n");
+    UpdaterCommand((UpdaterInfo*)(state->cookie), "wipe_cache");
     return StringValue(strdup("t"));
 }
 
@@ -1477,6 +1856,7 @@ void RegisterInstallFunctions() {
     RegisterFunction("delete", DeleteFn);
     RegisterFunction("delete_recursive", DeleteFn);
     RegisterFunction("package_extract_dir", PackageExtractDirFn);
+    RegisterFunction("package_extract_dir_metadata", PackageExtractDirMetadataFn);
     RegisterFunction("package_extract_file", PackageExtractFileFn);
     RegisterFunction("symlink", SymlinkFn);
 
@@ -14,12 +14,19 @@
  * limitations under the License.
  */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "edify/bytecode.h"
 #include "edify/expr.h"
 #include "updater.h"
+#include "frames.h"
 #include "install.h"
 #include "minzip/Zip.h"
 
@@ -31,9 +38,243 @@
 // Where in the package we expect to find the edify script to execute.
 // (Note it's "updateR-script", not the older "update-script".)
 #define SCRIPT_NAME "META-INF/com/google/android/updater-script"
+// The same script compiled by edifyc, used when present and current.
+#define BYTECODE_NAME SCRIPT_NAME ".edc"
 
 struct selabel_handle *sehandle;
 
+// -----------------------------------------------------------------
+//   commands to recovery
+// -----------------------------------------------------------------
+
+static void WriteFrame(UpdaterInfo* ui, int type, const void* payload, size_t len) {
+    unsigned char frame[FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD];
+    frame[0] = type;
+    frame[1] = len & 0xff;
+    frame[2] = len >> 8;
+    memcpy(frame + FRAME_HEADER_SIZE, payload, len);
+
+    // one write, so nothing a child echoes to the fd lands inside it
+    ssize_t r;
+    do {
+        r = write(fileno(ui->cmd_pipe), frame, FRAME_HEADER_SIZE + len);
+    } while (r < 0 && errno == EINTR);
+}
+
+void UpdaterPrint(UpdaterInfo* ui, const char* fmt, ...) {
+    char* text;
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vasprintf(&text, fmt, ap);
+    va_end(ap);
+    if (len < 0) return;
+
+    if (ui->framed) {
+        int pos;
+        for (pos = 0; pos < len; pos += FRAME_MAX_PAYLOAD) {
+            int n = len - pos < FRAME_MAX_PAYLOAD ? len - pos : FRAME_MAX_PAYLOAD;
+            WriteFrame(ui, FRAME_PRINT, text + pos, n);
+        }
+    } else {
+        // "ui_print <text>" shows text without a line break, and a bare
+        // "ui_print" is the line break
+        char* p = text;
+        while (*p) {
+            char* nl = strchr(p, '\n');
+            int n = nl != NULL ? nl - p : (int) strlen(p);
+            if (n > 0) {
+                fprintf(ui->cmd_pipe, "ui_print %.*s\n", n, p);
+            }
+            if (nl == NULL) break;
+            fprintf(ui->cmd_pipe, "ui_print\n");
+            p = nl + 1;
+        }
+    }
+    free(text);
+}
+
+void UpdaterProgress(UpdaterInfo* ui, double frac, int sec) {
+    if (ui->framed) {
+        struct frame_progress progress;
+        progress.fraction = frac;
+        progress.seconds = sec;
+        WriteFrame(ui, FRAME_PROGRESS, &progress, sizeof(progress));
+    } else {
+        fprintf(ui->cmd_pipe, "progress %f %d\n", frac, sec);
+    }
+}
+
+void UpdaterSetProgress(UpdaterInfo* ui, double frac) {
+    if (ui->framed) {
+        float fraction = frac;
+        WriteFrame(ui, FRAME_SET_PROGRESS, &fraction, sizeof(fraction));
+    } else {
+        fprintf(ui->cmd_pipe, "set_progress %f\n", frac);
+    }
+}
+
+void UpdaterCommand(UpdaterInfo* ui, const char* fmt, ...) {
+    char line[FRAME_MAX_PAYLOAD + 1];
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (len < 0) return;
+    if (len > FRAME_MAX_PAYLOAD) len = FRAME_MAX_PAYLOAD;
+
+    if (ui->framed) {
+        WriteFrame(ui, FRAME_COMMAND, line, len);
+    } else {
+        fprintf(ui->cmd_pipe, "%s\n", line);
+    }
+}
+
+// Reads an entry into a malloc'd, NUL-terminated buffer.  When recovery
+// keeps a cache of entries (UPDATE_CACHE_DIR), it is read from there,
+// so a package flashed again isn't inflated again.
+static char* ReadEntry(ZipArchive* za, const ZipEntry* entry) {
+    char* data = malloc(entry->uncompLen + 1);
+    if (data == NULL) return NULL;
+    data[entry->uncompLen] = '\0';
+
+    const char* cache_dir = getenv("UPDATE_CACHE_DIR");
+    char path[PATH_MAX];
+    if (cache_dir != NULL &&
+        mzExtractZipEntryToCache(za, entry, cache_dir, 0600, path, sizeof(path))) {
+        int fd = open(path, O_RDONLY);
+        if (fd >= 0) {
+            ssize_t done = 0;
+            while (done < entry->uncompLen) {
+                ssize_t n = read(fd, data + done, entry->uncompLen - done);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) break;
+                done += n;
+            }
+            close(fd);
+            if (done == entry->uncompLen) return data;
+        }
+    }
+
+    if (!mzReadZipEntry(za, entry, data, entry->uncompLen)) {
+        free(data);
+        return NULL;
+    }
+    return data;
+}
+
+// Per-statement profiling, asked for by recovery with UPDATE_PROFILE in
+// the environment.  The I/O counters come from /proc/self/io, so they
+// include our own threads but not programs started by run_program().
+
+typedef struct {
+    unsigned long long rchar, wchar, syscr, syscw;
+} IoCounters;
+
+typedef struct {
+    UpdaterInfo* ui;
+    const char* script;
+    int io_fd;
+    IoCounters last;
+    int pos;            // offset in script up to which lines are counted
+    int line;
+} Profiler;
+
+static void ReadIoCounters(int fd, IoCounters* io) {
+    char buffer[512];
+    memset(io, 0, sizeof(*io));
+    if (fd < 0) return;
+    ssize_t len = pread(fd, buffer, sizeof(buffer)-1, 0);
+    if (len <= 0) return;
+    buffer[len] = '\0';
+
+    char* line = strtok(buffer, "\n");
+    while (line) {
+        unsigned long long v;
+        if (sscanf(line, "rchar: %llu", &v) == 1) io->rchar = v;
+        else if (sscanf(line, "wchar: %llu", &v) == 1) io->wchar = v;
+        else if (sscanf(line, "syscr: %llu", &v) == 1) io->syscr = v;
+        else if (sscanf(line, "syscw: %llu", &v) == 1) io->syscw = v;
+        line = strtok(NULL, "\n");
+    }
+}
+
+static const struct {
+    Function fn;
+    const char* symbol;
+} kOperatorSymbols[] = {
+    { SequenceFn, ";" }, { ConcatFn, "+" }, { EqualityFn, "==" },
+    { InequalityFn, "!=" }, { LogicalAndFn, "&&" }, { LogicalOrFn, "||" },
+    { LogicalNotFn, "!" }, { IfElseFn, "if" },
+};
+
+static bool IsOperator(const Expr* e) {
+    return strcmp(e->name, "(operator)") == 0;
+}
+
+// The first function an operator calls, depth first.
+static const Expr* FirstCall(const Expr* e) {
+    int i;
+    if (IsLiteral(e)) return NULL;
+    if (!IsOperator(e)) return e;
+    for (i = 0; i < e->argc; ++i) {
+        const Expr* call = FirstCall(e->argv[i]);
+        if (call != NULL) return call;
+    }
+    return NULL;
+}
+
+// The name a statement is reported under, as a single word for the
+// command line: the function it calls, or for an operator the operator
+// and the first function under it ("||:mount").  Spaces, control
+// characters and anything too long for recovery's parser are cleaned up.
+static void StatementName(const Expr* stmt, char* out, size_t size) {
+    const char* name = stmt->name;
+    if (IsOperator(stmt)) {
+        const char* symbol = "op";
+        const Expr* call = FirstCall(stmt);
+        size_t i;
+        for (i = 0; i < sizeof(kOperatorSymbols) / sizeof(kOperatorSymbols[0]); ++i) {
+            if (kOperatorSymbols[i].fn == stmt->fn) {
+                symbol = kOperatorSymbols[i].symbol;
+                break;
+            }
+        }
+        if (call != NULL) {
+            snprintf(out, size, "%s:%s", symbol, call->name);
+        } else {
+            snprintf(out, size, "%s", symbol);
+        }
+    } else {
+        snprintf(out, size, "%s", name);
+    }
+    char* c;
+    for (c = out; *c != '\0'; ++c) {
+        if ((unsigned char) *c <= ' ' || (unsigned char) *c >= 0x7f) *c = '_';
+    }
+    if (out[0] == '\0') snprintf(out, size, "_");
+}
+
+// Statements run one after the other, so what the counters moved since
+// the previous call is what this statement did.
+static void ProfileStatement(const Expr* stmt, long long elapsed_ns,
+                             int ok, void* cookie) {
+    Profiler* p = (Profiler*) cookie;
+    IoCounters now;
+    char name[64];      // recovery reads at most 63
+    ReadIoCounters(p->io_fd, &now);
+
+    for (; p->pos < stmt->start; ++p->pos) {
+        if (p->script[p->pos] == '\n') ++p->line;
+    }
+
+    StatementName(stmt, name, sizeof(name));
+    UpdaterCommand(p->ui, "profile %s %d %lld %llu %llu %llu %llu",
+            name, p->line, elapsed_ns,
+            now.rchar - p->last.rchar, now.wchar - p->last.wchar,
+            now.syscr - p->last.syscr, now.syscw - p->last.syscw);
+    p->last = now;
+}
+
 int main(int argc, char** argv) {
     // Various things log information to stdout or stderr more or less
     // at random.  The log file makes more sense if buffering is
@@ -47,10 +288,9 @@ int main(int argc, char** argv) {
     }
 
     char* version = argv[1];
-    if ((version[0] != '1' && version[0] != '2' && version[0] != '3') ||
-        version[1] != '\0') {
-        // We support version 1, 2, or 3.
-        fprintf(stderr, "wrong updater binary API; expected 1, 2, or 3; "
+    if (version[0] < '1' || version[0] > '4' || version[1] != '\0') {
+        // We support version 1 through 4.
+        fprintf(stderr, "wrong updater binary API; expected 1, 2, 3, or 4; "
                         "got %s\n",
                 argv[1]);
         return 2;
@@ -80,12 +320,11 @@ int main(int argc, char** argv) {
         return 4;
     }
 
-    char* script = malloc(script_entry->uncompLen+1);
-    if (!mzReadZipEntry(&za, script_entry, script, script_entry->uncompLen)) {
+    char* script = ReadEntry(&za, script_entry);
+    if (script == NULL) {
         fprintf(stderr, "failed to read script from package\n");
         return 5;
     }
-    script[script_entry->uncompLen] = '\0';
 
     // Configure edify's functions.
 
@@ -94,14 +333,35 @@ int main(int argc, char** argv) {
     RegisterDeviceExtensions();
     FinishRegistration();
 
-    // Parse the script.
+    // Load the compiled script if the package has one, else parse the
+    // text.
 
-    Expr* root;
-    int error_count = 0;
-    yy_scan_string(script);
-    int error = yyparse(&root, &error_count);
-    if (error != 0 || error_count > 0) {
-        fprintf(stderr, "%d parse errors\n", error_count);
+    Expr* root = NULL;
+    const ZipEntry* bytecode_entry = mzFindZipEntry(&za, BYTECODE_NAME);
+    if (bytecode_entry != NULL) {
+        unsigned char* bytecode = (unsigned char*) ReadEntry(&za, bytecode_entry);
+        if (bytecode != NULL) {
+            root = ReadBytecode(bytecode, bytecode_entry->uncompLen,
+                                script, script_entry->uncompLen);
+        }
+        free(bytecode);
+        if (root == NULL) {
+            fprintf(stderr, "ignoring %s; parsing the script\n", BYTECODE_NAME);
+        }
+    }
+    if (root == NULL) {
+        int error_count = 0;
+        yy_scan_string(script);
+        int error = yyparse(&root, &error_count);
+        if (error != 0 || error_count > 0) {
+            fprintf(stderr, "%d parse errors\n", error_count);
+            return 6;
+        }
+        root = FoldConstants(root);
+    }
+
+    Program* program = BuildProgram(root);
+    if (program == NULL) {
         return 6;
     }
 
@@ -122,31 +382,54 @@ int main(int argc, char** argv) {
     updater_info.cmd_pipe = cmd_pipe;
     updater_info.package_zip = &za;
     updater_info.version = atoi(version);
+    const char* command_api = getenv(COMMAND_API_ENV);
+    updater_info.framed = updater_info.version >= COMMAND_API_FRAMED ||
+            (command_api != NULL && atoi(command_api) >= COMMAND_API_FRAMED);
 
     State state;
     state.cookie = &updater_info;
     state.script = script;
     state.errmsg = NULL;
 
-    char* result = Evaluate(&state, root);
+    Profiler profiler;
+    StatementTimer timer = NULL;
+    if (getenv("UPDATE_PROFILE") != NULL) {
+        profiler.ui = &updater_info;
+        profiler.script = script;
+        profiler.io_fd = open("/proc/self/io", O_RDONLY);
+        ReadIoCounters(profiler.io_fd, &profiler.last);
+        profiler.pos = 0;
+        profiler.line = 1;
+        timer = ProfileStatement;
+    }
+
+    Value* result = RunProgram(&state, program, timer, &profiler);
+    if (timer != NULL && profiler.io_fd >= 0) {
+        close(profiler.io_fd);
+    }
+    if (result != NULL && result->type != VAL_STRING) {
+        ErrorAbort(&state, "expecting string, got value type %d", result->type);
+        FreeValue(result);
+        result = NULL;
+    }
     if (result == NULL) {
         if (state.errmsg == NULL) {
             fprintf(stderr, "script aborted (no error message)\n");
-            fprintf(cmd_pipe, "ui_print script aborted (no error message)\n");
+            UpdaterPrint(&updater_info, "script aborted (no error message)");
         } else {
             fprintf(stderr, "script aborted: %s\n", state.errmsg);
             char* line = strtok(state.errmsg, "\n");
             while (line) {
-                fprintf(cmd_pipe, "ui_print %s\n", line);
+                UpdaterPrint(&updater_info, "%s", line);
                 line = strtok(NULL, "\n");
             }
-            fprintf(cmd_pipe, "ui_print\n");
+            UpdaterPrint(&updater_info, "\n");
         }
         free(state.errmsg);
         return 7;
     } else {
-        fprintf(stderr, "script result was [%s]\n", result);
-        free(result);
+        fprintf(stderr, "script result was [%s]\n", result->data);
+        FreeValue(result);
     }
 
     if (updater_info.package_zip) {
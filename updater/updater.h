@@ -27,8 +27,19 @@ typedef struct {
     FILE* cmd_pipe;
     ZipArchive* package_zip;
     int version;
+    int framed;             // recovery reads command API v4 frames
 } UpdaterInfo;
 
+// Commands to recovery, as frames or text lines depending on what it
+// asked for.  UpdaterPrint() shows exactly the text given, so a line
+// needs its '\n'.  UpdaterCommand() sends any other command line.
+void UpdaterPrint(UpdaterInfo* ui, const char* fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+void UpdaterProgress(UpdaterInfo* ui, double frac, int sec);
+void UpdaterSetProgress(UpdaterInfo* ui, double frac);
+void UpdaterCommand(UpdaterInfo* ui, const char* fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
 extern struct selabel_handle *sehandle;
 
 #endif
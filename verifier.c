@@ -24,6 +24,8 @@
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <stdbool.h>
 
 // Look for an RSA signature embedded in the .ZIP file comment given
@@ -34,11 +36,41 @@
 // or no key matches the signature).
 
 int verify_file(const char* path, const Certificate* pKeys, unsigned int numKeys) {
-    ui_set_progress(0.0);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        LOGE("failed to open %s (%s)\n", path, strerror(errno));
+        return VERIFY_FAILURE;
+    }
+    int ret = verify_fd(fd, path, pKeys, numKeys);
+    close(fd);
+    return ret;
+}
+
+static int verify_fd_progress(int fd, const char* path, const Certificate* pKeys,
+                              unsigned int numKeys, bool show_progress);
+
+// Same as verify_file() on a package that is already open.  fd is left
+// open; path is only used in messages.
+int verify_fd(int fd, const char* path, const Certificate* pKeys, unsigned int numKeys) {
+    return verify_fd_progress(fd, path, pKeys, numKeys, true);
+}
+
+// Same as verify_fd(), but leaves the progress bar alone, for checking
+// one package while another is being installed.
+int verify_fd_silent(int fd, const char* path, const Certificate* pKeys, unsigned int numKeys) {
+    return verify_fd_progress(fd, path, pKeys, numKeys, false);
+}
+
+static int verify_fd_progress(int fd, const char* path, const Certificate* pKeys,
+                              unsigned int numKeys, bool show_progress) {
+    if (show_progress) ui_set_progress(0.0);
 
-    FILE* f = fopen(path, "rb");
+    int dup_fd = dup(fd);
+    FILE* f = dup_fd < 0 ? NULL : fdopen(dup_fd, "rb");
     if (f == NULL) {
         LOGE("failed to open %s (%s)\n", path, strerror(errno));
+        if (dup_fd >= 0)
+            close(dup_fd);
         return VERIFY_FAILURE;
     }
 
@@ -174,7 +206,7 @@ int verify_file(const char* path, const Certificate* pKeys, unsigned int numKeys
         if (need_sha256) SHA256_update(&sha256_ctx, buffer, size);
         so_far += size;
         double f = so_far / (double)signed_len;
-        if (f > frac + 0.02 || size == so_far) {
+        if (show_progress && (f > frac + 0.02 || size == so_far)) {
             ui_set_progress(f);
             frac = f;
         }
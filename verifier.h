@@ -28,6 +28,8 @@ typedef struct Certificate {
  * matches one of the given keys.  Return one of the constants below.
  */
 int verify_file(const char* path, const Certificate *pKeys, unsigned int numKeys);
+int verify_fd(int fd, const char* path, const Certificate *pKeys, unsigned int numKeys);
+int verify_fd_silent(int fd, const char* path, const Certificate *pKeys, unsigned int numKeys);
 
 Certificate* load_keys(const char* filename, int* numKeys);
 
@@ -111,6 +111,13 @@ void ui_print(const char* fmt, ...) {
 void ui_set_progress(float fraction) {
 }
 
+void log_printf(int level, const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+}
+
 int main(int argc, char **argv) {
     if (argc < 2 || argc > 4) {
         fprintf(stderr, "Usage: %s [-sha256] [-f4 | -file <keys>] <package>\n", argv[0]);